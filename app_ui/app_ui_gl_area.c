@@ -1,3 +1,4 @@
+#include "../fractal/fractal_color.h"
 #include "app_ui_utils.h"
 #include "epoxy/gl.h"
 #include <epoxy/glx.h>
@@ -19,14 +20,13 @@ static void on_realize();
 static gboolean on_render();
 static void on_resize(GtkGLArea *, int width, int height);
 static void init_program();
-static void loadPalette(int maxItr);
+static void loadPalette();
 static char *readShaderFromFile(char *filename);
 
 static GtkGLArea *glArea;
 static GLint mbLocation, juliaLocation, ratioLocation, maxItrLocation,
-    paletteLocation;
+    paletteLocation, insideLocation;
 static GLuint shaderProgram;
-static float gl_palette[3 * (PV_MAX_ITERATION_LIMIT + 1)];
 
 GtkWidget *create_gl_area() {
     glArea = GTK_GL_AREA(gtk_gl_area_new());
@@ -168,8 +168,10 @@ void glAreaUpdate() {
     glUniform3d(mbLocation, x, y, zoom);
     glUniform3d(juliaLocation, julia_x, julia_y, julia_zoom);
 
-    glUniform1i(maxItrLocation, mb_tmp_config.max_iterations);
-    loadPalette(mb_tmp_config.max_iterations);
+    glUniform1i(maxItrLocation,
+                mb_tmp_config.max_iterations < PV_MAX_ITERATION_LIMIT
+                    ? mb_tmp_config.max_iterations
+                    : PV_MAX_ITERATION_LIMIT);
 
     gtk_gl_area_queue_render(glArea);
 }
@@ -246,6 +248,7 @@ void init_program() {
     ratioLocation = glGetUniformLocation(shaderProgram, "ratio");
     maxItrLocation = glGetUniformLocation(shaderProgram, "maxItr");
     paletteLocation = glGetUniformLocation(shaderProgram, "palette");
+    insideLocation = glGetUniformLocation(shaderProgram, "inside");
 
     glUseProgram(shaderProgram);
     glDeleteShader(vertexShader);
@@ -255,21 +258,30 @@ void init_program() {
                           (void *)0);
     glEnableVertexAttribArray(0);
 
+    loadPalette();
     glAreaUpdate();
 }
 
-void loadPalette(int maxItr) {
-    double t;
-    for (int i = 0; i <= maxItr; i++) {
-        t = (double)i / maxItr;
-
-        // color algorithm (default 9.4 ; 15.9 ; 9.4)
-        gl_palette[3 * i] = 9.4 * (1.0 - t) * t * t * t;
-        gl_palette[3 * i + 1] = 15.9 * (1.0 - t) * (1.0 - t) * t * t;
-        gl_palette[3 * i + 2] = 9.4 * (1.0 - t) * (1.0 - t) * (1.0 - t) * t;
-    }
-
-    glUniform3fv(paletteLocation, PV_MAX_ITERATION_LIMIT + 1, gl_palette);
+/**
+ * Loads the palette of the engine in a texture, it does not depend on
+ * max_iterations
+ */
+void loadPalette() {
+    GLuint texture;
+    uint32_t inside = fractal_palette_inside();
+
+    glGenTextures(1, &texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_1D, texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // 0x00BBGGRR: red is the lowest byte
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, FRACTAL_PALETTE_SIZE, 0, GL_RGBA,
+                 GL_UNSIGNED_INT_8_8_8_8_REV, fractal_palette_colors());
+    glUniform1i(paletteLocation, 0);
+    glUniform3f(insideLocation, (inside & 0xFF) / 255.0f,
+                (inside >> 8 & 0xFF) / 255.0f, (inside >> 16 & 0xFF) / 255.0f);
 }
 
 char *readShaderFromFile(char *filename) {
@@ -161,6 +161,7 @@ static void btn_stop_video_clicked() { mb_video_stop(); }
 gboolean ui_on_update(UpdateData *data) {
     update_state_t state = data->state;
     float progress = data->progress;
+    int max_iterations = data->max_iterations;
     free(data);
 
     switch (state) {
@@ -170,17 +171,19 @@ gboolean ui_on_update(UpdateData *data) {
         ui_blocked = 0;
         break;
     case PHOTO_PROGRESS:
-        snprintf(stateProgressStr, STATE_PROGRESS_SIZE, _("Progress: %.2f %%"),
-                 progress * 100.0f);
+        snprintf(stateProgressStr, STATE_PROGRESS_SIZE,
+                 _("Progress: %.2f %% (%d iterations)"), progress * 100.0f,
+                 max_iterations);
         gtk_label_set_text(statusLabel, stateProgressStr);
         gtk_progress_bar_set_fraction(progressBar, progress);
         break;
     case VIDEO_PROGRESS:
         snprintf(stateProgressStr, STATE_PROGRESS_SIZE,
-                 _("Progress: %02d:%02d.%02d"),
+                 _("Progress: %02d:%02d.%02d (%d iterations)"),
                  (int)progress / 60, // minutes
                  (int)progress % 60, // seconds
-                 (int)((progress - (int)progress) * mb_framerate));
+                 (int)((progress - (int)progress) * mb_framerate),
+                 max_iterations);
         gtk_label_set_text(statusLabel, stateProgressStr);
         // gtk_progress_bar_set_fraction(progressBar, progress);
         break;
@@ -198,18 +201,20 @@ gboolean ui_on_update(UpdateData *data) {
 
 //              ASYNC CALLBACKS (from other threads)
 
-void mb_on_photo_progress(float p) {
+void mb_on_photo_progress(float p, int max_iterations) {
     UpdateData *data = malloc(sizeof(UpdateData));
     data->state = PHOTO_PROGRESS;
     data->progress = p;
+    data->max_iterations = max_iterations;
 
     g_idle_add(G_SOURCE_FUNC(ui_on_update), data);
 }
 
-void mb_on_video_progress(float p) {
+void mb_on_video_progress(float p, int max_iterations) {
     UpdateData *data = malloc(sizeof(UpdateData));
     data->state = VIDEO_PROGRESS;
     data->progress = p;
+    data->max_iterations = max_iterations;
 
     g_idle_add(G_SOURCE_FUNC(ui_on_update), data);
 }
@@ -15,6 +15,23 @@ fractal_config_t mb_tmp_config = {
     0, // width, height
     0, // max_iterations
     8, // threads
+
+    1,                   // interior_check
+    FRACTAL_RENDER_FULL, // render_mode
+
+    NULL,
+    NULL, // center_x, center_y
+
+    FRACTAL_PRECISION_AUTO, // precision
+
+    0, // smooth
+
+    0, // band_rows
+
+    0,                       // png_level
+    FRACTAL_PNG_FILTER_AUTO, // png_filter
+
+    0, // keep_iterations
 };
 
 int ui_blocked = 0;
@@ -17,8 +17,9 @@
 
 #define GIO_SETTINGS_SCHEMA "com.nicolarevelant.fractal-generator"
 
-// max iterations for preview
-#define PV_MAX_ITERATION_LIMIT 500
+// max iterations for preview, so that it stays interactive: the photos
+// and the videos use the whole max_iterations
+#define PV_MAX_ITERATION_LIMIT 20000
 #define VIDEO_FRAMERATE 60
 
 extern fractal_config_t mb_tmp_config;
@@ -32,6 +33,7 @@ typedef enum { IDLE, PHOTO_PROGRESS, VIDEO_PROGRESS, ERR_SAVE } update_state_t;
 typedef struct {
     update_state_t state;
     float progress;
+    int max_iterations; // of the current frame
 } UpdateData;
 
 typedef struct {
@@ -66,8 +68,8 @@ extern GtkWidget *create_gl_area();
 extern void glAreaUpdate();
 
 // Main UI
-extern void mb_on_photo_progress(float p);
-extern void mb_on_video_progress(float p);
+extern void mb_on_photo_progress(float p, int max_iterations);
+extern void mb_on_video_progress(float p, int max_iterations);
 extern void image_on_save(int is_success);
 extern void video_on_save(int is_success);
 
@@ -8,7 +8,8 @@ uniform dvec3 mb; // x, y, zoom
 uniform dvec3 julia; // julia_x, julia_y, julia_zoom
 uniform float ratio;  // aspect ratio, max iterations
 uniform int maxItr;
-uniform vec3 palette[501];
+uniform sampler1D palette; // colors of the engine palette
+uniform vec3 inside; // color of the points that reach maxItr
 
 void main()
 {
@@ -24,8 +25,8 @@ void main()
 	dvec2 pos = c;
 
 	int itr;
-	for (itr = 0; itr < 500; itr++) {
-		if (itr == maxItr || dot(pos, pos) > 4.0) break;
+	for (itr = 0; itr < maxItr; itr++) {
+		if (dot(pos, pos) > 4.0) break;
 		if (julia.z != 0.0)
 			// Julia
 			pos = dvec2(pos.x*pos.x - pos.y*pos.y, 2.0*pos.x*pos.y) + mb.xy;
@@ -34,5 +35,15 @@ void main()
 			pos = dvec2(pos.x*pos.x - pos.y*pos.y, 2.0*pos.x*pos.y) + c;
 	}
 
-	FragColor = vec4(palette[itr], 1.0f);
+	if (itr == maxItr) {
+		FragColor = vec4(inside, 1.0f);
+		return;
+	}
+
+	// same mapping of the engine: the palette is stretched over maxItr,
+	// or repeated if it has less colors
+	int size = textureSize(palette, 0);
+	int period = min(maxItr, size);
+	int index = int(float(itr % period) * (float(size) / float(period)));
+	FragColor = vec4(texelFetch(palette, index % size, 0).rgb, 1.0f);
 }
\ No newline at end of file
@@ -1,156 +1,826 @@
-#include <libpng16/png.h>
+#include <errno.h>
+#include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <string.h>
 
 #include "../video/video.h"
 #include "fractal.h"
+#include "fractal_cache.h"
+#include "fractal_color.h"
+#include "fractal_field.h"
+#include "fractal_kernel.h"
+#include "fractal_perturb.h"
+#include "fractal_png.h"
+#include "fractal_pool.h"
+#include "fractal_pyramid.h"
+#include "fractal_tiles.h"
 
-// for gen photos
-static int mb_gen_status;
-static int mb_gen_rows; // generated rows, for progress
-static sem_t mb_add_semaphore;
-static int use_sem;         // if true mb_thread will count the generated rows
-static uint8_t *image_data; // image data used by both libpng and ffmpeg
-static volatile int generate_more_frames;
+// rectangles smaller than this are computed without splitting them again
+#define SUBDIVISION_MIN_SIZE 6
 
-// attributes
-static int mb_width, mb_height, mb_max_iterations, use_julia;
-static double fractal_tx, fractal_ty, julia_x0, julia_y0, fractal_zoom;
-static png_color *mb_palette;
+// bits needed to tell the pixels apart (see mb_choose_precision) that
+// each precision can handle, the rest of the mantissa absorbs the
+// rounding errors of the iterations
+#define FLOAT_MAX_BITS 14
+#define DOUBLE_MAX_BITS 42
 
+// rows of a photo colored at a time if the configuration does not say
+#define DEFAULT_BAND_ROWS 64
+
+// a photo keeps the iterations of all its pixels if they take at most
+// KEEP_ITERATIONS_MAX_BYTES bytes (see keep_iterations in
+// fractal_config_t). Otherwise it has at least WINDOW_TILE_ROWS rows of
+// tiles in memory: the workers go on while the rows above are written
+#define KEEP_ITERATIONS_MAX_BYTES (512L << 20)
+#define WINDOW_TILE_ROWS 4
+
+// a pyramid is rendered a square of 2^PYRAMID_CHUNK_SHIFT x
+// 2^PYRAMID_CHUNK_SHIFT tiles of its last level at a time
+#define PYRAMID_CHUNK_SHIFT 2
+
+// a zoom video renders more frames at a time while a frame has less than
+// VIDEO_TILES_PER_CORE tiles for every core, at most VIDEO_MAX_FRAMES
+// frames taking VIDEO_FRAMES_MAX_BYTES bytes
+#define VIDEO_TILES_PER_CORE 16
+#define VIDEO_MAX_FRAMES 8
+#define VIDEO_FRAMES_MAX_BYTES (512L << 20)
+
+// encoder of the videos of fractal_video_profile: the draft is fast and
+// rough, the archive is cut in slices checked and decoded independently
+#define DRAFT_PRESET "ultrafast"
+#define DRAFT_CRF 30
+#define ARCHIVAL_SLICES 16
+
+// rows of a video frame colored in YUV by a worker at a time, even
+#define YUV_BAND_ROWS 16
+
+// size of the tile cache if fractal_set_tile_cache does not say
+#define TILE_CACHE_DEFAULT_BYTES (1L << 30)
+
+// max secondary references created by a worker in a frame
+#define PERTURB_MAX_REFERENCES 16
+
+// FRACTAL_ITERATIONS_AUTO (see mb_estimate_iterations): the view is
+// sampled on a grid of AUTO_PROBE_COLUMNS columns (at most
+// FRACTAL_KERNEL_RUN), iterated up to AUTO_PROBE_ITERATIONS at first
+#define AUTO_PROBE_COLUMNS 128
+#define AUTO_PROBE_ITERATIONS 1024
+#define AUTO_MIN_ITERATIONS 64
+#define AUTO_MAX_ITERATIONS (1 << 24)
+
+// the limit is AUTO_MARGIN times the iterations of the AUTO_QUANTILE
+// sampled pixel that escaped, since the pixels of the frame get closer
+// to the boundary than the samples
+#define AUTO_QUANTILE 0.99
+#define AUTO_MARGIN 2.0
+
+// a video keeps its limit until the estimate is AUTO_HYSTERESIS times
+// higher or lower, so that the colors do not flicker
+#define AUTO_HYSTERESIS 1.5
+
+/**
+ * Pixel counters of a worker, summed for the whole frame
+ */
 typedef struct {
-    int start_row;
-    int row_step;
-} fractal_thread_args;
+    long interior;   // short-circuited by the interior check
+    long filled;     // filled by the subdivision without iterating
+    long references; // secondary perturbation references
+    long glitched;   // perturbation glitches left unresolved
+    long resumed;    // continued from the orbits of the last photo
+    long cached;     // tiles read from the tile cache
+} fractal_counters_t;
 
+/**
+ * Pixel of a tile that reached max_iterations without being proven
+ * inside the set, with the z where it stopped
+ */
 typedef struct {
-    mb_on_progress_t on_progress;
-    mb_on_save_t on_save;
+    int index; // position in the tile
+    int start; // iterations done, 0 if z is not known (filled pixels)
+    double x, y;
+} orbit_pixel_t;
 
-    char *filename;
-    int threads;
-} mb_photo_args;
+typedef struct {
+    orbit_pixel_t *pixels;
+    int count;
+    int cached; // the tile has been read from the tile cache, without orbits
+} orbit_list_t;
 
+/**
+ * What the iterations of a frame depend on, except max_iterations
+ */
 typedef struct {
+    int width, height, use_julia;
+    double tx, ty, julia_x0, julia_y0, zoom;
+    fractal_precision_t precision;
+} fractal_view_t;
+
+/**
+ * State of an export: every context has its own buffers, palette and
+ * workers, so different contexts can export at the same time
+ */
+struct fractal_ctx {
+    // status of the export
+    pthread_mutex_t status_lock;
+    pthread_cond_t status_done; // signaled when the export ends
+    int busy;
+    volatile int stop;
+    fractal_ctx_t *parent; // video rendering its frames here, stops them too
+
+    // export arguments
     mb_on_progress_t on_progress;
     mb_on_save_t on_save;
-
     char *filename;
     int threads;
     int framerate;
     double zoom_step;
-} mb_video_args;
+    mb_video_mode_t video_mode;
+    int palette_step;
+    int video_rgb;    // the frames are colored in RGB, YUV 4:2:0 otherwise
+    int color_offset; // of the palette, for mb_colorize_yuv
+
+    // buffers of the video frames shared with the encoder, kept between
+    // the videos
+    VideoFramePool *frame_pool;
+    VideoEncoderConfig encoder; // owns its strings
+
+    // for gen photos
+    long gen_pixels; // generated pixels, for progress
+    sem_t add_semaphore;
+    struct timespec progress_time; // of the next call to on_progress
+    uint8_t *image_data; // band of a photo or frame of a video
+    int band_rows;       // rows of image_data for photos
+    int png_level;
+    fractal_png_filter_t png_filter;
+
+    // a photo with at most 256 colors has their indices in image_data,
+    // color_map gives the index of every color (see fractal_palette_index)
+    int indexed;
+    uint8_t color_map[FRACTAL_PALETTE_SIZE + 1];
+    int *iteration_data; // iterations of every pixel, colored afterwards
+    float *smooth_data;  // their fractional part, NULL without smooth
+    int recolorable;     // the iterations are a complete photo
+    int keep_iterations; // of the photos, see fractal_config_t
+
+    // rows of iteration_data and smooth_data, the row y of the frame is
+    // y % window_rows. 0 if they have the whole frame, otherwise a photo
+    // is rendered in a window of rows of tiles reused once written
+    int window_rows;
+
+    // orbits of the pixels of the last photo that did not escape, one
+    // list per tile: if only max_iterations grows they are resumed
+    orbit_list_t *orbits; // NULL if not kept
+    int orbit_tiles;
+    int orbits_max;       // max_iterations of the orbits
+    fractal_view_t orbits_view;
+    int resume; // max_iterations of the photo continued, 0 if none
+    fractal_tiles_t *tiles;
+    fractal_pool_t *pool; // render workers, reused by every frame
+
+    // tiles completed in every row of tiles, a photo is written as soon
+    // as the rows above are complete. NULL for videos
+    int *tiles_done;
+    pthread_mutex_t rows_lock;
+    pthread_cond_t rows_ready; // signaled when a row of tiles is complete
+    int rows_written;          // rows of the photo written in the file
+    pthread_cond_t rows_free;  // signaled when rows_written grows
+
+    // attributes
+    fractal_config_t config; // of the last export, with copies of the strings
+    int width, height, max_iterations, use_julia;
+
+    // position of the center of the view in the frame, (width / 2,
+    // height / 2) unless the frame is a part of a larger image
+    double center_col, center_row;
+    int auto_iterations; // estimate max_iterations for every frame
+    int estimated;       // last estimate, 0 before the first frame
+    double tx, ty, julia_x0, julia_y0, zoom;
+    int smooth;
+    fractal_palette_t palette;
+    fractal_kernel_t kernel;
+    fractal_kernel_params_t kernel_params;
+    fractal_render_mode_t render_mode;
+    fractal_precision_t config_precision, precision;
+
+    // perturbation
+    fractal_big_t center_x, center_y; // exact center of the view
+    fractal_reference_t *reference;   // orbit of the center
+    int reference_limbs, reference_iterations;
+
+    // symmetry: the pixels of the rectangle (x0, y0) - (x1, y1) are
+    // copied from (mirror_x - col, mirror_y - row) for Julia and from
+    // (col, mirror_y - row) for Mandelbrot. Empty if x0 > x1
+    int mirror_x0, mirror_y0, mirror_x1, mirror_y1;
+    int mirror_x, mirror_y;
+
+    // statistics of the last frame
+    fractal_stats_t stats;
+    fractal_counters_t frame_counters;
+    pthread_mutex_t stats_lock;
+};
 
-// private methods
-static void *photo_thread(void *void_args);
-static void *video_thread(void *void_args);
-static void *fractal_thread(void *void_args);
 /**
- * 'xc' and 'yc' are the coordinates of the cartesian plane
+ * State of a worker during a frame
  */
-static png_color mb_get_color_from_pos(double xc, double yc);
+typedef struct {
+    fractal_ctx_t *ctx;
+    fractal_counters_t counters;
+
+    // references created on glitched pixels, tried again for the next
+    // glitches since they are usually close to each other
+    fractal_reference_t *references[PERTURB_MAX_REFERENCES];
+    int reference_count;
+} fractal_worker_t;
 
 /**
- * 'x0' and 'y0' are the starting point
- * 'xc' and 'yc' are the coordinates of the cartesian plane
+ * Scattered pixels waiting to be computed together, so that the kernel
+ * still gets long runs
  */
-static png_color julia_get_color_from_pos(double x0, double y0, double xc,
-                                          double yc);
-static void mb_prepare(fractal_config_t *config);
+typedef struct {
+    double dx[FRACTAL_KERNEL_RUN], dy[FRACTAL_KERNEL_RUN]; // from the center
+    int index[FRACTAL_KERNEL_RUN]; // position in the tile
+    int count;
+} pixel_batch_t;
 
-fractal_error_t mb_video_stop() {
-    generate_more_frames = 0;
+/**
+ * Tile of a pyramid written by a worker
+ */
+typedef struct {
+    int level, col, row;
+    const uint8_t *pixels; // in RGB, a row every 'stride' bytes
+    int stride;
+} pyramid_tile_t;
+
+/**
+ * State of a pyramid export: the image under every tile of chunk_level
+ * is rendered as a frame and gives the tiles of the levels below it, the
+ * tiles above chunk_level are downsampled from the ones below
+ */
+typedef struct {
+    fractal_ctx_t *ctx;
+    fractal_pyramid_t *pyramid;
+    int width, height; // of the image
+    int chunk_level;
+
+    // the frame at the levels from the last one to chunk_level, chunk[0]
+    // is image_data
+    uint8_t *chunk[PYRAMID_CHUNK_SHIFT + 1];
+
+    // 2 x 2 tiles of the next level for every level above chunk_level
+    uint8_t **merged;
+
+    // tiles of the frame written by the workers
+    pyramid_tile_t *tiles;
+    int tile_count;
+    volatile int failed;
+} pyramid_export_t;
+
+/**
+ * What the iterations of a tile depend on, the key of the tile cache.
+ * The tiles of different frames with the same pixels have the same key
+ */
+typedef struct {
+    int32_t use_julia, precision, max_iterations, interior_check, smooth;
+    int32_t width, height; // of the tile
+    int32_t negative_x, negative_y;
+    uint32_t center_x[FRACTAL_BIG_LIMBS], center_y[FRACTAL_BIG_LIMBS];
+    double julia_x, julia_y, zoom;
+    double x, y; // of the first pixel of the tile from the center
+} tile_key_t;
+
+// tiles of every context, NULL if there is no cache
+static fractal_cache_t *mb_tile_cache;
+
+// context of the functions that do not take one
+static fractal_ctx_t *mb_default_ctx;
+static pthread_once_t mb_default_once = PTHREAD_ONCE_INIT;
+
+// private methods
+static void *photo_thread(void *void_args);
+static void *video_thread(void *void_args);
+static int mb_video_zoom(fractal_ctx_t *ctx, VideoCtx *video_ctx);
+static int mb_video_cycle(fractal_ctx_t *ctx, VideoCtx *video_ctx);
+static int mb_video_frames(fractal_ctx_t *ctx);
+static fractal_ctx_t *mb_new_frame_ctx(fractal_ctx_t *ctx);
+static void mb_free_frame_ctx(fractal_ctx_t *frame_ctx);
+static void mb_start_frame(fractal_ctx_t *frame_ctx, fractal_ctx_t *last,
+                           double zoom);
+static void *pyramid_thread(void *void_args);
+static void mb_pyramid_settings(fractal_ctx_t *ctx, char *text, size_t size);
+static int mb_pyramid_tile(pyramid_export_t *export, int level, int col,
+                           int row, uint8_t *pixels, int stride);
+static int mb_pyramid_chunk(pyramid_export_t *export, int col, int row,
+                            uint8_t *pixels, int stride);
+static void mb_pyramid_region(pyramid_export_t *export, int level, int col,
+                              int row, int *x, int *y, int *width,
+                              int *height);
+static void pyramid_encode(int worker, void *data);
+static fractal_error_t mb_begin(fractal_ctx_t *ctx, fractal_config_t *config);
+static int mb_acquire(fractal_ctx_t *ctx);
+static void mb_start(fractal_ctx_t *ctx, void *(*thread)(void *));
+static void mb_finish(fractal_ctx_t *ctx);
+static inline void render_tiles(int worker, fractal_ctx_t *ctx,
+                                int progress) __attribute__((always_inline));
+static void fractal_thread(int worker, void *data);
+static void fractal_thread_progress(int worker, void *data);
+static int mb_wait_window(fractal_ctx_t *ctx, const fractal_tile_t *tile);
+static void mb_tile_done(fractal_ctx_t *ctx, const fractal_tile_t *tile);
+static int mb_wait_tile_row(fractal_ctx_t *ctx, int row);
+static void mb_rows_written(fractal_ctx_t *ctx, int rows);
+static void mb_photo_progress(fractal_ctx_t *ctx, long total);
+static fractal_png_t *mb_open_png(fractal_ctx_t *ctx, const char *filename,
+                                  int offset);
+static int mb_write_rows(fractal_ctx_t *ctx, fractal_png_t *png, int first,
+                         int last, int offset);
+static int mb_write_pixels(fractal_ctx_t *ctx, fractal_png_t *png,
+                           const int *iterations, const float *smooth,
+                           int rows, int offset);
+static fractal_pool_t *mb_get_pool(fractal_ctx_t *ctx, int threads);
+static void mb_free_pool(fractal_ctx_t *ctx);
+static void fractal_render_tile(const fractal_tile_t *tile,
+                                fractal_worker_t *worker);
+static void tile_render_rect(const fractal_tile_t *tile, int *iterations,
+                             float *smooth, fractal_orbit_t *orbit, int x0,
+                             int y0, int x1, int y1, fractal_worker_t *worker);
+static void tile_keep_orbits(const fractal_tile_t *tile, const int *iterations,
+                             const fractal_orbit_t *orbit, int x0, int y0,
+                             int x1, int y1, fractal_worker_t *worker);
+static void tile_resume(const fractal_tile_t *tile, fractal_worker_t *worker);
+static int tile_load(const fractal_tile_t *tile, fractal_worker_t *worker);
+static void mb_store_tiles(fractal_ctx_t *ctx, int first, int last);
+static int mb_tile_key(fractal_ctx_t *ctx, const fractal_tile_t *tile,
+                       tile_key_t *key);
+static void resume_run(const fractal_tile_t *tile, orbit_list_t *list,
+                       const int *entries, int count, fractal_worker_t *worker);
+static int mb_tile_index(fractal_ctx_t *ctx, const fractal_tile_t *tile);
+static long mb_data_index(fractal_ctx_t *ctx, int x, int y);
+static void compute_pixels(fractal_worker_t *worker, const double *dx,
+                           const double *dy, int count, int *iterations,
+                           float *smooth, fractal_orbit_t *orbit);
+static void perturb_pixels(fractal_worker_t *worker, const double *dx,
+                           const double *dy, int count, int *iterations,
+                           float *smooth);
+static void tile_compute_span(const fractal_tile_t *tile, int *iterations,
+                              float *smooth, fractal_orbit_t *orbit, int row,
+                              int first_col, int last_col,
+                              fractal_worker_t *worker);
+static void batch_add(const fractal_tile_t *tile, int *iterations,
+                      float *smooth, fractal_orbit_t *orbit,
+                      pixel_batch_t *batch, int col, int row,
+                      fractal_worker_t *worker);
+static void batch_flush(int *iterations, float *smooth, fractal_orbit_t *orbit,
+                        pixel_batch_t *batch, fractal_worker_t *worker);
+static void tile_subdivide(const fractal_tile_t *tile, int *iterations,
+                           float *smooth, fractal_orbit_t *orbit,
+                           pixel_batch_t *batch, int x0, int y0, int x1,
+                           int y1, fractal_worker_t *worker);
+static int mb_prepare(fractal_ctx_t *ctx, fractal_config_t *config);
+static void mb_keep_config(fractal_ctx_t *ctx, const fractal_config_t *config);
+static void mb_keep_encoder(fractal_ctx_t *ctx,
+                            const mb_video_config_t *video_config);
+static char *mb_copy_string(const char *string);
+static void mb_set_max_iterations(fractal_ctx_t *ctx, int max_iterations);
+static void mb_prepare_frame(fractal_ctx_t *ctx);
+static void mb_select_kernel(fractal_ctx_t *ctx, const char **name);
+static void mb_prepare_reference(fractal_ctx_t *ctx);
+static void mb_estimate_iterations(fractal_ctx_t *ctx);
+static int mb_probe_iterations(fractal_ctx_t *ctx, int limit);
+static int compare_int(const void *a, const void *b);
+static fractal_precision_t mb_choose_precision(fractal_ctx_t *ctx);
+static void mb_prepare_mirror(fractal_ctx_t *ctx);
+static int mb_mirror_axis(fractal_ctx_t *ctx, int vertical, int *mirror);
+static double mb_pixel_offset(fractal_ctx_t *ctx, int vertical, int i);
+static void mb_alloc_frame(fractal_ctx_t *ctx);
+static void mb_prepare_resume(fractal_ctx_t *ctx, int recolorable);
+static fractal_view_t mb_view(fractal_ctx_t *ctx);
+static int mb_same_view(const fractal_view_t *a, const fractal_view_t *b);
+static void mb_free_orbits(fractal_ctx_t *ctx);
+static void mb_mirror_image(fractal_ctx_t *ctx, int first, int last);
+static void mb_mirror_buffer(fractal_ctx_t *ctx, void *data, int size,
+                             int first, int last);
+static void mb_colorize(fractal_ctx_t *ctx, int offset);
+static AVBufferRef *mb_color_frame(fractal_ctx_t *ctx, VideoFramePool *pool,
+                                   int offset);
+static void mb_colorize_yuv(int worker, void *data);
+static size_t mb_frame_bytes(fractal_ctx_t *ctx);
+static VideoFramePool *mb_get_frame_pool(fractal_ctx_t *ctx, size_t size);
+static void mb_update_stats(fractal_ctx_t *ctx);
+static void mb_video_stats(fractal_ctx_t *ctx, VideoCtx *video_ctx);
+static void mb_new_default_ctx();
+
+fractal_ctx_t *fractal_ctx_new() {
+    fractal_ctx_t *ctx = calloc(1, sizeof(fractal_ctx_t));
+    if (!ctx)
+        return NULL;
+
+    pthread_mutex_init(&ctx->status_lock, NULL);
+    pthread_cond_init(&ctx->status_done, NULL);
+    pthread_mutex_init(&ctx->stats_lock, NULL);
+    pthread_mutex_init(&ctx->rows_lock, NULL);
+    pthread_cond_init(&ctx->rows_ready, NULL);
+    pthread_cond_init(&ctx->rows_free, NULL);
+    return ctx;
+}
+
+void fractal_ctx_free(fractal_ctx_t *ctx) {
+    if (!ctx)
+        return;
+
+    // the export thread uses the context until it ends
+    fractal_ctx_stop(ctx);
+    pthread_mutex_lock(&ctx->status_lock);
+    while (ctx->busy)
+        pthread_cond_wait(&ctx->status_done, &ctx->status_lock);
+    pthread_mutex_unlock(&ctx->status_lock);
+
+    mb_free_pool(ctx);
+    video_frame_pool_free(ctx->frame_pool);
+    mb_keep_encoder(ctx, NULL);
+    fractal_reference_free(ctx->reference);
+    free(ctx->iteration_data);
+    free(ctx->smooth_data);
+    mb_free_orbits(ctx);
+    mb_keep_config(ctx, NULL);
+    pthread_mutex_destroy(&ctx->status_lock);
+    pthread_cond_destroy(&ctx->status_done);
+    pthread_mutex_destroy(&ctx->stats_lock);
+    pthread_mutex_destroy(&ctx->rows_lock);
+    pthread_cond_destroy(&ctx->rows_ready);
+    pthread_cond_destroy(&ctx->rows_free);
+    free(ctx);
+}
+
+fractal_error_t fractal_ctx_stop(fractal_ctx_t *ctx) {
+    if (!ctx)
+        return MB_ERROR;
+
+    ctx->stop = 1;
     return MB_OK;
 }
 
+void fractal_ctx_get_stats(fractal_ctx_t *ctx, fractal_stats_t *stats) {
+    if (!ctx || !stats)
+        return;
+
+    pthread_mutex_lock(&ctx->stats_lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->stats_lock);
+}
+
+void fractal_set_core_budget(int cores) { fractal_pool_set_budget(cores); }
+
+fractal_error_t fractal_set_tile_cache(const char *filename, long max_bytes) {
+    if (mb_tile_cache)
+        fractal_cache_close(mb_tile_cache);
+    mb_tile_cache = NULL;
+    if (!filename)
+        return MB_OK;
+
+    mb_tile_cache = fractal_cache_open(
+        filename, max_bytes > 0 ? max_bytes : TILE_CACHE_DEFAULT_BYTES,
+        sizeof(tile_key_t),
+        2 * sizeof(int) * FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE);
+    return mb_tile_cache ? MB_OK : MB_ERROR;
+}
+
+void fractal_get_cache_stats(fractal_cache_stats_t *stats) {
+    fractal_cache_stats_t empty = {0};
+
+    if (!mb_tile_cache) {
+        *stats = empty;
+        return;
+    }
+    pthread_mutex_lock(&mb_tile_cache->lock);
+    stats->hits = mb_tile_cache->hits;
+    stats->misses = mb_tile_cache->misses;
+    stats->evictions = mb_tile_cache->evictions;
+    stats->tiles = mb_tile_cache->count;
+    stats->capacity = mb_tile_cache->capacity;
+    pthread_mutex_unlock(&mb_tile_cache->lock);
+}
+
+fractal_error_t mb_video_stop() {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_stop(mb_default_ctx);
+}
+
+void fractal_get_stats(fractal_stats_t *stats) {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    fractal_ctx_get_stats(mb_default_ctx, stats);
+}
+
+const char *fractal_precision_name(fractal_precision_t precision) {
+    switch (precision) {
+    case FRACTAL_PRECISION_FLOAT:
+        return "float";
+    case FRACTAL_PRECISION_DOUBLE:
+        return "double";
+    case FRACTAL_PRECISION_DOUBLE_DOUBLE:
+        return "double-double";
+    case FRACTAL_PRECISION_PERTURBATION:
+        return "perturbation";
+    default:
+        return "auto";
+    }
+}
+
+void fractal_video_profile(mb_video_config_t *video_config,
+                           mb_video_profile_t profile) {
+    video_config->codec = MB_VIDEO_CODEC_HEVC;
+    video_config->preset = video_config->tune = NULL;
+    video_config->crf = video_config->gop = 0;
+    video_config->encoder_threads = video_config->slices = 0;
+
+    switch (profile) {
+    case MB_VIDEO_PROFILE_DRAFT:
+        video_config->codec = MB_VIDEO_CODEC_H264;
+        video_config->preset = DRAFT_PRESET;
+        video_config->crf = DRAFT_CRF;
+        break;
+    case MB_VIDEO_PROFILE_ARCHIVAL:
+        // every frame can be decoded on its own
+        video_config->codec = MB_VIDEO_CODEC_FFV1;
+        video_config->gop = 1;
+        video_config->slices = ARCHIVAL_SLICES;
+        break;
+    default:
+        break;
+    }
+}
+
 extern fractal_error_t fractal_begin_photo(fractal_config_t *config,
                                            char *filename,
                                            mb_on_progress_t on_progress,
                                            mb_on_save_t on_save) {
-    if (!config || !filename || !on_save)
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_begin_photo(mb_default_ctx, config, filename,
+                                   on_progress, on_save);
+}
+
+fractal_error_t fractal_ctx_begin_photo(fractal_ctx_t *ctx,
+                                        fractal_config_t *config,
+                                        char *filename,
+                                        mb_on_progress_t on_progress,
+                                        mb_on_save_t on_save) {
+    if (!ctx || !config || !filename || !on_save)
         return MB_ERROR;
 
-    if (mb_gen_status)
-        return MB_EXEC;
-    mb_gen_status = 1;
-    mb_prepare(config);
+    fractal_error_t result = mb_begin(ctx, config);
+    if (result != MB_OK)
+        return result;
 
-    pthread_t pid;
-    mb_photo_args *mb_args = malloc(sizeof(mb_photo_args));
-    mb_args->on_progress = on_progress;
-    mb_args->on_save = on_save;
-    mb_args->filename = filename;
-    mb_args->threads = config->threads;
-    pthread_create(&pid, NULL, photo_thread, mb_args);
-    on_progress(0);
+    ctx->on_progress = on_progress;
+    ctx->on_save = on_save;
+    ctx->filename = filename;
+    if (on_progress)
+        on_progress(0, ctx->auto_iterations ? 0 : ctx->max_iterations);
+    mb_start(ctx, photo_thread);
 
     return MB_OK;
 }
 
-static void *photo_thread(void *void_args) {
-    mb_photo_args *mb_args = void_args;
-    mb_on_progress_t on_progress = mb_args->on_progress;
-    mb_on_save_t on_save = mb_args->on_save;
-    char *filename = mb_args->filename;
-    int mb_threads = mb_args->threads;
-    free(mb_args);
-
-    fractal_thread_args **thread_args = malloc(sizeof(void *) * mb_threads);
-    pthread_t *thread_ids = malloc(sizeof(pthread_t) * mb_threads);
-    use_sem = 0;
-    if (on_progress) {
-        sem_init(&mb_add_semaphore, 0, 1);
-        mb_gen_rows = 0;
-        use_sem = 1;
-    }
-
-    png_image image = {0};
-    image.format = PNG_FORMAT_RGB;
-    image.version = PNG_IMAGE_VERSION;
-    image.width = mb_width;
-    image.height = mb_height;
-    image_data = malloc(PNG_IMAGE_SIZE(image));
-
-    int creation_result;
-    for (int i = 0; i < mb_threads; i++) {
-        thread_args[i] = malloc(sizeof(fractal_thread_args));
-        thread_args[i]->start_row = i;
-        thread_args[i]->row_step = mb_threads;
-        creation_result = pthread_create(thread_ids + i, NULL, fractal_thread,
-                                         thread_args[i]);
-        if (creation_result) {
-            fprintf(stderr, "ERROR: Cannot create threads\n");
-            exit(creation_result);
+fractal_error_t fractal_recolor_photo(int palette_offset, char *filename) {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_recolor_photo(mb_default_ctx, palette_offset, filename);
+}
+
+fractal_error_t fractal_ctx_recolor_photo(fractal_ctx_t *ctx,
+                                          int palette_offset, char *filename) {
+    if (!ctx || !filename)
+        return MB_ERROR;
+    if (!mb_acquire(ctx))
+        return MB_EXEC;
+
+    fractal_error_t result = MB_ERROR;
+    fractal_png_t *png = NULL;
+    if (ctx->recolorable)
+        png = mb_open_png(ctx, filename, palette_offset);
+    if (png) {
+        int written =
+            !mb_write_rows(ctx, png, 0, ctx->height - 1, palette_offset);
+        if (!fractal_png_close(png, written))
+            result = MB_OK;
+        free(ctx->image_data);
+    }
+
+    mb_finish(ctx);
+    return result;
+}
+
+fractal_error_t fractal_save_field(int level, char *filename) {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_save_field(mb_default_ctx, level, filename);
+}
+
+fractal_error_t fractal_ctx_save_field(fractal_ctx_t *ctx, int level,
+                                       char *filename) {
+    if (!ctx || !filename)
+        return MB_ERROR;
+    if (!mb_acquire(ctx))
+        return MB_EXEC;
+
+    // the field is rendered again with the max_iterations it has used
+    fractal_error_t result = MB_ERROR;
+    fractal_config_t config = ctx->config;
+    config.max_iterations = ctx->max_iterations;
+    if (ctx->recolorable &&
+        !fractal_field_save(filename, &config, ctx->precision,
+                            ctx->iteration_data, ctx->smooth_data, level))
+        result = MB_OK;
+
+    mb_finish(ctx);
+    return result;
+}
+
+fractal_error_t fractal_load_field(char *filename) {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_load_field(mb_default_ctx, filename);
+}
+
+fractal_error_t fractal_ctx_load_field(fractal_ctx_t *ctx, char *filename) {
+    fractal_field_t *field;
+    int failed = 1;
+    long start;
+
+    if (!ctx || !filename)
+        return MB_ERROR;
+    if (!mb_acquire(ctx))
+        return MB_EXEC;
+
+    field = fractal_field_open(filename);
+    if (field) {
+        // the last photo is replaced even if the field is corrupted
+        ctx->recolorable = 0;
+        failed = mb_prepare(ctx, &field->config);
+    }
+    if (!failed) {
+        ctx->threads = field->config.threads;
+        ctx->precision = field->precision;
+        mb_free_orbits(ctx);
+        mb_alloc_frame(ctx);
+        for (int i = 0; i < field->chunk_count && !failed; i++) {
+            start = (long)i * field->chunk_rows * ctx->width;
+            failed = fractal_field_read(
+                field, i, ctx->iteration_data + start,
+                ctx->smooth_data ? ctx->smooth_data + start : NULL);
         }
+        ctx->recolorable = !failed;
+    }
+
+    fractal_field_close(field);
+    mb_finish(ctx);
+    return failed ? MB_ERROR : MB_OK;
+}
+
+fractal_error_t fractal_field_to_png(char *field_filename, int palette_offset,
+                                     char *png_filename) {
+    fractal_field_t *field;
+    fractal_ctx_t *ctx;
+    fractal_png_t *png = NULL;
+    int *iterations = NULL;
+    float *smooth = NULL;
+    int failed, rows;
+    long start;
+
+    if (!field_filename || !png_filename)
+        return MB_ERROR;
+    field = fractal_field_open(field_filename);
+    if (!field)
+        return MB_ERROR;
+
+    // a context of its own gives the palette and the PNG workers
+    ctx = fractal_ctx_new();
+    if (ctx && !mb_prepare(ctx, &field->config)) {
+        ctx->threads = field->config.threads;
+        png = mb_open_png(ctx, png_filename, palette_offset);
+    }
+    failed = !png;
+    if (png && field->level) {
+        iterations =
+            malloc(sizeof(int) * field->chunk_rows * field->config.width);
+        if (ctx->smooth)
+            smooth = malloc(sizeof(float) * field->chunk_rows *
+                            field->config.width);
+    }
+
+    // without compression the rows are colored in the mapping of the file
+    for (int i = 0; i < field->chunk_count && !failed; i++) {
+        rows = fractal_field_chunk_rows(field, i);
+        start = (long)i * field->chunk_rows * field->config.width;
+        if (field->level)
+            failed = fractal_field_read(field, i, iterations, smooth) ||
+                     mb_write_pixels(ctx, png, iterations, smooth, rows,
+                                     palette_offset);
+        else
+            failed = mb_write_pixels(
+                ctx, png, field->iterations + start,
+                field->smooth ? field->smooth + start : NULL, rows,
+                palette_offset);
+    }
+
+    if (png) {
+        failed = fractal_png_close(png, !failed) || failed;
+        free(ctx->image_data);
+    }
+    free(iterations);
+    free(smooth);
+    fractal_ctx_free(ctx);
+    fractal_field_close(field);
+    return failed ? MB_ERROR : MB_OK;
+}
+
+static void *photo_thread(void *void_args) {
+    fractal_ctx_t *ctx = void_args;
+    mb_on_progress_t on_progress = ctx->on_progress;
+    mb_on_save_t on_save = ctx->on_save;
+    int recolorable = ctx->recolorable, first, last, failed = 0, window;
+    long bytes = (long)ctx->width * ctx->height *
+                 (sizeof(int) + (ctx->smooth ? sizeof(float) : 0));
+
+    // the iterations are complete again only if the photo is
+    ctx->recolorable = 0;
+    ctx->tiles = fractal_tiles_new(ctx->width, ctx->height, FRACTAL_TILE_SIZE,
+                                   ctx->threads);
+    fractal_pool_t *pool = mb_get_pool(ctx, ctx->threads);
+
+    // the window has at least the rows of a band, in rows of tiles
+    ctx->window_rows = 0;
+    if (ctx->keep_iterations < 0 ||
+        (!ctx->keep_iterations && bytes > KEEP_ITERATIONS_MAX_BYTES)) {
+        window = (ctx->band_rows + FRACTAL_TILE_SIZE - 1) / FRACTAL_TILE_SIZE;
+        window = window < WINDOW_TILE_ROWS ? WINDOW_TILE_ROWS : window;
+        if ((long)window * FRACTAL_TILE_SIZE < ctx->height)
+            ctx->window_rows = window * FRACTAL_TILE_SIZE;
     }
+    mb_prepare_frame(ctx);
 
+    // max_iterations is known, the photo can be indexed
+    fractal_png_t *png = mb_open_png(ctx, ctx->filename, 0);
+    if (!png) {
+        fractal_tiles_free(ctx->tiles);
+        ctx->window_rows = 0;
+        mb_finish(ctx);
+        on_save(0);
+        return NULL;
+    }
     if (on_progress) {
-        const struct timespec delay = {0, PROGRESS_DELAY_NANOSECONDS};
-        while (mb_gen_rows < mb_height) {
-            on_progress((float)mb_gen_rows / mb_height);
-            nanosleep(&delay, NULL);
-        }
+        sem_init(&ctx->add_semaphore, 0, 1);
+        ctx->gen_pixels = 0;
     }
 
-    for (int i = 0; i < mb_threads; i++) {
-        pthread_join(thread_ids[i], NULL);
-        free(thread_args[i]);
+    ctx->tiles_done = calloc(ctx->tiles->rows, sizeof(int));
+    ctx->rows_written = 0;
+    mb_prepare_resume(ctx, recolorable);
+    clock_gettime(CLOCK_REALTIME, &ctx->progress_time);
+    fractal_pool_start(pool,
+                       on_progress ? fractal_thread_progress : fractal_thread,
+                       ctx);
+
+    // every row of tiles is written while the next ones are rendered, the
+    // mirrored rows come after their sources
+    for (int row = 0; row < ctx->tiles->rows && !ctx->stop && !failed;) {
+        if (!mb_wait_tile_row(ctx, row))
+            continue;
+
+        first = row++ * FRACTAL_TILE_SIZE;
+        last = first + FRACTAL_TILE_SIZE - 1;
+        last = last < ctx->height ? last : ctx->height - 1;
+        mb_mirror_image(ctx, first, last);
+        mb_store_tiles(ctx, first, last);
+        failed = mb_write_rows(ctx, png, first, last, 0);
+        mb_rows_written(ctx, last + 1);
     }
 
-    free(thread_ids);
-    free(thread_args);
+    // the photo cannot be saved any more, the workers stop instead of
+    // rendering the rest of the tiles once the window is free
+    if (failed)
+        ctx->stop = 1;
+    mb_rows_written(ctx, ctx->height);
+    fractal_pool_wait(pool);
+
+    mb_update_stats(ctx);
+    fractal_tiles_free(ctx->tiles);
+    free(ctx->tiles_done);
+    ctx->tiles_done = NULL;
     if (on_progress)
-        sem_destroy(&mb_add_semaphore);
+        sem_destroy(&ctx->add_semaphore);
 
-    int success =
-        png_image_write_to_file(&image, filename, 0, image_data, 0, NULL);
-    if (!success) {
-        fprintf(stderr, "Libpng error: %s\n", image.message);
+    // a stopped photo is incomplete, it is not saved. Otherwise the
+    // iterations are kept for fractal_ctx_recolor_photo if they are all
+    // in memory, the window is freed
+    ctx->recolorable = !ctx->stop && !ctx->window_rows;
+    int success = !fractal_png_close(png, !ctx->stop);
+    free(ctx->image_data);
+    if (ctx->window_rows) {
+        free(ctx->iteration_data);
+        free(ctx->smooth_data);
+        ctx->iteration_data = NULL;
+        ctx->smooth_data = NULL;
+        ctx->window_rows = 0;
     }
-    png_image_free(&image);
-    free(image_data);
 
-    mb_gen_status = 0;
+    mb_finish(ctx);
     on_save(success);
 
     return NULL;
@@ -161,222 +831,2186 @@ fractal_error_t fractal_begin_video(fractal_config_t *config,
                                     char *filename,
                                     mb_on_progress_t on_progress,
                                     mb_on_save_t on_save) {
-    if (!config || !video_config || !filename || !on_progress || !on_save)
-        return MB_ERROR;
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_begin_video(mb_default_ctx, config, video_config,
+                                   filename, on_progress, on_save);
+}
 
-    if (mb_gen_status)
-        return MB_EXEC;
-    mb_gen_status = 1;
-    mb_prepare(config);
+fractal_error_t fractal_ctx_begin_video(fractal_ctx_t *ctx,
+                                        fractal_config_t *config,
+                                        mb_video_config_t *video_config,
+                                        char *filename,
+                                        mb_on_progress_t on_progress,
+                                        mb_on_save_t on_save) {
+    if (!ctx || !config || !video_config || !filename || !on_progress ||
+        !on_save)
+        return MB_ERROR;
 
-    fractal_zoom = video_config->zoom_start * config->height;
-    generate_more_frames = 1;
+    fractal_error_t result = mb_begin(ctx, config);
+    if (result != MB_OK)
+        return result;
 
-    pthread_t pid;
-    mb_video_args *mb_args = malloc(sizeof(mb_video_args));
-    mb_args->on_progress = on_progress;
-    mb_args->on_save = on_save;
-    mb_args->filename = filename;
-    mb_args->threads = config->threads;
-    mb_args->framerate = video_config->frame_rate;
-    mb_args->zoom_step = video_config->zoom_step;
-    pthread_create(&pid, NULL, video_thread, mb_args);
-    on_progress(0);
+    ctx->zoom = video_config->zoom_start * config->height;
+    ctx->on_progress = on_progress;
+    ctx->on_save = on_save;
+    ctx->filename = filename;
+    ctx->framerate = video_config->frame_rate;
+    ctx->zoom_step = video_config->zoom_step;
+    ctx->video_mode = video_config->mode;
+    ctx->palette_step =
+        video_config->palette_step > 0 ? video_config->palette_step : 1;
+    ctx->video_rgb = video_config->rgb_frames;
+    mb_keep_encoder(ctx, video_config);
+    on_progress(0, ctx->auto_iterations ? 0 : ctx->max_iterations);
+    mb_start(ctx, video_thread);
 
     return MB_OK;
 }
 
 static void *video_thread(void *void_args) {
-    mb_video_args *mb_args = void_args;
-    mb_on_progress_t on_progress = mb_args->on_progress;
-    mb_on_save_t on_save = mb_args->on_save;
-    char *filename = mb_args->filename;
-    int mb_threads = mb_args->threads;
-    int mb_framerate = mb_args->framerate;
-    double mb_zoom_step = mb_args->zoom_step;
-    free(mb_args);
+    fractal_ctx_t *ctx = void_args;
+    mb_on_save_t on_save = ctx->on_save;
+    int success;
+
+    if (!mb_get_frame_pool(ctx, mb_frame_bytes(ctx))) {
+        mb_finish(ctx);
+        on_save(0);
+        return NULL;
+    }
 
     char *video_title = malloc(1024);
     snprintf(video_title, 1024,
-             "Fractal cartesian coordinates: (%.4lf , %.4lf)", fractal_tx,
-             fractal_ty);
+             "Fractal cartesian coordinates: (%.4lf , %.4lf)", ctx->tx,
+             ctx->ty);
     AVDictionary *metadata = NULL;
     av_dict_set(&metadata, "title", video_title, 0);
     av_dict_set(&metadata, "copyright", "Nicola Revelant", 0);
     free(video_title);
 
     VideoCtx *video_ctx =
-        video_ctx_new(NULL, filename, mb_width, mb_height, mb_framerate,
-                      AV_PIX_FMT_RGB24, metadata);
+        video_ctx_new(NULL, ctx->filename, ctx->width, ctx->height,
+                      ctx->framerate,
+                      ctx->video_rgb ? AV_PIX_FMT_RGB24 : VIDEO_PIX_FMT,
+                      &ctx->encoder, metadata);
 
     if (!video_ctx) {
+        mb_finish(ctx);
         on_save(0);
         return NULL;
     }
-    image_data = malloc(mb_width * mb_height * 3);
+    ctx->recolorable = 0;
+    mb_free_orbits(ctx);
+
+    if (ctx->video_mode == MB_VIDEO_PALETTE_CYCLE)
+        success = mb_video_cycle(ctx, video_ctx);
+    else
+        success = mb_video_zoom(ctx, video_ctx);
+
+#ifdef DEBUG
+    fprintf(stderr,
+            " [DD] Encoder queue: %.2f frames, render waited %.2f s, "
+            "encoder waited %.2f s\n",
+            ctx->stats.queue_depth, ctx->stats.render_wait,
+            ctx->stats.encode_wait);
+    fprintf(stderr, " [DD] Frame buffers: %ld allocated, %ld reused\n",
+            ctx->stats.frame_buffers_allocated,
+            ctx->stats.frame_buffers_reused);
+#endif
+
+    // flush the stream and save the file
+    if (video_ctx_free(video_ctx))
+        success = 0;
+
+    mb_finish(ctx);
+    on_save(success);
+
+    return NULL;
+}
+
+/**
+ * Renders the frames of a zoom video, several at a time when a frame is
+ * too small to keep every core busy (see mb_video_frames): the frame n
+ * is rendered by frames[n % count] and is started 'count' frames before
+ * it is sent. The frames are prepared and sent in order and share the
+ * reference orbit of 'ctx', so the zooms, max_iterations and reference
+ * orbits do not depend on 'count'. Returns 0 if the video cannot be
+ * encoded or the frame contexts cannot be allocated
+ */
+static int mb_video_zoom(fractal_ctx_t *ctx, VideoCtx *video_ctx) {
+    int count = mb_video_frames(ctx), started = 0;
+    int stride = ctx->video_rgb ? ctx->width * 3 : ctx->width;
+    fractal_ctx_t **frames = calloc(count, sizeof(fractal_ctx_t *));
+    fractal_ctx_t *frame_ctx, *last = ctx;
+    double zoom = ctx->zoom;
+    int pts, success = 1;
+    AVBufferRef *buffer;
 
-    int stride = mb_width * 3;
-    fractal_thread_args **thread_args = malloc(sizeof(void *) * mb_threads);
-    pthread_t *thread_ids = malloc(sizeof(pthread_t) * mb_threads);
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Frames rendered at a time: %d\n", count);
+#endif
 
-    for (int i = 0; i < mb_threads; i++) {
-        thread_args[i] = malloc(sizeof(fractal_thread_args));
+    if (!frames)
+        return 0;
+    for (int i = 0; i < count && success; i++) {
+        frames[i] = mb_new_frame_ctx(ctx);
+        success = frames[i] != NULL;
+    }
+    for (; success && started < count && !ctx->stop;
+         started++, zoom *= ctx->zoom_step) {
+        mb_start_frame(frames[started], last, zoom);
+        last = frames[started];
     }
 
-    use_sem = 0;
-    int creation_result;
-    while (generate_more_frames) {
-        for (int i = 0; i < mb_threads; i++) {
-            thread_args[i]->start_row = i;
-            thread_args[i]->row_step = mb_threads;
-            creation_result = pthread_create(thread_ids + i, NULL,
-                                             fractal_thread, thread_args[i]);
-            if (creation_result) {
-                fprintf(stderr, "ERROR: Cannot create threads\n");
-                exit(creation_result);
-            }
-        }
+    for (int frame = 0; success && !ctx->stop; frame++) {
+        frame_ctx = frames[frame % count];
+        fractal_pool_wait(frame_ctx->pool);
+        if (ctx->stop)
+            break; // the workers may have left the frame incomplete
 
-        for (int i = 0; i < mb_threads; i++) {
-            pthread_join(thread_ids[i], NULL);
-        }
+        mb_mirror_image(frame_ctx, 0, ctx->height - 1);
+        mb_update_stats(frame_ctx);
+        mb_store_tiles(frame_ctx, 0, ctx->height - 1);
+        buffer = mb_color_frame(frame_ctx, ctx->frame_pool, 0);
+        pthread_mutex_lock(&ctx->stats_lock);
+        ctx->stats = frame_ctx->stats;
+        pthread_mutex_unlock(&ctx->stats_lock);
+        ctx->max_iterations = frame_ctx->max_iterations;
 
-        int pts = video_send_frame(video_ctx, image_data, stride);
+        // the frame is encoded while the next ones are rendered, without
+        // copying its buffer
+        pts = buffer ? video_send_buffer(video_ctx, buffer, stride) : -1;
         if (pts < 0) {
-            on_save(0);
-            return NULL;
+            success = 0;
+            break;
         }
+        mb_video_stats(ctx, video_ctx);
+        ctx->on_progress((float)pts / ctx->framerate, ctx->max_iterations);
 
-        on_progress((float)pts / mb_framerate);
-        fractal_zoom *= mb_zoom_step;
+        mb_start_frame(frame_ctx, last, zoom);
+        last = frame_ctx;
+        zoom *= ctx->zoom_step;
     }
 
-    // flush the stream and save the file
-    video_ctx_free(video_ctx);
+    // the frames still rendered are no longer needed
+    ctx->stop = 1;
+    for (int i = 0; i < count; i++)
+        mb_free_frame_ctx(frames[i]);
+    free(frames);
+    return success;
+}
 
-    for (int i = 0; i < mb_threads; i++) {
-        free(thread_args[i]);
-    }
+/**
+ * Renders the first frame of a palette cycle and colors it again and
+ * again with the palette moved by palette_step colors. Returns 0 if the
+ * video cannot be encoded
+ */
+static int mb_video_cycle(fractal_ctx_t *ctx, VideoCtx *video_ctx) {
+    int stride = ctx->video_rgb ? ctx->width * 3 : ctx->width;
+    int success = 1, pts;
+    AVBufferRef *buffer;
 
-    free(thread_ids);
-    free(thread_args);
-    free(image_data);
+    mb_alloc_frame(ctx);
+    ctx->tiles = fractal_tiles_new(ctx->width, ctx->height, FRACTAL_TILE_SIZE,
+                                   ctx->threads);
+    fractal_pool_t *pool = mb_get_pool(ctx, ctx->threads);
 
-    mb_gen_status = 0;
-    on_save(1);
+    // wake up the workers, they sleep again when the frame is done
+    mb_prepare_frame(ctx);
+    fractal_tiles_reset(ctx->tiles);
+    fractal_pool_run(pool, fractal_thread, ctx);
+    if (!ctx->stop) {
+        mb_mirror_image(ctx, 0, ctx->height - 1);
+        mb_update_stats(ctx);
+        mb_store_tiles(ctx, 0, ctx->height - 1);
+    }
 
-    return NULL;
-}
+    // nothing is sent if the workers have left the frame incomplete
+    for (int frame = 0; !ctx->stop; frame++) {
+        buffer = mb_color_frame(ctx, ctx->frame_pool,
+                                frame * ctx->palette_step);
 
-static void *fractal_thread(void *void_args) {
-    fractal_thread_args *tArgs = void_args;
-    int start_row = tArgs->start_row, row_step = tArgs->row_step;
-    double xc, yc;
-    double halfWidth = mb_width / 2.0, halfHeight = mb_height / 2.0;
-    int data_index;
-    png_color color;
-
-    // scan pixels
-    for (int row = start_row, col; row < mb_height; row += row_step) {
-        for (col = 0; col < mb_width; col++) {
-
-            xc = fractal_tx + (col - halfWidth) / fractal_zoom;
-            yc = fractal_ty - (row - halfHeight) / fractal_zoom;
-
-            if (use_julia)
-                color = julia_get_color_from_pos(julia_x0, julia_y0, xc, yc);
-            else
-                color = mb_get_color_from_pos(xc, yc);
-            data_index = 3 * (row * mb_width + col);
-            image_data[data_index] = color.red;
-            image_data[data_index + 1] = color.green;
-            image_data[data_index + 2] = color.blue;
-        }
-        if (use_sem) {
-            sem_wait(&mb_add_semaphore);
-            mb_gen_rows++;
-            sem_post(&mb_add_semaphore);
+        // the frame is encoded while the next one is colored in another
+        // buffer
+        pts = buffer ? video_send_buffer(video_ctx, buffer, stride) : -1;
+        if (pts < 0) {
+            success = 0;
+            break;
         }
+        mb_video_stats(ctx, video_ctx);
+        ctx->on_progress((float)pts / ctx->framerate, ctx->max_iterations);
+
+        // the next frame would be the first one again
+        if ((long)(frame + 1) * ctx->palette_step >= FRACTAL_PALETTE_SIZE)
+            break;
     }
 
-    return NULL;
+    // the run has been stopped, the workers are no longer needed
+    mb_free_pool(ctx);
+    fractal_tiles_free(ctx->tiles);
+    ctx->image_data = NULL;
+    free(ctx->iteration_data);
+    free(ctx->smooth_data);
+    ctx->iteration_data = NULL;
+    ctx->smooth_data = NULL;
+    return success;
 }
 
-static png_color mb_get_color_from_pos(double xc, double yc) {
-    // 'x', 'y', 'xx' and 'yy' are calculation variables
-    double x = xc, y = yc, xx, yy;
-    int iterations = 0;
+/**
+ * Frames of a zoom video rendered at a time: one while a frame has at
+ * least VIDEO_TILES_PER_CORE tiles for every core of the budget, more
+ * for smaller frames. With more than a core there are at least 2, so the
+ * frame colored and sent overlaps with the next one. The buffers of the
+ * frames take at most VIDEO_FRAMES_MAX_BYTES
+ */
+static int mb_video_frames(fractal_ctx_t *ctx) {
+    int cores = fractal_pool_get_budget();
+    long tiles = (long)((ctx->width + FRACTAL_TILE_SIZE - 1) /
+                        FRACTAL_TILE_SIZE) *
+                 ((ctx->height + FRACTAL_TILE_SIZE - 1) / FRACTAL_TILE_SIZE);
+    long bytes = (long)ctx->width * ctx->height *
+                     (sizeof(int) + (ctx->smooth ? sizeof(float) : 0)) +
+                 mb_frame_bytes(ctx);
+    long count = (cores * VIDEO_TILES_PER_CORE + tiles - 1) / tiles;
 
-    while (iterations < mb_max_iterations) {
-        xx = x * x;
-        yy = y * y;
-        if (xx + yy > 4.0)
-            break;
-        y = 2.0 * x * y + yc;
-        x = xx - yy + xc;
-        iterations++;
-    }
+    if (cores > 1 && count < 2)
+        count = 2;
+    if (count > VIDEO_MAX_FRAMES)
+        count = VIDEO_MAX_FRAMES;
+    if (count * bytes > VIDEO_FRAMES_MAX_BYTES)
+        count = VIDEO_FRAMES_MAX_BYTES / bytes;
+    return count > 1 ? (int)count : 1;
+}
+
+/**
+ * Creates a context that renders frames of the video of 'ctx' with its
+ * own buffers and workers, stopped with it. Returns NULL if it cannot be
+ * allocated
+ */
+static fractal_ctx_t *mb_new_frame_ctx(fractal_ctx_t *ctx) {
+    fractal_ctx_t *frame_ctx = fractal_ctx_new();
+    if (!frame_ctx)
+        return NULL;
 
-    return mb_palette[iterations];
+    // the configuration has been checked by the video
+    mb_prepare(frame_ctx, &ctx->config);
+    frame_ctx->parent = ctx;
+    frame_ctx->threads = ctx->threads;
+    frame_ctx->video_rgb = ctx->video_rgb;
+    frame_ctx->tiles = fractal_tiles_new(ctx->width, ctx->height,
+                                         FRACTAL_TILE_SIZE, ctx->threads);
+    mb_get_pool(frame_ctx, ctx->threads);
+    mb_alloc_frame(frame_ctx);
+    return frame_ctx;
 }
 
-static png_color julia_get_color_from_pos(double x0, double y0, double xc,
-                                          double yc) {
-    // 'x', 'y', 'xx' and 'yy' are calculation variables
-    double x = xc, y = yc, xx, yy;
-    int iterations = 0;
+/**
+ * Waits for the frame and frees its context
+ */
+static void mb_free_frame_ctx(fractal_ctx_t *frame_ctx) {
+    if (!frame_ctx)
+        return;
 
-    while (iterations < mb_max_iterations) {
-        xx = x * x;
-        yy = y * y;
-        if (xx + yy > 4.0)
-            break;
-        y = 2.0 * x * y + y0;
-        x = xx - yy + x0;
-        iterations++;
-    }
+    fractal_pool_wait(frame_ctx->pool);
+    fractal_tiles_free(frame_ctx->tiles);
+    fractal_ctx_free(frame_ctx);
+}
 
-    return mb_palette[iterations];
+/**
+ * Prepares the frame with 'zoom' after the one of 'last' and starts
+ * rendering it without waiting
+ */
+static void mb_start_frame(fractal_ctx_t *frame_ctx, fractal_ctx_t *last,
+                           double zoom) {
+    // the estimate of max_iterations follows the previous frame
+    frame_ctx->zoom = zoom;
+    frame_ctx->estimated = last->estimated;
+    mb_prepare_frame(frame_ctx);
+    fractal_tiles_reset(frame_ctx->tiles);
+    fractal_pool_start(frame_ctx->pool, fractal_thread, frame_ctx);
 }
 
-static void mb_prepare(fractal_config_t *config) {
-    fractal_config_t c = *config;
+fractal_error_t fractal_begin_pyramid(fractal_config_t *config,
+                                      char *filename,
+                                      mb_on_progress_t on_progress,
+                                      mb_on_save_t on_save) {
+    pthread_once(&mb_default_once, mb_new_default_ctx);
+    return fractal_ctx_begin_pyramid(mb_default_ctx, config, filename,
+                                     on_progress, on_save);
+}
 
-    if (c.use_julia) {
-        // use Julia
-        use_julia = 1;
-        julia_x0 = c.x;
-        julia_y0 = c.y;
-        fractal_zoom = c.julia_zoom * c.height / 2.0;
+fractal_error_t fractal_ctx_begin_pyramid(fractal_ctx_t *ctx,
+                                          fractal_config_t *config,
+                                          char *filename,
+                                          mb_on_progress_t on_progress,
+                                          mb_on_save_t on_save) {
+    if (!ctx || !config || !filename || !on_save || config->width < 1 ||
+        config->height < 1)
+        return MB_ERROR;
 
-        fractal_tx = c.julia_x;
-        fractal_ty = c.julia_y;
-    } else {
-        // use Mandelbrot
-        use_julia = 0;
-        fractal_tx = c.x;
-        fractal_ty = c.y;
-        fractal_zoom = c.zoom * c.height / 2.0;
-    }
-
-    mb_width = c.width;
-    mb_height = c.height;
-
-    if (mb_max_iterations != c.max_iterations) {
-        mb_max_iterations = c.max_iterations;
-        free(mb_palette);
-        mb_palette = malloc(3 * (mb_max_iterations + 1));
-
-        double t;
-        for (int i = 0; i <= mb_max_iterations; i++) {
-            t = (double)i / mb_max_iterations;
-
-            // color algorithm (default 9.4 ; 15.9 ; 9.4)
-            mb_palette[i].red = (png_byte)(256.0 * 9.4 * (1.0 - t) * t * t * t);
-            mb_palette[i].green =
-                (png_byte)(256.0 * 15.9 * (1.0 - t) * (1.0 - t) * t * t);
-            mb_palette[i].blue =
-                (png_byte)(256.0 * 9.4 * (1.0 - t) * (1.0 - t) * (1.0 - t) * t);
-        }
+    fractal_error_t result = mb_begin(ctx, config);
+    if (result != MB_OK)
+        return result;
+
+    ctx->on_progress = on_progress;
+    ctx->on_save = on_save;
+    ctx->filename = filename;
+    if (on_progress)
+        on_progress(0, ctx->auto_iterations ? 0 : ctx->max_iterations);
+    mb_start(ctx, pyramid_thread);
+
+    return MB_OK;
+}
+
+static void *pyramid_thread(void *void_args) {
+    fractal_ctx_t *ctx = void_args;
+    mb_on_save_t on_save = ctx->on_save;
+    pyramid_export_t export = {0};
+    int shift, side, width, height, success;
+    char settings[2048];
+    uint8_t pixel[3];
+
+    export.ctx = ctx;
+    export.width = ctx->width;
+    export.height = ctx->height;
+
+    // every frame is rendered with the precision and max_iterations of
+    // the whole image
+    mb_prepare_frame(ctx);
+    ctx->config_precision = ctx->precision;
+    ctx->auto_iterations = 0;
+
+    mb_pyramid_settings(ctx, settings, sizeof(settings));
+    export.pyramid =
+        fractal_pyramid_open(ctx->filename, ctx->width, ctx->height, settings,
+                             ctx->png_level, ctx->png_filter);
+    if (!export.pyramid) {
+        mb_finish(ctx);
+        on_save(0);
+        return NULL;
+    }
+
+    shift = export.pyramid->levels - 1;
+    shift = shift < PYRAMID_CHUNK_SHIFT ? shift : PYRAMID_CHUNK_SHIFT;
+    export.chunk_level = export.pyramid->levels - 1 - shift;
+    side = FRACTAL_PYRAMID_TILE << shift;
+
+    // the buffers of the largest frame, the others use a part of them
+    ctx->recolorable = 0;
+    mb_free_orbits(ctx);
+    ctx->width = width = ctx->width < side ? ctx->width : side;
+    ctx->height = height = ctx->height < side ? ctx->height : side;
+    mb_alloc_frame(ctx);
+    ctx->image_data = export.chunk[0] = malloc((size_t)3 * width * height);
+    for (int i = 1; i <= shift; i++) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        export.chunk[i] = malloc((size_t)3 * width * height);
+    }
+    export.merged = malloc(sizeof(uint8_t *) * (export.chunk_level + 1));
+    for (int i = 0; i < export.chunk_level; i++)
+        export.merged[i] =
+            malloc(3 * 4 * FRACTAL_PYRAMID_TILE * FRACTAL_PYRAMID_TILE);
+    export.tiles = malloc(sizeof(pyramid_tile_t) * 2 * (1 << 2 * shift));
+
+    mb_get_pool(ctx, ctx->threads);
+    ctx->gen_pixels = 0;
+    clock_gettime(CLOCK_REALTIME, &ctx->progress_time);
+    mb_pyramid_tile(&export, 0, 0, 0, pixel, 3);
+
+    // the .dzi is written only if every tile is
+    success = !export.failed && !ctx->stop;
+    success = !fractal_pyramid_close(export.pyramid, success) && success;
+
+    for (int i = 0; i <= shift; i++)
+        free(export.chunk[i]);
+    for (int i = 0; i < export.chunk_level; i++)
+        free(export.merged[i]);
+    free(export.merged);
+    free(export.tiles);
+    free(ctx->iteration_data);
+    free(ctx->smooth_data);
+    ctx->iteration_data = NULL;
+    ctx->smooth_data = NULL;
+
+    mb_finish(ctx);
+    on_save(success);
+
+    return NULL;
+}
+
+/**
+ * Writes in 'text' what the pixels of a pyramid depend on, its tiles are
+ * kept only if it does not change
+ */
+static void mb_pyramid_settings(fractal_ctx_t *ctx, char *text, size_t size) {
+    int length = snprintf(
+        text, size,
+        "size %d %d\njulia %d %a %a\nzoom %a\nmax_iterations %d\n"
+        "smooth %d\nprecision %d\nrender_mode %d\ninterior_check %d\n",
+        ctx->width, ctx->height, ctx->use_julia, ctx->julia_x0,
+        ctx->julia_y0, ctx->zoom, ctx->max_iterations, ctx->smooth,
+        ctx->precision, ctx->render_mode,
+        ctx->kernel_params.interior_check);
+
+    // the center with every digit
+    for (int i = 0; i < 2; i++) {
+        const fractal_big_t *center = i ? &ctx->center_y : &ctx->center_x;
+        length += snprintf(text + length, size - length, "center %c",
+                           center->negative ? '-' : '+');
+        for (int limb = 0; limb < FRACTAL_BIG_LIMBS; limb++)
+            length += snprintf(text + length, size - length, "%08x",
+                               (unsigned)center->limb[limb]);
+        length += snprintf(text + length, size - length, "\n");
     }
 }
+
+/**
+ * Writes the tile (col, row) of 'level' and the missing tiles below it
+ * and copies it in 'pixels', in RGB with a row every 'stride' bytes. A
+ * tile is written after the ones below it, so the existing tiles are
+ * not rendered again. Returns -1 if the export is stopped or has failed
+ */
+static int mb_pyramid_tile(pyramid_export_t *export, int level, int col,
+                           int row, uint8_t *pixels, int stride) {
+    fractal_ctx_t *ctx = export->ctx;
+    fractal_pyramid_t *pyramid = export->pyramid;
+    int size = 3 * 2 * FRACTAL_PYRAMID_TILE, x, y, width, height;
+    uint8_t *merged;
+
+    fractal_pyramid_tile_size(pyramid, level, col, row, &width, &height);
+    if (!width)
+        return 0; // out of the image
+
+    if (!fractal_pyramid_read_tile(pyramid, level, col, row, pixels,
+                                   stride)) {
+        mb_pyramid_region(export, level, col, row, &x, &y, &width, &height);
+        ctx->gen_pixels += (long)width * height;
+        mb_photo_progress(ctx, (long)export->width * export->height);
+        return 0;
+    }
+    if (level == export->chunk_level)
+        return mb_pyramid_chunk(export, col, row, pixels, stride);
+
+    merged = export->merged[level];
+    for (int i = 0; i < 4; i++) {
+        if (mb_pyramid_tile(export, level + 1, 2 * col + i % 2,
+                            2 * row + i / 2,
+                            merged + (i / 2) * FRACTAL_PYRAMID_TILE * size +
+                                (i % 2) * FRACTAL_PYRAMID_TILE * 3,
+                            size))
+            return -1;
+    }
+
+    // the children that are in the image
+    fractal_pyramid_level_size(pyramid, level + 1, &width, &height);
+    width -= 2 * col * FRACTAL_PYRAMID_TILE;
+    height -= 2 * row * FRACTAL_PYRAMID_TILE;
+    width = width < 2 * FRACTAL_PYRAMID_TILE ? width : 2 * FRACTAL_PYRAMID_TILE;
+    height =
+        height < 2 * FRACTAL_PYRAMID_TILE ? height : 2 * FRACTAL_PYRAMID_TILE;
+    fractal_pyramid_downsample(merged, width, height, size, pixels, stride);
+
+    if (fractal_pyramid_write_tile(pyramid, level, col, row, pixels, stride)) {
+        export->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Renders the part of the image under the tile (col, row) of chunk_level
+ * as a frame, writes its tiles at every level from the last one to
+ * chunk_level and copies the last tile in 'pixels', in RGB with a row
+ * every 'stride' bytes. Returns -1 if the export is stopped or has failed
+ */
+static int mb_pyramid_chunk(pyramid_export_t *export, int col, int row,
+                            uint8_t *pixels, int stride) {
+    fractal_ctx_t *ctx = export->ctx;
+    fractal_pyramid_t *pyramid = export->pyramid;
+    int x, y, width, height, area, shift, tile = FRACTAL_PYRAMID_TILE;
+    pyramid_tile_t *entry;
+
+    // the view does not change, the frame moves over the image
+    mb_pyramid_region(export, export->chunk_level, col, row, &x, &y, &width,
+                      &height);
+    area = width * height;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->center_col = export->width / 2.0 - x;
+    ctx->center_row = export->height / 2.0 - y;
+    mb_prepare_frame(ctx);
+
+    ctx->tiles =
+        fractal_tiles_new(width, height, FRACTAL_TILE_SIZE, ctx->threads);
+    fractal_pool_run(ctx->pool, fractal_thread, ctx);
+    if (!ctx->stop) {
+        mb_mirror_image(ctx, 0, height - 1);
+        mb_update_stats(ctx);
+        mb_store_tiles(ctx, 0, height - 1);
+    }
+    fractal_tiles_free(ctx->tiles);
+    if (ctx->stop)
+        return -1;
+    mb_colorize(ctx, 0);
+
+    // the tiles of the levels below chunk_level, written by the workers
+    export->tile_count = 0;
+    shift = pyramid->levels - 1 - export->chunk_level;
+    for (int i = 0; i <= shift; i++) {
+        if (i > 0) {
+            fractal_pyramid_downsample(export->chunk[i - 1], width, height,
+                                       3 * width, export->chunk[i],
+                                       3 * ((width + 1) / 2));
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        if (i == shift)
+            break;
+
+        for (int ty = 0; ty * tile < height; ty++) {
+            for (int tx = 0; tx * tile < width; tx++) {
+                entry = export->tiles + export->tile_count++;
+                entry->level = pyramid->levels - 1 - i;
+                entry->col = (col << (shift - i)) + tx;
+                entry->row = (row << (shift - i)) + ty;
+                entry->stride = 3 * width;
+                entry->pixels =
+                    export->chunk[i] + 3 * ((size_t)ty * tile * width +
+                                            (size_t)tx * tile);
+            }
+        }
+    }
+    fractal_pool_run(ctx->pool, pyramid_encode, export);
+    if (export->failed || ctx->stop)
+        return -1;
+
+    for (int i = 0; i < height; i++)
+        memcpy(pixels + (size_t)i * stride,
+               export->chunk[shift] + (size_t)i * 3 * width, 3 * width);
+    if (fractal_pyramid_write_tile(pyramid, export->chunk_level, col, row,
+                                   pixels, stride)) {
+        export->failed = 1;
+        return -1;
+    }
+
+    ctx->gen_pixels += area;
+    mb_photo_progress(ctx, (long)export->width * export->height);
+    return 0;
+}
+
+/**
+ * Part of the image under the tile (col, row) of 'level', in pixels of
+ * the last level
+ */
+static void mb_pyramid_region(pyramid_export_t *export, int level, int col,
+                              int row, int *x, int *y, int *width,
+                              int *height) {
+    long size = (long)FRACTAL_PYRAMID_TILE
+                << (export->pyramid->levels - 1 - level);
+
+    *x = (int)(col * size);
+    *y = (int)(row * size);
+    *width = (int)(export->width - *x < size ? export->width - *x : size);
+    *height = (int)(export->height - *y < size ? export->height - *y : size);
+}
+
+/**
+ * Writes the tiles of the frame of a pyramid, every worker takes one out
+ * of the size of the pool
+ */
+static void pyramid_encode(int worker, void *data) {
+    pyramid_export_t *export = data;
+    fractal_ctx_t *ctx = export->ctx;
+    pyramid_tile_t *tile;
+    int failed;
+
+    for (int i = worker; i < export->tile_count && !ctx->stop;
+         i += ctx->pool->size) {
+        tile = export->tiles + i;
+        fractal_pool_acquire_core();
+        failed = fractal_pyramid_write_tile(export->pyramid, tile->level,
+                                            tile->col, tile->row,
+                                            tile->pixels, tile->stride);
+        fractal_pool_release_core();
+        if (failed)
+            export->failed = 1;
+    }
+}
+
+/**
+ * Marks the context as busy and prepares the view of the export.
+ * Returns MB_EXEC if the context is already exporting
+ */
+static fractal_error_t mb_begin(fractal_ctx_t *ctx, fractal_config_t *config) {
+    if (!mb_acquire(ctx))
+        return MB_EXEC;
+
+    if (mb_prepare(ctx, config)) {
+        mb_finish(ctx);
+        return MB_ERROR;
+    }
+    ctx->threads = config->threads;
+    ctx->stop = 0;
+    return MB_OK;
+}
+
+/**
+ * Marks the context as busy, returns 0 if it already is
+ */
+static int mb_acquire(fractal_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->status_lock);
+    if (ctx->busy) {
+        pthread_mutex_unlock(&ctx->status_lock);
+        return 0;
+    }
+    ctx->busy = 1;
+    pthread_mutex_unlock(&ctx->status_lock);
+    return 1;
+}
+
+static void mb_start(fractal_ctx_t *ctx, void *(*thread)(void *)) {
+    pthread_t pid;
+    pthread_create(&pid, NULL, thread, ctx);
+    pthread_detach(pid);
+}
+
+/**
+ * Marks the context as free, the export thread must not use it after
+ * this since it can be freed
+ */
+static void mb_finish(fractal_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->status_lock);
+    ctx->busy = 0;
+    pthread_cond_broadcast(&ctx->status_done);
+    pthread_mutex_unlock(&ctx->status_lock);
+}
+
+/**
+ * Renders tiles until there are none left or the export is stopped, every
+ * tile takes a core of the budget shared with the other contexts.
+ * 'progress' is a constant in each variant of the job so the check
+ * leaves the loop
+ */
+static inline void render_tiles(int worker, fractal_ctx_t *ctx,
+                                int progress) {
+    fractal_tile_t tile;
+    fractal_worker_t state = {0};
+    state.ctx = ctx;
+
+    while (!ctx->stop && !(ctx->parent && ctx->parent->stop) &&
+           fractal_tiles_next(ctx->tiles, worker, &tile)) {
+        if (ctx->window_rows && !mb_wait_window(ctx, &tile))
+            break;
+        fractal_pool_acquire_core();
+        fractal_render_tile(&tile, &state);
+        fractal_pool_release_core();
+        if (ctx->tiles_done)
+            mb_tile_done(ctx, &tile);
+
+        if (progress) {
+            sem_wait(&ctx->add_semaphore);
+            ctx->gen_pixels += (long)tile.width * tile.height;
+            sem_post(&ctx->add_semaphore);
+        }
+    }
+
+    for (int i = 0; i < state.reference_count; i++)
+        fractal_reference_free(state.references[i]);
+
+    pthread_mutex_lock(&ctx->stats_lock);
+    ctx->frame_counters.interior += state.counters.interior;
+    ctx->frame_counters.filled += state.counters.filled;
+    ctx->frame_counters.references += state.reference_count;
+    ctx->frame_counters.glitched += state.counters.glitched;
+    ctx->frame_counters.resumed += state.counters.resumed;
+    ctx->frame_counters.cached += state.counters.cached;
+    pthread_mutex_unlock(&ctx->stats_lock);
+}
+
+static void fractal_thread(int worker, void *data) {
+    render_tiles(worker, data, 0);
+}
+
+/**
+ * Same as fractal_thread, also counts the generated pixels
+ */
+static void fractal_thread_progress(int worker, void *data) {
+    render_tiles(worker, data, 1);
+}
+
+/**
+ * Waits until the rows of a tile are in the window of the photo, that is
+ * the rows it replaces have been written. Returns 0 if the export is
+ * stopped. The tiles are given from the top, so the rows above the tile
+ * are rendered by the workers that do not wait
+ */
+static int mb_wait_window(fractal_ctx_t *ctx, const fractal_tile_t *tile) {
+    int last = tile->y + tile->height;
+
+    pthread_mutex_lock(&ctx->rows_lock);
+    while (last > ctx->rows_written + ctx->window_rows && !ctx->stop)
+        pthread_cond_wait(&ctx->rows_free, &ctx->rows_lock);
+    pthread_mutex_unlock(&ctx->rows_lock);
+    return !ctx->stop;
+}
+
+/**
+ * Counts a tile of a photo as completed, see mb_wait_tile_row
+ */
+static void mb_tile_done(fractal_ctx_t *ctx, const fractal_tile_t *tile) {
+    pthread_mutex_lock(&ctx->rows_lock);
+    if (++ctx->tiles_done[tile->y / FRACTAL_TILE_SIZE] == ctx->tiles->columns)
+        pthread_cond_signal(&ctx->rows_ready);
+    pthread_mutex_unlock(&ctx->rows_lock);
+}
+
+/**
+ * Waits until the row of tiles 'row' is complete, the export is stopped
+ * or it is time to call on_progress (see mb_photo_progress). Returns 1 if
+ * the row is complete
+ */
+static int mb_wait_tile_row(fractal_ctx_t *ctx, int row) {
+    int complete, timeout = 0;
+
+    pthread_mutex_lock(&ctx->rows_lock);
+    while (!(complete = ctx->tiles_done[row] == ctx->tiles->columns) &&
+           !timeout && !ctx->stop)
+        timeout = pthread_cond_timedwait(&ctx->rows_ready, &ctx->rows_lock,
+                                         &ctx->progress_time) == ETIMEDOUT;
+    pthread_mutex_unlock(&ctx->rows_lock);
+
+    mb_photo_progress(ctx, (long)ctx->width * ctx->height);
+    return complete;
+}
+
+/**
+ * Frees the rows of the window of the photo before 'rows', see
+ * mb_wait_window
+ */
+static void mb_rows_written(fractal_ctx_t *ctx, int rows) {
+    pthread_mutex_lock(&ctx->rows_lock);
+    ctx->rows_written = rows;
+    pthread_cond_broadcast(&ctx->rows_free);
+    pthread_mutex_unlock(&ctx->rows_lock);
+}
+
+/**
+ * Calls on_progress with gen_pixels out of 'total' if progress_time has
+ * come, the next call will be PROGRESS_DELAY_NANOSECONDS later
+ */
+static void mb_photo_progress(fractal_ctx_t *ctx, long total) {
+    struct timespec now, *next = &ctx->progress_time;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec < next->tv_sec ||
+        (now.tv_sec == next->tv_sec && now.tv_nsec < next->tv_nsec))
+        return;
+
+    if (ctx->on_progress)
+        ctx->on_progress((float)ctx->gen_pixels / total, ctx->max_iterations);
+
+    next->tv_sec = now.tv_sec;
+    next->tv_nsec = now.tv_nsec + PROGRESS_DELAY_NANOSECONDS;
+    if (next->tv_nsec >= 1000000000L) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Creates the PNG of the photo and allocates image_data for its pixels:
+ * without smooth the pixels can get at most max_iterations + 1 colors,
+ * if they are 256 or less (after removing the duplicates) the photo is
+ * indexed. The palette is shifted by 'offset' colors
+ */
+static fractal_png_t *mb_open_png(fractal_ctx_t *ctx, const char *filename,
+                                  int offset) {
+    uint32_t colors[256];
+    int count = 0;
+    fractal_png_t *png;
+
+    if (!ctx->smooth)
+        count = fractal_palette_index(&ctx->palette, offset, ctx->color_map,
+                                      colors);
+    ctx->indexed = count > 0;
+
+#ifdef DEBUG
+    if (ctx->indexed)
+        fprintf(stderr, " [DD] Indexed photo with %d colors\n", count);
+#endif
+
+    png = fractal_png_open(filename, ctx->width, ctx->height, ctx->png_level,
+                           ctx->png_filter, ctx->threads,
+                           ctx->indexed ? colors : NULL, count);
+    if (png)
+        ctx->image_data = malloc((size_t)(ctx->indexed ? 1 : 3) * ctx->width *
+                                 ctx->band_rows);
+    return png;
+}
+
+/**
+ * Colors the rows of the photo from 'first' to 'last' (included) in
+ * image_data, band_rows at a time, and writes them in 'png'. They are in
+ * a single row of tiles or in a photo with all its rows. The palette is
+ * shifted by 'offset' colors. Returns -1 on error
+ */
+static int mb_write_rows(fractal_ctx_t *ctx, fractal_png_t *png, int first,
+                         int last, int offset) {
+    long start = mb_data_index(ctx, 0, first);
+
+    return mb_write_pixels(ctx, png, ctx->iteration_data + start,
+                           ctx->smooth_data ? ctx->smooth_data + start : NULL,
+                           last + 1 - first, offset);
+}
+
+/**
+ * Same as mb_write_rows with the 'rows' rows of 'iterations' and 'smooth'
+ * (NULL without smooth) instead of the ones of the photo
+ */
+static int mb_write_pixels(fractal_ctx_t *ctx, fractal_png_t *png,
+                           const int *iterations, const float *smooth,
+                           int rows, int offset) {
+    long start, count;
+    int band;
+
+    for (int row = 0; row < rows; row += band) {
+        band = rows - row < ctx->band_rows ? rows - row : ctx->band_rows;
+        start = (long)row * ctx->width;
+        count = (long)band * ctx->width;
+        if (ctx->indexed)
+            fractal_colorize_indexed(&ctx->palette, iterations + start, count,
+                                     offset, ctx->color_map, ctx->image_data);
+        else
+            fractal_colorize(&ctx->palette, iterations + start,
+                             smooth ? smooth + start : NULL, count, offset,
+                             ctx->image_data);
+        if (fractal_png_write(png, ctx->image_data, band))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the render workers, creating them if the number of threads
+ * has changed since the last export
+ */
+static fractal_pool_t *mb_get_pool(fractal_ctx_t *ctx, int threads) {
+    if (ctx->pool && ctx->pool->size != threads)
+        mb_free_pool(ctx);
+    if (!ctx->pool)
+        ctx->pool = fractal_pool_new(threads);
+    return ctx->pool;
+}
+
+static void mb_free_pool(fractal_ctx_t *ctx) {
+    fractal_pool_free(ctx->pool);
+    ctx->pool = NULL;
+}
+
+/**
+ * Computes the iterations of a tile with the current render mode, or
+ * reads them from the tile cache, and writes them in iteration_data. The
+ * part of the tile that is the mirror of another part of the frame is
+ * left to mb_mirror_image
+ */
+static void fractal_render_tile(const fractal_tile_t *tile,
+                                fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    int iterations[FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE];
+    float tile_smooth[FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE];
+    float *smooth = ctx->smooth_data ? tile_smooth : NULL;
+    double orbit_x[FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE];
+    double orbit_y[FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE];
+    fractal_orbit_t tile_orbit = {orbit_x, orbit_y, 0};
+    fractal_orbit_t *orbit = ctx->orbits ? &tile_orbit : NULL;
+    orbit_list_t *list =
+        ctx->orbits ? &ctx->orbits[mb_tile_index(ctx, tile)] : NULL;
+    int width = tile->width, height = tile->height;
+
+    // the tiles of the cache have no orbits, they are rendered again
+    if (ctx->resume && !list->cached) {
+        tile_resume(tile, worker);
+        return;
+    }
+    if (tile_load(tile, worker)) {
+        if (list) {
+            list->count = 0;
+            list->cached = 1;
+        }
+        return;
+    }
+    if (list)
+        list->cached = 0;
+
+    // mirrored rectangle in tile coordinates
+    int x0 = ctx->mirror_x0 - tile->x, y0 = ctx->mirror_y0 - tile->y;
+    int x1 = ctx->mirror_x1 - tile->x, y1 = ctx->mirror_y1 - tile->y;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > width - 1 ? width - 1 : x1;
+    y1 = y1 > height - 1 ? height - 1 : y1;
+
+    if (x0 > x1 || y0 > y1) {
+        tile_render_rect(tile, iterations, smooth, orbit, 0, 0, width - 1,
+                         height - 1, worker);
+        return;
+    }
+
+    // above, below, left and right of the mirrored rectangle
+    tile_render_rect(tile, iterations, smooth, orbit, 0, 0, width - 1, y0 - 1,
+                     worker);
+    tile_render_rect(tile, iterations, smooth, orbit, 0, y1 + 1, width - 1,
+                     height - 1, worker);
+    tile_render_rect(tile, iterations, smooth, orbit, 0, y0, x0 - 1, y1,
+                     worker);
+    tile_render_rect(tile, iterations, smooth, orbit, x1 + 1, y0, width - 1,
+                     y1, worker);
+}
+
+/**
+ * Computes the rectangle (x0, y0) - (x1, y1) of a tile, corners included,
+ * and copies it in iteration_data (and smooth_data if 'smooth' is not
+ * NULL). If 'orbit' is not NULL the orbits of the pixels that did not
+ * escape are kept
+ */
+static void tile_render_rect(const fractal_tile_t *tile, int *iterations,
+                             float *smooth, fractal_orbit_t *orbit, int x0,
+                             int y0, int x1, int y1, fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    int width = tile->width, count = x1 - x0 + 1;
+    long data_index;
+
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    if (ctx->render_mode == FRACTAL_RENDER_SUBDIVISION) {
+        pixel_batch_t batch;
+        batch.count = 0;
+
+        // -1 marks the pixels not computed yet, the orbits of the
+        // filled pixels stay unknown (infinite)
+        for (int row = y0; row <= y1; row++) {
+            for (int col = x0; col <= x1; col++) {
+                iterations[row * width + col] = -1;
+                if (orbit)
+                    orbit->x[row * width + col] = INFINITY;
+            }
+        }
+        tile_subdivide(tile, iterations, smooth, orbit, &batch, x0, y0, x1,
+                       y1, worker);
+        batch_flush(iterations, smooth, orbit, &batch, worker);
+    } else {
+        for (int row = y0; row <= y1; row++)
+            tile_compute_span(tile, iterations, smooth, orbit, row, x0, x1,
+                              worker);
+    }
+    if (orbit)
+        tile_keep_orbits(tile, iterations, orbit, x0, y0, x1, y1, worker);
+
+    for (int row = y0; row <= y1; row++) {
+        data_index = mb_data_index(ctx, tile->x + x0, tile->y + row);
+        memcpy(ctx->iteration_data + data_index, iterations + row * width + x0,
+               sizeof(int) * count);
+        if (smooth)
+            memcpy(ctx->smooth_data + data_index, smooth + row * width + x0,
+                   sizeof(float) * count);
+    }
+}
+
+/**
+ * Adds the pixels of the rectangle (x0, y0) - (x1, y1) of a tile that
+ * reached max_iterations to the orbits of the tile, except the ones that
+ * never escape
+ */
+static void tile_keep_orbits(const fractal_tile_t *tile, const int *iterations,
+                             const fractal_orbit_t *orbit, int x0, int y0,
+                             int x1, int y1, fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    orbit_list_t *list = &ctx->orbits[mb_tile_index(ctx, tile)];
+    int max_iterations = ctx->kernel_params.max_iterations, count = 0, index;
+    orbit_pixel_t *pixel;
+
+    for (int row = y0; row <= y1; row++) {
+        for (int col = x0; col <= x1; col++) {
+            index = row * tile->width + col;
+            count += iterations[index] >= max_iterations &&
+                     !isnan(orbit->x[index]);
+        }
+    }
+    if (!count)
+        return;
+
+    list->pixels =
+        realloc(list->pixels, sizeof(orbit_pixel_t) * (list->count + count));
+    for (int row = y0; row <= y1; row++) {
+        for (int col = x0; col <= x1; col++) {
+            index = row * tile->width + col;
+            if (iterations[index] < max_iterations || isnan(orbit->x[index]))
+                continue;
+
+            pixel = &list->pixels[list->count++];
+            pixel->index = index;
+            pixel->start = isinf(orbit->x[index]) ? 0 : max_iterations;
+            pixel->x = orbit->x[index];
+            pixel->y = orbit->y[index];
+        }
+    }
+}
+
+/**
+ * Continues the pixels of a tile that did not escape in the last photo,
+ * from their orbits, up to the new max_iterations. The other pixels of
+ * the tile keep their iterations
+ */
+static void tile_resume(const fractal_tile_t *tile, fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    orbit_list_t *list = &ctx->orbits[mb_tile_index(ctx, tile)];
+    int entries[FRACTAL_KERNEL_RUN], count, kept = 0, *data;
+
+    // the pixels proven inside the set are not in the list
+    for (int row = 0; row < tile->height; row++) {
+        data = ctx->iteration_data +
+               mb_data_index(ctx, tile->x, tile->y + row);
+        for (int col = 0; col < tile->width; col++)
+            if (data[col] >= ctx->resume)
+                data[col] = ctx->max_iterations;
+    }
+
+    // the pixels with a known orbit first, then the unknown ones from
+    // the beginning: every run has the same start
+    for (int known = 1; known >= 0; known--) {
+        count = 0;
+        for (int i = 0; i < list->count; i++) {
+            if ((list->pixels[i].start != 0) != known)
+                continue;
+            entries[count++] = i;
+            if (count == FRACTAL_KERNEL_RUN) {
+                resume_run(tile, list, entries, count, worker);
+                count = 0;
+            }
+        }
+        resume_run(tile, list, entries, count, worker);
+    }
+
+    // the pixels that escaped now are removed
+    for (int i = 0; i < list->count; i++)
+        if (list->pixels[i].start >= 0)
+            list->pixels[kept++] = list->pixels[i];
+    list->count = kept;
+}
+
+/**
+ * Computes the pixels 'entries' of the orbits of a tile, that have the
+ * same start, and writes them in iteration_data. The orbits are updated,
+ * start becomes -1 for the pixels that will not be resumed again
+ */
+static void resume_run(const fractal_tile_t *tile, orbit_list_t *list,
+                       const int *entries, int count,
+                       fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    double dx[FRACTAL_KERNEL_RUN], dy[FRACTAL_KERNEL_RUN];
+    double zx[FRACTAL_KERNEL_RUN], zy[FRACTAL_KERNEL_RUN];
+    double halfWidth = ctx->center_col, halfHeight = ctx->center_row;
+    int result[FRACTAL_KERNEL_RUN], col, row;
+    float result_smooth[FRACTAL_KERNEL_RUN];
+    fractal_orbit_t orbit = {zx, zy, 0};
+    orbit_pixel_t *pixel;
+    long data_index;
+
+    if (count <= 0)
+        return;
+
+    orbit.start = list->pixels[entries[0]].start;
+    for (int i = 0; i < count; i++) {
+        pixel = &list->pixels[entries[i]];
+        col = pixel->index % tile->width;
+        row = pixel->index / tile->width;
+        dx[i] = (tile->x + col - halfWidth) / ctx->zoom;
+        dy[i] = -((tile->y + row - halfHeight) / ctx->zoom);
+        zx[i] = pixel->x;
+        zy[i] = pixel->y;
+    }
+
+    compute_pixels(worker, dx, dy, count, result,
+                   ctx->smooth_data ? result_smooth : NULL, &orbit);
+    worker->counters.resumed += count;
+
+    for (int i = 0; i < count; i++) {
+        pixel = &list->pixels[entries[i]];
+        col = pixel->index % tile->width;
+        row = pixel->index / tile->width;
+        data_index = mb_data_index(ctx, tile->x + col, tile->y + row);
+        ctx->iteration_data[data_index] = result[i];
+        if (ctx->smooth_data)
+            ctx->smooth_data[data_index] = result_smooth[i];
+
+        if (result[i] < ctx->kernel_params.max_iterations || isnan(zx[i])) {
+            pixel->start = -1;
+            continue;
+        }
+        pixel->start = result[i];
+        pixel->x = zx[i];
+        pixel->y = zy[i];
+    }
+}
+
+/**
+ * Copies the tile from the tile cache in iteration_data (and smooth_data),
+ * returns 0 if it is not there
+ */
+static int tile_load(const fractal_tile_t *tile, fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    int data[2 * FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE];
+    int pixels = tile->width * tile->height;
+    float *smooth = (float *)(data + pixels);
+    long data_index;
+    tile_key_t key;
+
+    if (!mb_tile_cache || mb_tile_key(ctx, tile, &key) ||
+        fractal_cache_load(mb_tile_cache, &key, sizeof(key), data,
+                           (ctx->smooth_data ? 2 : 1) * sizeof(int) *
+                               pixels))
+        return 0;
+
+    for (int row = 0; row < tile->height; row++) {
+        data_index = mb_data_index(ctx, tile->x, tile->y + row);
+        memcpy(ctx->iteration_data + data_index, data + row * tile->width,
+               sizeof(int) * tile->width);
+        if (ctx->smooth_data)
+            memcpy(ctx->smooth_data + data_index, smooth + row * tile->width,
+                   sizeof(float) * tile->width);
+    }
+    worker->counters.cached++;
+    return 1;
+}
+
+/**
+ * Adds the tiles of the rows of the frame from 'first' to 'last'
+ * (included), that are complete, to the tile cache. 'first' is the first
+ * row of a row of tiles
+ */
+static void mb_store_tiles(fractal_ctx_t *ctx, int first, int last) {
+    int data[2 * FRACTAL_TILE_SIZE * FRACTAL_TILE_SIZE], pixels;
+    fractal_tile_t tile;
+    float *smooth;
+    long data_index;
+    tile_key_t key;
+
+    if (!mb_tile_cache)
+        return;
+
+    // the same tiles of the scheduler
+    for (tile.y = first; tile.y <= last; tile.y += FRACTAL_TILE_SIZE) {
+        for (tile.x = 0; tile.x < ctx->width; tile.x += FRACTAL_TILE_SIZE) {
+            tile.width = ctx->width - tile.x < FRACTAL_TILE_SIZE
+                             ? ctx->width - tile.x
+                             : FRACTAL_TILE_SIZE;
+            tile.height = ctx->height - tile.y < FRACTAL_TILE_SIZE
+                              ? ctx->height - tile.y
+                              : FRACTAL_TILE_SIZE;
+            if (mb_tile_key(ctx, &tile, &key))
+                return;
+
+            pixels = tile.width * tile.height;
+            smooth = (float *)(data + pixels);
+            for (int row = 0; row < tile.height; row++) {
+                data_index = mb_data_index(ctx, tile.x, tile.y + row);
+                memcpy(data + row * tile.width,
+                       ctx->iteration_data + data_index,
+                       sizeof(int) * tile.width);
+                if (ctx->smooth_data)
+                    memcpy(smooth + row * tile.width,
+                           ctx->smooth_data + data_index,
+                           sizeof(float) * tile.width);
+            }
+            fractal_cache_store(mb_tile_cache, &key, sizeof(key), data,
+                                (ctx->smooth_data ? 2 : 1) * sizeof(int) *
+                                    pixels);
+        }
+    }
+}
+
+/**
+ * Writes the key of a tile of the frame in the tile cache, returns -1 if
+ * the tile cannot be cached: the subdivision fills the pixels depending
+ * on the boundaries of the tiles and of the mirrored pixels
+ */
+static int mb_tile_key(fractal_ctx_t *ctx, const fractal_tile_t *tile,
+                       tile_key_t *key) {
+    if (ctx->render_mode != FRACTAL_RENDER_FULL)
+        return -1;
+
+    // the padding too is compared
+    memset(key, 0, sizeof(tile_key_t));
+    key->use_julia = ctx->use_julia;
+    key->precision = ctx->precision;
+    key->max_iterations = ctx->max_iterations;
+    key->interior_check = ctx->kernel_params.interior_check;
+    key->smooth = ctx->smooth_data != NULL;
+    key->width = tile->width;
+    key->height = tile->height;
+    key->negative_x = ctx->center_x.negative;
+    key->negative_y = ctx->center_y.negative;
+    memcpy(key->center_x, ctx->center_x.limb, sizeof(key->center_x));
+    memcpy(key->center_y, ctx->center_y.limb, sizeof(key->center_y));
+    key->julia_x = ctx->use_julia ? ctx->julia_x0 : 0.0;
+    key->julia_y = ctx->use_julia ? ctx->julia_y0 : 0.0;
+    key->zoom = ctx->zoom;
+    key->x = tile->x - ctx->center_col;
+    key->y = tile->y - ctx->center_row;
+    return 0;
+}
+
+/**
+ * Index of the tile in the scheduler of the frame
+ */
+static int mb_tile_index(fractal_ctx_t *ctx, const fractal_tile_t *tile) {
+    int size = ctx->tiles->tile_size;
+    return tile->y / size * ctx->tiles->columns + tile->x / size;
+}
+
+/**
+ * Position of the pixel (x, y) of the frame in iteration_data and
+ * smooth_data
+ */
+static long mb_data_index(fractal_ctx_t *ctx, int x, int y) {
+    if (ctx->window_rows)
+        y %= ctx->window_rows;
+    return (long)y * ctx->width + x;
+}
+
+/**
+ * Computes at most FRACTAL_KERNEL_RUN pixels at offset (dx, dy) from the
+ * center of the view with the precision of the frame. 'orbit' is passed
+ * to the kernel, perturbation ignores it
+ */
+static void compute_pixels(fractal_worker_t *worker, const double *dx,
+                           const double *dy, int count, int *iterations,
+                           float *smooth, fractal_orbit_t *orbit) {
+    fractal_ctx_t *ctx = worker->ctx;
+    double xc[FRACTAL_KERNEL_RUN], yc[FRACTAL_KERNEL_RUN];
+
+    if (ctx->precision == FRACTAL_PRECISION_PERTURBATION) {
+        perturb_pixels(worker, dx, dy, count, iterations, smooth);
+        return;
+    }
+    if (ctx->precision == FRACTAL_PRECISION_DOUBLE_DOUBLE) {
+        // the kernel adds the offsets to the center by itself
+        worker->counters.interior += ctx->kernel(
+            &ctx->kernel_params, dx, dy, count, iterations, smooth, orbit);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        xc[i] = ctx->tx + dx[i];
+        yc[i] = ctx->ty + dy[i];
+    }
+    worker->counters.interior += ctx->kernel(&ctx->kernel_params, xc, yc,
+                                             count, iterations, smooth, orbit);
+}
+
+/**
+ * Computes the pixels with the reference orbit of the center. Glitched
+ * pixels are computed again with the references of the worker, newest
+ * first, then with a new reference on one of them until the limit is
+ * reached
+ */
+static void perturb_pixels(fractal_worker_t *worker, const double *dx,
+                           const double *dy, int count, int *iterations,
+                           float *smooth) {
+    fractal_ctx_t *ctx = worker->ctx;
+    double gx[FRACTAL_KERNEL_RUN], gy[FRACTAL_KERNEL_RUN];
+    int index[FRACTAL_KERNEL_RUN], result[FRACTAL_KERNEL_RUN];
+    float result_smooth[FRACTAL_KERNEL_RUN];
+    int glitched, n, next = worker->reference_count - 1;
+    fractal_reference_t *ref;
+
+    glitched = fractal_perturb_pixels(ctx->reference, &ctx->kernel_params,
+                                      dx, dy, count, iterations, smooth);
+    while (glitched) {
+        n = 0;
+        for (int i = 0; i < count; i++) {
+            if (iterations[i] < 0) {
+                gx[n] = dx[i];
+                gy[n] = dy[i];
+                index[n++] = i;
+            }
+        }
+
+        if (next >= 0) {
+            ref = worker->references[next--];
+        } else if (worker->reference_count < PERTURB_MAX_REFERENCES) {
+            // the pixel of the new reference is exact, so this ends
+            ref = fractal_reference_new(&ctx->center_x, &ctx->center_y, gx[0],
+                                        gy[0], &ctx->kernel_params,
+                                        ctx->reference_limbs);
+            worker->references[worker->reference_count++] = ref;
+        } else {
+            // keep the iterations reached before the glitch
+            for (int i = 0; i < n; i++)
+                iterations[index[i]] = -iterations[index[i]] - 1;
+            worker->counters.glitched += n;
+            return;
+        }
+
+        glitched =
+            fractal_perturb_pixels(ref, &ctx->kernel_params, gx, gy, n, result,
+                                   smooth ? result_smooth : NULL);
+        for (int i = 0; i < n; i++) {
+            iterations[index[i]] = result[i];
+            if (smooth)
+                smooth[index[i]] = result_smooth[i];
+        }
+    }
+}
+
+/**
+ * Computes the pixels of a tile row from 'first_col' to 'last_col'
+ * (included), in runs of contiguous columns
+ */
+static void tile_compute_span(const fractal_tile_t *tile, int *iterations,
+                              float *smooth, fractal_orbit_t *orbit, int row,
+                              int first_col, int last_col,
+                              fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    double dx[FRACTAL_KERNEL_RUN], dy[FRACTAL_KERNEL_RUN], row_dy;
+    double halfWidth = ctx->center_col, halfHeight = ctx->center_row;
+    int *out = iterations + row * tile->width;
+    float *out_smooth = smooth ? smooth + row * tile->width : NULL;
+    fractal_orbit_t run_orbit = {0};
+    int run;
+
+    row_dy = -((tile->y + row - halfHeight) / ctx->zoom);
+    for (int col = first_col; col <= last_col; col += run) {
+        run = last_col + 1 - col;
+        if (run > FRACTAL_KERNEL_RUN)
+            run = FRACTAL_KERNEL_RUN;
+
+        for (int i = 0; i < run; i++) {
+            dx[i] = (tile->x + col + i - halfWidth) / ctx->zoom;
+            dy[i] = row_dy;
+        }
+
+        if (orbit) {
+            run_orbit.x = orbit->x + row * tile->width + col;
+            run_orbit.y = orbit->y + row * tile->width + col;
+        }
+        compute_pixels(worker, dx, dy, run, out + col,
+                       out_smooth ? out_smooth + col : NULL,
+                       orbit ? &run_orbit : NULL);
+    }
+}
+
+/**
+ * Queues the pixel (col, row) of the tile if it has not been computed or
+ * queued yet, the batch is computed when it is full
+ */
+static void batch_add(const fractal_tile_t *tile, int *iterations,
+                      float *smooth, fractal_orbit_t *orbit,
+                      pixel_batch_t *batch, int col, int row,
+                      fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    double halfWidth = ctx->center_col, halfHeight = ctx->center_row;
+    int index = row * tile->width + col;
+    if (iterations[index] != -1)
+        return;
+
+    iterations[index] = -2;
+    batch->dx[batch->count] = (tile->x + col - halfWidth) / ctx->zoom;
+    batch->dy[batch->count] = -((tile->y + row - halfHeight) / ctx->zoom);
+    batch->index[batch->count++] = index;
+
+    if (batch->count == FRACTAL_KERNEL_RUN)
+        batch_flush(iterations, smooth, orbit, batch, worker);
+}
+
+/**
+ * Computes every queued pixel
+ */
+static void batch_flush(int *iterations, float *smooth, fractal_orbit_t *orbit,
+                        pixel_batch_t *batch, fractal_worker_t *worker) {
+    int result[FRACTAL_KERNEL_RUN];
+    float result_smooth[FRACTAL_KERNEL_RUN];
+    double zx[FRACTAL_KERNEL_RUN], zy[FRACTAL_KERNEL_RUN];
+    fractal_orbit_t result_orbit = {zx, zy, 0};
+
+    if (!batch->count)
+        return;
+
+    compute_pixels(worker, batch->dx, batch->dy, batch->count, result,
+                   smooth ? result_smooth : NULL,
+                   orbit ? &result_orbit : NULL);
+    for (int i = 0; i < batch->count; i++) {
+        iterations[batch->index[i]] = result[i];
+        if (smooth)
+            smooth[batch->index[i]] = result_smooth[i];
+        if (orbit) {
+            orbit->x[batch->index[i]] = zx[i];
+            orbit->y[batch->index[i]] = zy[i];
+        }
+    }
+    batch->count = 0;
+}
+
+/**
+ * Mariani-Silver subdivision of the rectangle (x0, y0) - (x1, y1) of a
+ * tile, corners included: the border is computed and, if every pixel of
+ * the border has the same iterations, the inside is filled with them
+ * (the Mandelbrot and the filled Julia sets are connected so no detail
+ * can be hidden inside). Otherwise the rectangle is split in four.
+ * 'iterations' contains -1 for the pixels not computed yet and -2 for
+ * the pixels waiting in the batch. With 'smooth' only the rectangles
+ * inside the set are filled, the fractional part varies in the others
+ */
+static void tile_subdivide(const fractal_tile_t *tile, int *iterations,
+                           float *smooth, fractal_orbit_t *orbit,
+                           pixel_batch_t *batch, int x0, int y0, int x1,
+                           int y1, fractal_worker_t *worker) {
+    fractal_ctx_t *ctx = worker->ctx;
+    int width = tile->width, value, uniform = 1;
+
+    for (int col = x0; col <= x1; col++) {
+        batch_add(tile, iterations, smooth, orbit, batch, col, y0, worker);
+        batch_add(tile, iterations, smooth, orbit, batch, col, y1, worker);
+    }
+    for (int row = y0 + 1; row < y1; row++) {
+        batch_add(tile, iterations, smooth, orbit, batch, x0, row, worker);
+        batch_add(tile, iterations, smooth, orbit, batch, x1, row, worker);
+    }
+
+    if (x1 - x0 < 2 || y1 - y0 < 2)
+        return; // no inside
+
+    // the border is needed now
+    batch_flush(iterations, smooth, orbit, batch, worker);
+
+    value = iterations[y0 * width + x0];
+    uniform = !smooth || value >= ctx->kernel_params.max_iterations;
+    for (int col = x0; col <= x1 && uniform; col++)
+        uniform = iterations[y0 * width + col] == value &&
+                  iterations[y1 * width + col] == value;
+    for (int row = y0 + 1; row < y1 && uniform; row++)
+        uniform = iterations[row * width + x0] == value &&
+                  iterations[row * width + x1] == value;
+
+    if (uniform) {
+        for (int row = y0 + 1; row < y1; row++) {
+            for (int col = x0 + 1; col < x1; col++) {
+                iterations[row * width + col] = value;
+                if (smooth)
+                    smooth[row * width + col] = 0.0f;
+            }
+        }
+        worker->counters.filled += (long)(x1 - x0 - 1) * (y1 - y0 - 1);
+        return;
+    }
+
+    if (x1 - x0 < SUBDIVISION_MIN_SIZE || y1 - y0 < SUBDIVISION_MIN_SIZE) {
+        // too small to be split again, nobody else reads these pixels so
+        // they can stay in the batch together with the next ones
+        for (int row = y0 + 1; row < y1; row++)
+            for (int col = x0 + 1; col < x1; col++)
+                batch_add(tile, iterations, smooth, orbit, batch, col, row,
+                          worker);
+        return;
+    }
+
+    int mx = (x0 + x1) / 2, my = (y0 + y1) / 2;
+    tile_subdivide(tile, iterations, smooth, orbit, batch, x0, y0, mx, my,
+                   worker);
+    tile_subdivide(tile, iterations, smooth, orbit, batch, mx, y0, x1, my,
+                   worker);
+    tile_subdivide(tile, iterations, smooth, orbit, batch, x0, my, mx, y1,
+                   worker);
+    tile_subdivide(tile, iterations, smooth, orbit, batch, mx, my, x1, y1,
+                   worker);
+}
+
+/**
+ * Returns -1 if the center strings are not valid
+ */
+static int mb_prepare(fractal_ctx_t *ctx, fractal_config_t *config) {
+    fractal_config_t c = *config;
+    fractal_big_t center_x, center_y;
+
+    if (c.center_x || c.center_y) {
+        if (fractal_big_from_string(&center_x, c.center_x) ||
+            fractal_big_from_string(&center_y, c.center_y)) {
+            fprintf(stderr, "Invalid center coordinates\n");
+            return -1;
+        }
+    }
+
+    if (c.use_julia) {
+        // use Julia
+        ctx->use_julia = 1;
+        ctx->julia_x0 = c.x;
+        ctx->julia_y0 = c.y;
+        ctx->zoom = c.julia_zoom * c.height / 2.0;
+
+        ctx->tx = c.julia_x;
+        ctx->ty = c.julia_y;
+    } else {
+        // use Mandelbrot
+        ctx->use_julia = 0;
+        ctx->tx = c.x;
+        ctx->ty = c.y;
+        ctx->zoom = c.zoom * c.height / 2.0;
+    }
+
+    ctx->width = c.width;
+    ctx->height = c.height;
+    ctx->center_col = c.width / 2.0;
+    ctx->center_row = c.height / 2.0;
+
+    // the strings keep the digits lost by the doubles
+    if (c.center_x || c.center_y) {
+        ctx->center_x = center_x;
+        ctx->center_y = center_y;
+        ctx->tx = fractal_big_to_double(&center_x);
+        ctx->ty = fractal_big_to_double(&center_y);
+    } else {
+        fractal_big_from_double(&ctx->center_x, ctx->tx);
+        fractal_big_from_double(&ctx->center_y, ctx->ty);
+    }
+    fractal_big_to_double_double(&ctx->center_x, ctx->kernel_params.center_x);
+    fractal_big_to_double_double(&ctx->center_y, ctx->kernel_params.center_y);
+
+    ctx->kernel_params.julia_x = ctx->julia_x0;
+    ctx->kernel_params.julia_y = ctx->julia_y0;
+    ctx->kernel_params.use_julia = ctx->use_julia;
+    ctx->kernel_params.interior_check = c.interior_check;
+    ctx->render_mode = c.render_mode;
+    ctx->config_precision = c.precision;
+    ctx->smooth = c.smooth;
+    ctx->band_rows = c.band_rows > 0 ? c.band_rows : DEFAULT_BAND_ROWS;
+    ctx->keep_iterations = c.keep_iterations;
+    ctx->png_level = c.png_level;
+    ctx->png_filter = c.png_filter;
+
+    // estimated by mb_prepare_frame
+    ctx->auto_iterations = c.max_iterations == FRACTAL_ITERATIONS_AUTO;
+    ctx->estimated = 0;
+    if (!ctx->auto_iterations)
+        mb_set_max_iterations(ctx, c.max_iterations);
+
+    // the view has changed
+    fractal_reference_free(ctx->reference);
+    ctx->reference = NULL;
+    mb_keep_config(ctx, &c);
+    return 0;
+}
+
+/**
+ * Replaces the configuration kept in the context with a copy of 'config'
+ * (NULL to free it)
+ */
+static void mb_keep_config(fractal_ctx_t *ctx, const fractal_config_t *config) {
+    free((char *)ctx->config.center_x);
+    free((char *)ctx->config.center_y);
+    memset(&ctx->config, 0, sizeof(fractal_config_t));
+    if (!config)
+        return;
+
+    ctx->config = *config;
+    ctx->config.center_x = mb_copy_string(config->center_x);
+    ctx->config.center_y = mb_copy_string(config->center_y);
+}
+
+/**
+ * Replaces the settings of the encoder kept in the context with those of
+ * 'video_config' (NULL to free them)
+ */
+static void mb_keep_encoder(fractal_ctx_t *ctx,
+                            const mb_video_config_t *video_config) {
+    free((char *)ctx->encoder.preset);
+    free((char *)ctx->encoder.tune);
+    memset(&ctx->encoder, 0, sizeof(VideoEncoderConfig));
+    if (!video_config)
+        return;
+
+    // the codecs are in the same order
+    ctx->encoder.codec = (VideoCodec)video_config->codec;
+    ctx->encoder.preset = mb_copy_string(video_config->preset);
+    ctx->encoder.tune = mb_copy_string(video_config->tune);
+    ctx->encoder.crf = video_config->crf;
+    ctx->encoder.gop = video_config->gop;
+    ctx->encoder.threads = video_config->encoder_threads;
+    ctx->encoder.slices = video_config->slices;
+}
+
+static char *mb_copy_string(const char *string) {
+    char *copy;
+
+    if (!string)
+        return NULL;
+    copy = malloc(strlen(string) + 1);
+    strcpy(copy, string);
+    return copy;
+}
+
+/**
+ * Sets max_iterations of the kernels and of the palette
+ */
+static void mb_set_max_iterations(fractal_ctx_t *ctx, int max_iterations) {
+    ctx->kernel_params.max_iterations = max_iterations;
+    ctx->max_iterations = max_iterations;
+    fractal_palette_init(&ctx->palette, max_iterations);
+}
+
+/**
+ * Chooses the precision, max_iterations (if automatic) and the kernel for
+ * the current zoom and computes the reference orbit if needed
+ */
+static void mb_prepare_frame(fractal_ctx_t *ctx) {
+    const char *kernel_name = NULL;
+
+    ctx->precision = ctx->config_precision;
+    if (ctx->precision == FRACTAL_PRECISION_AUTO)
+        ctx->precision = mb_choose_precision(ctx);
+    if (ctx->auto_iterations)
+        mb_estimate_iterations(ctx);
+
+    mb_select_kernel(ctx, &kernel_name);
+
+    // the coordinates depend on the precision
+    mb_prepare_mirror(ctx);
+
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Precision: %s, kernel: %s\n",
+            fractal_precision_name(ctx->precision),
+            kernel_name ? kernel_name : "none");
+#endif
+
+    if (ctx->precision == FRACTAL_PRECISION_PERTURBATION)
+        mb_prepare_reference(ctx);
+}
+
+/**
+ * Selects the kernel of the precision of the frame
+ */
+static void mb_select_kernel(fractal_ctx_t *ctx, const char **name) {
+    if (ctx->precision == FRACTAL_PRECISION_FLOAT)
+        ctx->kernel = fractal_kernel_select(FRACTAL_KERNEL_FLOAT, name);
+    else if (ctx->precision == FRACTAL_PRECISION_DOUBLE)
+        ctx->kernel = fractal_kernel_select(FRACTAL_KERNEL_DOUBLE, name);
+    else if (ctx->precision == FRACTAL_PRECISION_DOUBLE_DOUBLE)
+        ctx->kernel =
+            fractal_kernel_select(FRACTAL_KERNEL_DOUBLE_DOUBLE, name);
+}
+
+/**
+ * Computes the reference orbit of the center up to the max_iterations of
+ * kernel_params. The orbit does not depend on the zoom, so the next
+ * frames of a video reuse it until more precision or more iterations
+ * are needed. The frame contexts of a video share the orbit of the video,
+ * prepared in the order of the frames: it is the same whatever frame
+ * context renders a frame
+ */
+static void mb_prepare_reference(fractal_ctx_t *ctx) {
+    fractal_ctx_t *owner = ctx->parent ? ctx->parent : ctx;
+    int limbs = fractal_big_limbs_for_zoom(ctx->zoom);
+
+    if (!owner->reference || limbs > owner->reference_limbs ||
+        ctx->kernel_params.max_iterations > owner->reference_iterations) {
+        fractal_reference_free(owner->reference);
+        owner->reference =
+            fractal_reference_new(&ctx->center_x, &ctx->center_y, 0.0, 0.0,
+                                  &ctx->kernel_params, limbs);
+        owner->reference_limbs = limbs;
+        owner->reference_iterations = ctx->kernel_params.max_iterations;
+
+#ifdef DEBUG
+        fprintf(stderr, " [DD] Reference orbit: %d iterations, %d bits\n",
+                owner->reference->length, 32 * limbs);
+#endif
+    }
+
+    if (owner == ctx || ctx->reference == owner->reference)
+        return;
+    fractal_reference_free(ctx->reference);
+    ctx->reference = fractal_reference_ref(owner->reference);
+    ctx->reference_limbs = owner->reference_limbs;
+    ctx->reference_iterations = owner->reference_iterations;
+}
+
+/**
+ * Chooses max_iterations for the current view from a low resolution
+ * sample of it (see mb_probe_iterations). If the estimate reaches the
+ * limit of the probe, the pixels escape later than the probe can tell and
+ * it is done again with a higher limit. The probe of a video frame
+ * starts from a few times the limit of the last frame, that is kept
+ * while the estimate stays close to it (see AUTO_HYSTERESIS)
+ */
+static void mb_estimate_iterations(fractal_ctx_t *ctx) {
+    int limit = ctx->estimated * 4, estimate;
+
+    limit = limit < AUTO_PROBE_ITERATIONS ? AUTO_PROBE_ITERATIONS : limit;
+    limit = limit > AUTO_MAX_ITERATIONS ? AUTO_MAX_ITERATIONS : limit;
+    for (;;) {
+        estimate = mb_probe_iterations(ctx, limit);
+        if (estimate < limit || limit == AUTO_MAX_ITERATIONS)
+            break;
+        limit = limit > AUTO_MAX_ITERATIONS / 4 ? AUTO_MAX_ITERATIONS
+                                                : limit * 4;
+    }
+
+    estimate = estimate < AUTO_MIN_ITERATIONS ? AUTO_MIN_ITERATIONS : estimate;
+    estimate = estimate > AUTO_MAX_ITERATIONS ? AUTO_MAX_ITERATIONS : estimate;
+    if (ctx->estimated && estimate <= ctx->estimated * AUTO_HYSTERESIS &&
+        estimate * AUTO_HYSTERESIS >= ctx->estimated)
+        estimate = ctx->estimated;
+
+#ifdef DEBUG
+    if (estimate != ctx->estimated)
+        fprintf(stderr, " [DD] Max iterations: %d (probe limit: %d)\n",
+                estimate, limit);
+#endif
+
+    ctx->estimated = estimate;
+    mb_set_max_iterations(ctx, estimate);
+}
+
+/**
+ * Iterates a grid of at most AUTO_PROBE_COLUMNS x AUTO_PROBE_COLUMNS
+ * pixels spread over the frame up to 'limit' with the precision of the
+ * frame and returns the max_iterations that most of the pixels escaping
+ * before 'limit' need (see AUTO_QUANTILE and AUTO_MARGIN). The interior
+ * check is always done, it only stops the pixels that never escape
+ * earlier
+ */
+static int mb_probe_iterations(fractal_ctx_t *ctx, int limit) {
+    fractal_kernel_params_t params = ctx->kernel_params;
+    fractal_worker_t worker = {0};
+    double dx[AUTO_PROBE_COLUMNS], dy[AUTO_PROBE_COLUMNS], row_dy;
+    int iterations[AUTO_PROBE_COLUMNS], *escaped, count = 0, quantile;
+    int columns = ctx->width < AUTO_PROBE_COLUMNS ? ctx->width
+                                                  : AUTO_PROBE_COLUMNS;
+    int rows = (int)lround((double)columns * ctx->height / ctx->width);
+
+    rows = rows > AUTO_PROBE_COLUMNS ? AUTO_PROBE_COLUMNS : rows;
+    rows = rows < 1 ? 1 : (rows > ctx->height ? ctx->height : rows);
+    escaped = malloc(sizeof(int) * columns * rows);
+
+    ctx->kernel_params.max_iterations = limit;
+    ctx->kernel_params.interior_check = 1;
+    mb_select_kernel(ctx, NULL);
+    if (ctx->precision == FRACTAL_PRECISION_PERTURBATION)
+        mb_prepare_reference(ctx);
+    worker.ctx = ctx;
+
+    // the centers of the cells, with the offsets of tile_compute_span
+    for (int row = 0; row < rows; row++) {
+        row_dy = -(((row + 0.5) * ctx->height / rows - ctx->height / 2.0) /
+                   ctx->zoom);
+        for (int i = 0; i < columns; i++) {
+            dx[i] = ((i + 0.5) * ctx->width / columns - ctx->width / 2.0) /
+                    ctx->zoom;
+            dy[i] = row_dy;
+        }
+
+        compute_pixels(&worker, dx, dy, columns, iterations, NULL, NULL);
+        for (int i = 0; i < columns; i++) {
+            // the glitched perturbation pixels are negative
+            if (iterations[i] >= 0 && iterations[i] < limit)
+                escaped[count++] = iterations[i];
+        }
+    }
+
+    for (int i = 0; i < worker.reference_count; i++)
+        fractal_reference_free(worker.references[i]);
+    ctx->kernel_params = params;
+
+    if (!count) {
+        free(escaped);
+        return 0; // nothing escapes, any limit shows the same frame
+    }
+
+    qsort(escaped, count, sizeof(int), compare_int);
+    quantile = escaped[(int)(AUTO_QUANTILE * (count - 1))];
+    free(escaped);
+    return (int)(AUTO_MARGIN * (quantile + 1));
+}
+
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Returns the fastest precision that can tell the pixels of the frame
+ * apart. The orbits reach |z| = 2 and the pixels are 1 / zoom wide,
+ * so about log2(2 * zoom + width) bits are needed.
+ * Double-double is never chosen: perturbation iterates in double and is
+ * several times faster, double-double is there to render without glitches
+ */
+static fractal_precision_t mb_choose_precision(fractal_ctx_t *ctx) {
+    double bits = log2(2.0 * ctx->zoom + ctx->width);
+
+    if (bits <= FLOAT_MAX_BITS)
+        return FRACTAL_PRECISION_FLOAT;
+    if (bits <= DOUBLE_MAX_BITS)
+        return FRACTAL_PRECISION_DOUBLE;
+    return FRACTAL_PRECISION_PERTURBATION;
+}
+
+/**
+ * Finds the pixels that are the mirror of other pixels of the frame: the
+ * Mandelbrot set is symmetric about the real axis and every Julia set
+ * about the origin, so their iterations are the same. A pixel is mirrored
+ * only if its coordinates are exactly the opposite of the coordinates of
+ * its source, as computed by the render
+ */
+static void mb_prepare_mirror(fractal_ctx_t *ctx) {
+    int x0 = 0, x1 = ctx->width - 1;
+
+    // empty
+    ctx->mirror_x0 = ctx->mirror_y0 = 0;
+    ctx->mirror_x1 = ctx->mirror_y1 = -1;
+
+    // the sources have left the window of the photo
+    if (ctx->window_rows)
+        return;
+    if (!mb_mirror_axis(ctx, 1, &ctx->mirror_y))
+        return;
+    if (ctx->use_julia) {
+        if (!mb_mirror_axis(ctx, 0, &ctx->mirror_x))
+            return;
+        x0 = ctx->mirror_x - (ctx->width - 1);
+        x0 = x0 < 0 ? 0 : x0;
+        x1 = ctx->mirror_x < x1 ? ctx->mirror_x : x1;
+    }
+
+    // the rows after the axis, their sources are before it
+    ctx->mirror_x0 = x0;
+    ctx->mirror_x1 = x1;
+    ctx->mirror_y0 = ctx->mirror_y / 2 + 1;
+    ctx->mirror_y1 =
+        ctx->mirror_y < ctx->height - 1 ? ctx->mirror_y : ctx->height - 1;
+}
+
+/**
+ * Looks for the index 'mirror' so that the pixel 'mirror - i' is the
+ * opposite of the pixel 'i' on the rows (vertical) or on the columns,
+ * returns 0 if there is none or if it is not exact
+ */
+static int mb_mirror_axis(fractal_ctx_t *ctx, int vertical, int *mirror) {
+    int size = vertical ? ctx->height : ctx->width;
+    double center = vertical ? ctx->ty : ctx->tx, k, a, b;
+    double middle = vertical ? ctx->center_row : ctx->center_col;
+    const double *dd_center =
+        vertical ? ctx->kernel_params.center_y : ctx->kernel_params.center_x;
+
+    // the other precisions add the offsets to the exact center
+    if (ctx->precision != FRACTAL_PRECISION_FLOAT &&
+        ctx->precision != FRACTAL_PRECISION_DOUBLE) {
+        if (dd_center[0] != 0.0 || dd_center[1] != 0.0)
+            return 0;
+        center = 0.0;
+    }
+
+    // center + offset(mirror - i) = -(center + offset(i))
+    k = 2.0 * middle + (vertical ? 2.0 : -2.0) * center * ctx->zoom;
+    if (!(k >= 1.0 && k <= 2.0 * size - 3.0) || k != floor(k))
+        return 0; // no pixel has a mirror in the frame
+
+    *mirror = (int)k;
+    for (int i = *mirror - (size - 1) > 0 ? *mirror - (size - 1) : 0;
+         i < size && i <= *mirror; i++) {
+        a = center + mb_pixel_offset(ctx, vertical, i);
+        b = center + mb_pixel_offset(ctx, vertical, *mirror - i);
+        if (a != -b)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Offset from the center of the pixel 'i' of the rows (vertical) or of
+ * the columns, with the same operations of tile_compute_span
+ */
+static double mb_pixel_offset(fractal_ctx_t *ctx, int vertical, int i) {
+    if (vertical)
+        return -((i - ctx->center_row) / ctx->zoom);
+    return (i - ctx->center_col) / ctx->zoom;
+}
+
+/**
+ * (Re)allocates the iteration buffers of a frame of the current size, or
+ * of the window of the photo (see window_rows)
+ */
+static void mb_alloc_frame(fractal_ctx_t *ctx) {
+    long pixels = (long)ctx->width *
+                  (ctx->window_rows ? ctx->window_rows : ctx->height);
+
+    free(ctx->iteration_data);
+    free(ctx->smooth_data);
+    ctx->iteration_data = malloc(sizeof(int) * pixels);
+    ctx->smooth_data = ctx->smooth ? malloc(sizeof(float) * pixels) : NULL;
+}
+
+/**
+ * Continues the last photo if only max_iterations has grown since then:
+ * its pixels that escaped keep their iterations and the others are
+ * resumed from their orbits (see tile_resume). Otherwise allocates the
+ * buffers of a new frame, and keeps the orbits if the precision allows
+ * it (the double-double and perturbation orbits do not fit in doubles).
+ * Both need the whole photo, not a window. 'recolorable' tells if the
+ * last photo was complete
+ */
+static void mb_prepare_resume(fractal_ctx_t *ctx, int recolorable) {
+    fractal_view_t view = mb_view(ctx);
+
+    ctx->resume = 0;
+    if (recolorable && !ctx->window_rows && ctx->orbits &&
+        ctx->max_iterations > ctx->orbits_max &&
+        (ctx->smooth_data || !ctx->smooth) &&
+        mb_same_view(&view, &ctx->orbits_view))
+        ctx->resume = ctx->orbits_max;
+    if (ctx->resume) {
+        if (!ctx->smooth) {
+            free(ctx->smooth_data);
+            ctx->smooth_data = NULL;
+        }
+    } else {
+        mb_free_orbits(ctx);
+        mb_alloc_frame(ctx);
+        if (!ctx->window_rows &&
+            (ctx->precision == FRACTAL_PRECISION_FLOAT ||
+             ctx->precision == FRACTAL_PRECISION_DOUBLE)) {
+            ctx->orbit_tiles = ctx->tiles->count;
+            ctx->orbits = calloc(ctx->orbit_tiles, sizeof(orbit_list_t));
+        }
+    }
+
+    ctx->orbits_view = view;
+    ctx->orbits_max = ctx->max_iterations;
+
+#ifdef DEBUG
+    if (ctx->resume)
+        fprintf(stderr, " [DD] Resuming the last photo\n");
+#endif
+}
+
+static fractal_view_t mb_view(fractal_ctx_t *ctx) {
+    fractal_view_t view;
+
+    view.width = ctx->width;
+    view.height = ctx->height;
+    view.use_julia = ctx->use_julia;
+    view.tx = ctx->tx;
+    view.ty = ctx->ty;
+    view.julia_x0 = ctx->julia_x0;
+    view.julia_y0 = ctx->julia_y0;
+    view.zoom = ctx->zoom;
+    view.precision = ctx->precision;
+    return view;
+}
+
+static int mb_same_view(const fractal_view_t *a, const fractal_view_t *b) {
+    return a->width == b->width && a->height == b->height &&
+           a->use_julia == b->use_julia && a->tx == b->tx && a->ty == b->ty &&
+           a->julia_x0 == b->julia_x0 && a->julia_y0 == b->julia_y0 &&
+           a->zoom == b->zoom && a->precision == b->precision;
+}
+
+static void mb_free_orbits(fractal_ctx_t *ctx) {
+    ctx->resume = 0;
+    if (!ctx->orbits)
+        return;
+
+    for (int i = 0; i < ctx->orbit_tiles; i++)
+        free(ctx->orbits[i].pixels);
+    free(ctx->orbits);
+    ctx->orbits = NULL;
+    ctx->orbit_tiles = 0;
+}
+
+/**
+ * Copies the mirrored pixels of the rows from 'first' to 'last' (included)
+ * from their sources, that are rendered by the workers and come before
+ * them
+ */
+static void mb_mirror_image(fractal_ctx_t *ctx, int first, int last) {
+    mb_mirror_buffer(ctx, ctx->iteration_data, sizeof(int), first, last);
+    if (ctx->smooth_data)
+        mb_mirror_buffer(ctx, ctx->smooth_data, sizeof(float), first, last);
+}
+
+/**
+ * Same as mb_mirror_image on a buffer with 'size' bytes per pixel
+ */
+static void mb_mirror_buffer(fractal_ctx_t *ctx, void *data, int size,
+                             int first, int last) {
+    int x0 = ctx->mirror_x0, x1 = ctx->mirror_x1;
+    uint8_t *dst, *src;
+
+    first = first > ctx->mirror_y0 ? first : ctx->mirror_y0;
+    last = last < ctx->mirror_y1 ? last : ctx->mirror_y1;
+    for (int row = first; row <= last; row++) {
+        dst = (uint8_t *)data + size * ((long)row * ctx->width + x0);
+        src = (uint8_t *)data + size * (long)(ctx->mirror_y - row) * ctx->width;
+        if (!ctx->use_julia) {
+            memcpy(dst, src + size * x0, size * (x1 - x0 + 1));
+            continue;
+        }
+
+        // the columns are reversed too
+        src += size * (ctx->mirror_x - x0);
+        for (int col = x0; col <= x1; col++, dst += size, src -= size)
+            memcpy(dst, src, size);
+    }
+}
+
+/**
+ * Colors the iterations of the frame in image_data, shifted by 'offset'
+ * colors of the palette
+ */
+static void mb_colorize(fractal_ctx_t *ctx, int offset) {
+    fractal_colorize(&ctx->palette, ctx->iteration_data, ctx->smooth_data,
+                     (long)ctx->width * ctx->height, offset, ctx->image_data);
+}
+
+/**
+ * Colors the iterations of a video frame in a buffer of 'pool', in YUV
+ * 4:2:0 with the workers of the frame unless the video is in RGB. The
+ * buffer is image_data until the next frame. Returns NULL on error
+ */
+static AVBufferRef *mb_color_frame(fractal_ctx_t *ctx, VideoFramePool *pool,
+                                   int offset) {
+    AVBufferRef *buffer = video_frame_pool_get(pool);
+
+    if (!buffer)
+        return NULL;
+    ctx->image_data = buffer->data;
+    if (ctx->video_rgb) {
+        mb_colorize(ctx, offset);
+        return buffer;
+    }
+    ctx->color_offset = offset;
+    fractal_pool_run(ctx->pool, mb_colorize_yuv, ctx);
+    return buffer;
+}
+
+/**
+ * Colors the bands of YUV_BAND_ROWS rows of the frame given to 'worker'
+ * in the planes of image_data, one after the other (see video_send_buffer)
+ */
+static void mb_colorize_yuv(int worker, void *data) {
+    fractal_ctx_t *ctx = data;
+    int chroma_width = (ctx->width + 1) / 2, last;
+    int strides[3] = {ctx->width, chroma_width, chroma_width};
+    uint8_t *planes[3];
+
+    planes[0] = ctx->image_data;
+    planes[1] = planes[0] + (long)ctx->width * ctx->height;
+    planes[2] = planes[1] + (long)chroma_width * ((ctx->height + 1) / 2);
+    for (int first = worker * YUV_BAND_ROWS; first < ctx->height;
+         first += ctx->pool->size * YUV_BAND_ROWS) {
+        last = first + YUV_BAND_ROWS;
+        fractal_pool_acquire_core();
+        fractal_colorize_yuv(&ctx->palette, ctx->iteration_data,
+                             ctx->smooth_data, ctx->width, ctx->height, first,
+                             last < ctx->height ? last : ctx->height,
+                             ctx->color_offset, planes, strides);
+        fractal_pool_release_core();
+    }
+}
+
+/**
+ * Bytes of a video frame in image_data
+ */
+static size_t mb_frame_bytes(fractal_ctx_t *ctx) {
+    if (ctx->video_rgb)
+        return (size_t)ctx->width * ctx->height * 3;
+    return (size_t)ctx->width * ctx->height +
+           (size_t)2 * ((ctx->width + 1) / 2) * ((ctx->height + 1) / 2);
+}
+
+/**
+ * Pool of the buffers of the video frames with 'size' bytes, reused by
+ * the next videos of the same size
+ */
+static VideoFramePool *mb_get_frame_pool(fractal_ctx_t *ctx, size_t size) {
+    if (ctx->frame_pool && ctx->frame_pool->size != size) {
+        video_frame_pool_free(ctx->frame_pool);
+        ctx->frame_pool = NULL;
+    }
+    if (!ctx->frame_pool)
+        ctx->frame_pool = video_frame_pool_new(size);
+    return ctx->frame_pool;
+}
+
+static void mb_update_stats(fractal_ctx_t *ctx) {
+    fractal_stats_t *stats = &ctx->stats;
+    fractal_counters_t *counters = &ctx->frame_counters;
+
+    pthread_mutex_lock(&ctx->stats_lock);
+    stats->tiles = ctx->tiles->count;
+    stats->steals = fractal_tiles_steals(ctx->tiles);
+    stats->imbalance = fractal_tiles_imbalance(ctx->tiles);
+    stats->interior_pixels = counters->interior;
+    stats->filled_fraction =
+        (double)counters->filled / ((long)ctx->width * ctx->height);
+    stats->references = ctx->precision == FRACTAL_PRECISION_PERTURBATION
+                            ? 1 + (int)counters->references
+                            : 0;
+    stats->precision = ctx->precision;
+    stats->glitched_pixels = counters->glitched;
+    stats->resumed_pixels = counters->resumed;
+    stats->cached_tiles = (int)counters->cached;
+    stats->queue_depth = stats->render_wait = stats->encode_wait = 0.0;
+    stats->frame_buffers_allocated = stats->frame_buffers_reused = 0;
+    stats->max_iterations = ctx->max_iterations;
+    stats->mirrored_fraction =
+        ctx->mirror_x0 > ctx->mirror_x1
+            ? 0.0
+            : (double)(ctx->mirror_x1 - ctx->mirror_x0 + 1) *
+                  (ctx->mirror_y1 - ctx->mirror_y0 + 1) /
+                  ((long)ctx->width * ctx->height);
+    *counters = (fractal_counters_t){0};
+    pthread_mutex_unlock(&ctx->stats_lock);
+
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Tiles: %d, steals: %d, load imbalance: %.1f %%\n",
+            stats->tiles, stats->steals, stats->imbalance * 100.0);
+    fprintf(stderr, " [DD] Interior pixels short-circuited: %ld\n",
+            stats->interior_pixels);
+    fprintf(stderr, " [DD] Pixels filled by subdivision: %.1f %%\n",
+            stats->filled_fraction * 100.0);
+    if (stats->references)
+        fprintf(stderr, " [DD] Reference orbits: %d, glitched pixels: %ld\n",
+                stats->references, stats->glitched_pixels);
+    if (stats->resumed_pixels)
+        fprintf(stderr, " [DD] Pixels resumed: %ld\n", stats->resumed_pixels);
+    if (stats->cached_tiles)
+        fprintf(stderr, " [DD] Tiles from the cache: %d\n",
+                stats->cached_tiles);
+    if (stats->mirrored_fraction > 0.0)
+        fprintf(stderr, " [DD] Pixels mirrored: %.1f %%, speedup: %.2fx\n",
+                stats->mirrored_fraction * 100.0,
+                1.0 / (1.0 - stats->mirrored_fraction));
+#endif
+}
+
+/**
+ * Copies the statistics of the queue of the encoder and of the frame
+ * buffers in the ones of the frame
+ */
+static void mb_video_stats(fractal_ctx_t *ctx, VideoCtx *video_ctx) {
+    fractal_stats_t *stats = &ctx->stats;
+    VideoStats video_stats;
+    int64_t requests, allocations;
+
+    video_get_stats(video_ctx, &video_stats);
+    video_frame_pool_counts(ctx->frame_pool, &requests, &allocations);
+    pthread_mutex_lock(&ctx->stats_lock);
+    stats->queue_depth = video_stats.queue_depth;
+    stats->render_wait = video_stats.send_wait;
+    stats->encode_wait = video_stats.encode_wait;
+    stats->frame_buffers_allocated = allocations;
+    stats->frame_buffers_reused = requests - allocations;
+    pthread_mutex_unlock(&ctx->stats_lock);
+}
+
+static void mb_new_default_ctx() { mb_default_ctx = fractal_ctx_new(); }
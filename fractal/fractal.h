@@ -6,11 +6,46 @@
 
 #define PROGRESS_DELAY_NANOSECONDS 100 * 1000 * 1000 // 100 ms
 
+// max_iterations chosen for every frame from the view
+#define FRACTAL_ITERATIONS_AUTO 0
+
 /**
  * Errors generated by public functions
  */
 typedef enum { MB_OK, MB_EXEC, MB_ERROR } fractal_error_t;
 
+/**
+ * How the pixels of a frame are computed
+ */
+typedef enum {
+    FRACTAL_RENDER_FULL,       // every pixel is iterated
+    FRACTAL_RENDER_SUBDIVISION // Mariani-Silver rectangle subdivision
+} fractal_render_mode_t;
+
+/**
+ * Arithmetic used to iterate the pixels, from the fastest to the most
+ * precise
+ */
+typedef enum {
+    FRACTAL_PRECISION_AUTO,          // chosen from the zoom and the width
+    FRACTAL_PRECISION_FLOAT,         // 24 bits, shallow zooms only
+    FRACTAL_PRECISION_DOUBLE,        // 53 bits
+    FRACTAL_PRECISION_DOUBLE_DOUBLE, // about 106 bits
+    FRACTAL_PRECISION_PERTURBATION   // deltas from a reference orbit
+} fractal_precision_t;
+
+/**
+ * PNG filter applied to the rows of a photo before the compression
+ */
+typedef enum {
+    FRACTAL_PNG_FILTER_AUTO, // the smallest filter of every row, like libpng
+    FRACTAL_PNG_FILTER_NONE,
+    FRACTAL_PNG_FILTER_SUB,
+    FRACTAL_PNG_FILTER_UP,
+    FRACTAL_PNG_FILTER_AVERAGE,
+    FRACTAL_PNG_FILTER_PAETH
+} fractal_png_filter_t;
+
 /**
  * Configuration used to generate an image (or video frame)
  */
@@ -24,10 +59,68 @@ typedef struct {
     int use_julia;
     int width;
     int height;
-    int max_iterations;
+    int max_iterations; // FRACTAL_ITERATIONS_AUTO to estimate it
     int threads;
+
+    // skip the main cardioid, the period-2 bulb and periodic orbits
+    int interior_check;
+    fractal_render_mode_t render_mode;
+
+    // decimal strings of the center (x, y or julia_x, julia_y with Julia)
+    // with any number of digits, for deep zooms. NULL to use the doubles
+    const char *center_x, *center_y;
+
+    // FRACTAL_PRECISION_AUTO to choose it for every frame
+    fractal_precision_t precision;
+
+    // blend the colors with the fractional iterations (no bands)
+    int smooth;
+
+    // rows of a photo colored and written to the file at a time, 0 for
+    // the default: the colors of the whole photo are never in memory
+    int band_rows;
+
+    // zlib level of photos from 1 (fastest) to 9 (smallest), 0 for the
+    // default. The bands of rows are compressed by 'threads' workers
+    int png_level;
+    fractal_png_filter_t png_filter;
+
+    // 1 to keep the iterations of the whole photo, for
+    // fractal_recolor_photo, fractal_save_field, mirroring the symmetric
+    // pixels and resuming the next photo if only max_iterations grows.
+    // -1 to render it in a window of at least band_rows rows reused once
+    // they are written, so the memory does not grow with its height,
+    // without those. 0 for the default: they are kept if they take at
+    // most 512 MiB (e.g. an 8K photo with smooth)
+    int keep_iterations;
 } fractal_config_t;
 
+/**
+ * What changes between the frames of a video
+ */
+typedef enum {
+    MB_VIDEO_ZOOM,         // every frame is rendered with a new zoom
+    MB_VIDEO_PALETTE_CYCLE // the first frame is colored again and again
+} mb_video_mode_t;
+
+/**
+ * Codec of a video
+ */
+typedef enum {
+    MB_VIDEO_CODEC_HEVC,
+    MB_VIDEO_CODEC_H264,
+    MB_VIDEO_CODEC_FFV1 // lossless, needs a container like Matroska (.mkv)
+} mb_video_codec_t;
+
+/**
+ * Ready-made settings of the encoder (see fractal_video_profile)
+ */
+typedef enum {
+    MB_VIDEO_PROFILE_DEFAULT, // HEVC with the defaults of the encoder
+    MB_VIDEO_PROFILE_DRAFT,   // fastest H.264, to preview a video
+    MB_VIDEO_PROFILE_ARCHIVAL // FFV1, lossless and every frame a keyframe
+} mb_video_profile_t;
+
 /**
  * Configuration used to generate the video
  */
@@ -35,20 +128,146 @@ typedef struct {
     double zoom_start; // initial zoom value
     double zoom_step;  // zoom *= zoom_step every frame
     int frame_rate;    // frame rate
+
+    // with MB_VIDEO_PALETTE_CYCLE the palette moves by palette_step colors
+    // every frame (at least 1) and the video ends after a whole cycle
+    mb_video_mode_t mode;
+    int palette_step;
+
+    // 1 to color the frames in RGB and let the encoder convert them, 0 for
+    // the default: the workers color them straight in the YUV 4:2:0 of the
+    // encoder
+    int rgb_frames;
+
+    // encoder, 0 or NULL for its defaults: preset and tune of x264 and
+    // x265 (like "ultrafast" and "animation"), quality (lower is better,
+    // not used by FFV1), frames between keyframes (a quarter second by
+    // default), threads of the encoder and slices of every frame
+    mb_video_codec_t codec;
+    const char *preset, *tune;
+    int crf;
+    int gop;
+    int encoder_threads;
+    int slices;
 } mb_video_config_t;
 
-typedef void (*mb_on_progress_t)(float progress);
+/**
+ * Statistics of the last generated image (or video frame)
+ */
+typedef struct {
+    int tiles;              // number of tiles of the frame
+    int steals;             // blocks of tiles stolen by idle workers
+    double imbalance;       // slowest worker time / average worker time - 1
+    long interior_pixels;   // pixels short-circuited by the interior check
+    double filled_fraction; // pixels filled by the subdivision / all pixels
+    int references;         // perturbation reference orbits (0 if not used)
+    long glitched_pixels;   // perturbation glitches left unresolved
+
+    // arithmetic used by the frame, never FRACTAL_PRECISION_AUTO
+    fractal_precision_t precision;
+
+    // pixels copied from their symmetric pixel / all pixels, the frame
+    // needed 1 / (1 - mirrored_fraction) times less work
+    double mirrored_fraction;
+
+    // pixels of the last photo continued from where they stopped, the
+    // others kept their iterations (0 if the photo started over)
+    long resumed_pixels;
+
+    // tiles read from the tile cache instead of being rendered
+    int cached_tiles;
+
+    // encoder of the video so far: average frames waiting in its queue,
+    // seconds the render waited for room in the queue (encoding is
+    // slower) and the encoder waited for frames (rendering is slower)
+    double queue_depth;
+    double render_wait, encode_wait;
+
+    // buffers of the video frames allocated and reused by the context
+    // since its first video, the videos of the same size share them
+    long frame_buffers_allocated, frame_buffers_reused;
+
+    // max_iterations used by the frame, estimated with
+    // FRACTAL_ITERATIONS_AUTO
+    int max_iterations;
+} fractal_stats_t;
+
+/**
+ * Counters of the tile cache since it has been opened
+ */
+typedef struct {
+    long hits, misses, evictions;
+    int tiles;    // in the cache
+    int capacity; // tiles that fit in the cache
+} fractal_cache_stats_t;
+
+/**
+ * 'max_iterations' is the one used by the current frame, it changes
+ * during a video with FRACTAL_ITERATIONS_AUTO (0 until it is chosen)
+ */
+typedef void (*mb_on_progress_t)(float progress, int max_iterations);
 typedef void (*mb_on_save_t)(int is_success);
 
+/**
+ * Render context: owns the buffers, the palette and the workers of its
+ * exports, so exports of different contexts can run at the same time.
+ * The functions without a context use a default one
+ */
+typedef struct fractal_ctx fractal_ctx_t;
+
 /* Generates a photo and saves it on a file,
- * if on_progress is set then it will call for progress
- * if equals to 1 o greater indicates the saving part
+ * if on_progress is set then it will call for progress.
+ * The rows are written while the next ones are rendered, a stopped or
+ * failed photo leaves no file.
+ * If the last photo had the same view and a lower max_iterations, only
+ * its pixels that did not escape are iterated further.
+ * Returns MB_ERROR if the center strings are not valid numbers
  */
 extern fractal_error_t fractal_begin_photo(fractal_config_t *config,
                                            char *filename,
                                            mb_on_progress_t on_progress,
                                            mb_on_save_t on_save);
 
+/**
+ * Colors the iterations of the last photo again with the palette shifted
+ * by 'palette_offset' colors and saves it on a file, without rendering.
+ * Returns MB_EXEC if an export is running and MB_ERROR if there is no
+ * complete photo with its iterations kept (see keep_iterations) or it
+ * cannot be saved
+ */
+extern fractal_error_t fractal_recolor_photo(int palette_offset,
+                                             char *filename);
+
+/**
+ * Saves the iterations of the last photo and its configuration in the
+ * file 'filename', to color them again later without rendering (see
+ * fractal_field.h). 'level' is the zlib level from 1 to 9, or 0 to store
+ * them uncompressed, so they are used straight from the mapped file.
+ * Returns MB_EXEC if an export is running and MB_ERROR if there is no
+ * complete photo with its iterations kept (see keep_iterations) or it
+ * cannot be saved
+ */
+extern fractal_error_t fractal_save_field(int level, char *filename);
+
+/**
+ * Reads the iterations saved by fractal_save_field as the last photo, so
+ * fractal_recolor_photo colors them again. Returns MB_EXEC if an export
+ * is running and MB_ERROR if the file is not valid
+ */
+extern fractal_error_t fractal_load_field(char *filename);
+
+/**
+ * Colors the iterations saved by fractal_save_field with the palette
+ * shifted by 'palette_offset' colors and saves them in the photo
+ * 'png_filename', a chunk of rows at a time: the whole field is never in
+ * memory and without compression it is colored straight from the mapped
+ * file. Uses no context. Returns MB_ERROR if the field is not valid or
+ * the photo cannot be saved
+ */
+extern fractal_error_t fractal_field_to_png(char *field_filename,
+                                            int palette_offset,
+                                            char *png_filename);
+
 /* Generates a video using a specific configuration. For each frame
  * it will change only the zoom, as described in the video configuration.
  */
@@ -58,9 +277,139 @@ fractal_error_t fractal_begin_video(fractal_config_t *config,
                                     mb_on_progress_t on_progress,
                                     mb_on_save_t on_save);
 
+/**
+ * Generates a Deep Zoom pyramid of the image for zoomable viewers and
+ * images too large for a single file: 'filename'.dzi and the directory
+ * 'filename'_files with 256 x 256 PNG tiles at every level. The image is
+ * rendered a part at a time and the lower levels are downsampled from
+ * the tiles, the memory used does not depend on the size of the image.
+ * The tiles of an interrupted export of the same image are kept and not
+ * rendered again. The .dzi is written last, a stopped or failed export
+ * leaves its tiles without it.
+ * Returns MB_ERROR if the center strings are not valid numbers
+ */
+extern fractal_error_t fractal_begin_pyramid(fractal_config_t *config,
+                                             char *filename,
+                                             mb_on_progress_t on_progress,
+                                             mb_on_save_t on_save);
+
 /**
  * Stop the current operation
  */
 fractal_error_t mb_video_stop();
 
+/**
+ * Copy the statistics of the last generated image (or video frame)
+ */
+extern void fractal_get_stats(fractal_stats_t *stats);
+
+/**
+ * Creates a render context, returns NULL if there is not enough memory
+ */
+extern fractal_ctx_t *fractal_ctx_new();
+
+/**
+ * Stops the export of the context, waits until it ends and frees the
+ * context
+ */
+extern void fractal_ctx_free(fractal_ctx_t *ctx);
+
+/**
+ * Same as fractal_begin_photo with the context 'ctx'.
+ * Returns MB_EXEC if the context is already exporting
+ */
+extern fractal_error_t fractal_ctx_begin_photo(fractal_ctx_t *ctx,
+                                               fractal_config_t *config,
+                                               char *filename,
+                                               mb_on_progress_t on_progress,
+                                               mb_on_save_t on_save);
+
+/**
+ * Same as fractal_recolor_photo with the context 'ctx'
+ */
+extern fractal_error_t fractal_ctx_recolor_photo(fractal_ctx_t *ctx,
+                                                 int palette_offset,
+                                                 char *filename);
+
+/**
+ * Same as fractal_save_field with the context 'ctx'
+ */
+extern fractal_error_t fractal_ctx_save_field(fractal_ctx_t *ctx, int level,
+                                              char *filename);
+
+/**
+ * Same as fractal_load_field with the context 'ctx'
+ */
+extern fractal_error_t fractal_ctx_load_field(fractal_ctx_t *ctx,
+                                              char *filename);
+
+/**
+ * Same as fractal_begin_video with the context 'ctx'.
+ * Returns MB_EXEC if the context is already exporting
+ */
+extern fractal_error_t fractal_ctx_begin_video(fractal_ctx_t *ctx,
+                                               fractal_config_t *config,
+                                               mb_video_config_t *video_config,
+                                               char *filename,
+                                               mb_on_progress_t on_progress,
+                                               mb_on_save_t on_save);
+
+/**
+ * Same as fractal_begin_pyramid with the context 'ctx'.
+ * Returns MB_EXEC if the context is already exporting
+ */
+extern fractal_error_t fractal_ctx_begin_pyramid(fractal_ctx_t *ctx,
+                                                 fractal_config_t *config,
+                                                 char *filename,
+                                                 mb_on_progress_t on_progress,
+                                                 mb_on_save_t on_save);
+
+/**
+ * Stops the export of the context: a video is saved with the frames
+ * generated so far, a photo is not saved and on_save gets 0
+ */
+extern fractal_error_t fractal_ctx_stop(fractal_ctx_t *ctx);
+
+/**
+ * Copy the statistics of the last image (or video frame) of the context
+ */
+extern void fractal_ctx_get_stats(fractal_ctx_t *ctx, fractal_stats_t *stats);
+
+/**
+ * Sets the cores shared by the workers of every context, 0 for the number
+ * of online CPUs (the default). Exports started together never render
+ * more tiles at the same time than this
+ */
+extern void fractal_set_core_budget(int cores);
+
+/**
+ * Keeps the iterations of the rendered tiles in the file 'filename' (of
+ * at most 'max_bytes' bytes, 0 for 1 GiB) and reads them back instead of
+ * rendering again the tiles with the same pixels: the same view exported
+ * again, with another palette or at another size with the same pixels.
+ * When the file is full the least recently used tiles are replaced. The
+ * file is kept between the runs. NULL closes the cache.
+ * The tiles of the subdivision are not cached. Must not be called while
+ * an export is running. Returns MB_ERROR if the file cannot be opened
+ */
+extern fractal_error_t fractal_set_tile_cache(const char *filename,
+                                              long max_bytes);
+
+/**
+ * Copies the counters of the tile cache, 0 if there is none
+ */
+extern void fractal_get_cache_stats(fractal_cache_stats_t *stats);
+
+/**
+ * Name of the precision for logs, e.g. "double-double"
+ */
+extern const char *fractal_precision_name(fractal_precision_t precision);
+
+/**
+ * Sets the encoder of 'video_config' for 'profile', the other fields are
+ * left as they are
+ */
+extern void fractal_video_profile(mb_video_config_t *video_config,
+                                  mb_video_profile_t profile);
+
 #endif /* FRACTAL_H */
@@ -0,0 +1,271 @@
+/*
+ * Benchmark of the escape-time kernels: time per pixel of the kernel
+ * selected for each precision, fractal type and interior check, and its
+ * gain over the baseline, the scalar loop in double that rendered every
+ * pixel before the kernels.
+ * Before timing it checks the products of the perturbation big numbers
+ * against a reference product in 16 bit digits.
+ * Usage: fractal-bench [width height max_iterations repeat]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fractal_kernel.h"
+#include "fractal_perturb.h"
+#include "fractal_tiles.h"
+
+typedef struct {
+    const char *name;
+    fractal_kernel_precision_t precision;
+} bench_precision_t;
+
+// private functions
+static int check_big_mul(int count);
+static void reference_mul(fractal_big_t *r, const fractal_big_t *a,
+                          const fractal_big_t *b, int limbs);
+static int baseline_kernel(const fractal_kernel_params_t *params,
+                           const double *xc, const double *yc, int count,
+                           int *iterations, float *smooth,
+                           fractal_orbit_t *orbit);
+static double bench_kernel(fractal_kernel_t kernel,
+                           fractal_kernel_precision_t precision,
+                           const fractal_kernel_params_t *params, int width,
+                           int height, int repeat, long *checksum);
+static double now();
+
+int main(int argc, char **argv) {
+    const bench_precision_t precisions[] = {
+        {"float", FRACTAL_KERNEL_FLOAT},
+        {"double", FRACTAL_KERNEL_DOUBLE},
+        {"double-double", FRACTAL_KERNEL_DOUBLE_DOUBLE}};
+    int width = 640, height = 360, max_iterations = 500, repeat = 5;
+    fractal_kernel_params_t params = {0};
+    fractal_kernel_t kernel;
+    const char *name;
+    long checksum;
+    double time, baseline[2];
+
+    if (argc == 5) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+        max_iterations = atoi(argv[3]);
+        repeat = atoi(argv[4]);
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [width height max_iterations repeat]\n",
+                argv[0]);
+        return 1;
+    }
+    if (width < 1 || height < 1 || max_iterations < 1 || repeat < 1) {
+        fprintf(stderr, "%s: Invalid arguments\n", argv[0]);
+        return 1;
+    }
+
+    if (check_big_mul(20000)) {
+        fprintf(stderr, "%s: Wrong big number product\n", argv[0]);
+        return 1;
+    }
+
+    params.julia_x = -0.8;
+    params.julia_y = 0.156;
+    params.max_iterations = max_iterations;
+
+    fractal_kernel_select(FRACTAL_KERNEL_DOUBLE, &name);
+    printf("%s kernels, %dx%d pixels, %d iterations, best of %d\n", name,
+           width, height, max_iterations, repeat);
+    printf("%-14s %-10s %-9s %9s %6s %12s\n", "precision", "fractal",
+           "interior", "ns/pixel", "gain", "iterations");
+
+    // the baseline has no interior check, its iterations are the same of
+    // the double kernels without it
+    for (int julia = 0; julia < 2; julia++) {
+        params.use_julia = julia;
+        baseline[julia] =
+            bench_kernel(baseline_kernel, FRACTAL_KERNEL_DOUBLE, &params,
+                         width, height, repeat, &checksum);
+        printf("%-14s %-10s %-9s %9.1f %6s %12ld\n", "baseline",
+               julia ? "julia" : "mandelbrot", "no",
+               baseline[julia] * 1e9 / ((double)width * height), "",
+               checksum);
+    }
+
+    for (int p = 0; p < 3; p++) {
+        kernel = fractal_kernel_select(precisions[p].precision, NULL);
+        for (int mode = 0; mode < 4; mode++) {
+            params.use_julia = mode / 2;
+            params.interior_check = mode % 2;
+
+            time = bench_kernel(kernel, precisions[p].precision, &params,
+                                width, height, repeat, &checksum);
+            printf("%-14s %-10s %-9s %9.1f %5.2fx %12ld\n",
+                   precisions[p].name,
+                   params.use_julia ? "julia" : "mandelbrot",
+                   params.interior_check ? "yes" : "no",
+                   time * 1e9 / ((double)width * height),
+                   baseline[params.use_julia] / time, checksum);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Compares fractal_big_mul with reference_mul on 'count' random pairs of
+ * operands for every precision, returns the number of wrong products.
+ * Most limbs are 0 or 0xFFFFFFFF, where the carries go the furthest
+ */
+int check_big_mul(int count) {
+    const uint32_t values[] = {0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFE, 1};
+    fractal_big_t a, b, product, expected;
+    int errors = 0;
+
+    srand(1);
+    for (int limbs = 1; limbs <= FRACTAL_BIG_LIMBS; limbs++) {
+        for (int n = 0; n < count / FRACTAL_BIG_LIMBS; n++) {
+            for (int i = 0; i < limbs; i++) {
+                a.limb[i] = rand() % 2 ? values[rand() % 5]
+                                       : ((uint32_t)rand() << 16) ^ rand();
+                b.limb[i] = rand() % 2 ? values[rand() % 5]
+                                       : ((uint32_t)rand() << 16) ^ rand();
+            }
+            a.negative = rand() % 2;
+            b.negative = rand() % 2;
+
+            fractal_big_mul(&product, &a, &b, limbs);
+            reference_mul(&expected, &a, &b, limbs);
+            for (int i = 0; i < limbs; i++) {
+                if (product.limb[i] != expected.limb[i] ||
+                    product.negative != expected.negative) {
+                    errors++;
+                    break;
+                }
+            }
+        }
+    }
+
+    return errors;
+}
+
+/**
+ * Full product in 16 bit digits, each column summed apart and the carries
+ * propagated at the end, truncated like fractal_big_mul
+ */
+void reference_mul(fractal_big_t *r, const fractal_big_t *a,
+                   const fractal_big_t *b, int limbs) {
+    // digit k has weight 2^(16 - 16 * k)
+    uint32_t x[2 * FRACTAL_BIG_LIMBS], y[2 * FRACTAL_BIG_LIMBS];
+    uint64_t column[4 * FRACTAL_BIG_LIMBS] = {0}, carry = 0;
+
+    for (int i = 0; i < limbs; i++) {
+        x[2 * i] = a->limb[i] >> 16;
+        x[2 * i + 1] = a->limb[i] & 0xFFFF;
+        y[2 * i] = b->limb[i] >> 16;
+        y[2 * i + 1] = b->limb[i] & 0xFFFF;
+    }
+
+    // column k has weight 2^(32 - 16 * k)
+    for (int i = 0; i < 2 * limbs; i++) {
+        for (int j = 0; j < 2 * limbs; j++)
+            column[i + j] += (uint64_t)x[i] * y[j];
+    }
+    for (int k = 4 * limbs - 2; k >= 0; k--) {
+        column[k] += carry;
+        carry = column[k] >> 16;
+        column[k] &= 0xFFFF;
+    }
+
+    // limb i has weight 2^(-32 * i): columns 2 * i + 1 and 2 * i + 2
+    for (int i = 0; i < limbs; i++) {
+        r->limb[i] = (uint32_t)(column[2 * i + 1] << 16 | column[2 * i + 2]);
+    }
+    r->negative = a->negative != b->negative;
+}
+
+/**
+ * The loop of every pixel before the escape-time kernels, one pixel at a
+ * time in double without interior check, smooth or orbits
+ */
+int baseline_kernel(const fractal_kernel_params_t *params, const double *xc,
+                    const double *yc, int count, int *iterations,
+                    float *smooth, fractal_orbit_t *orbit) {
+    double x0 = params->julia_x, y0 = params->julia_y, x, y, xx, yy;
+    int n;
+
+    (void)smooth;
+    (void)orbit;
+    for (int i = 0; i < count; i++) {
+        x = xc[i];
+        y = yc[i];
+        if (!params->use_julia) {
+            x0 = xc[i];
+            y0 = yc[i];
+        }
+
+        n = 0;
+        while (n < params->max_iterations) {
+            xx = x * x;
+            yy = y * y;
+            if (xx + yy > 4.0)
+                break;
+            y = 2.0 * x * y + y0;
+            x = xx - yy + x0;
+            n++;
+        }
+        iterations[i] = n;
+    }
+
+    return 0;
+}
+
+/**
+ * Renders the whole fractal 'repeat' times in rows of tiles and returns
+ * the best time in seconds, 'checksum' is the sum of the iterations
+ */
+double bench_kernel(fractal_kernel_t kernel,
+                    fractal_kernel_precision_t precision,
+                    const fractal_kernel_params_t *params, int width,
+                    int height, int repeat, long *checksum) {
+    double xc[FRACTAL_TILE_SIZE], yc[FRACTAL_TILE_SIZE];
+    int iterations[FRACTAL_TILE_SIZE], run;
+    double zoom = height / 2.5, best = -1.0, start, time;
+    double center_x = params->use_julia ? 0.0 : -0.75;
+    fractal_kernel_params_t p = *params;
+
+    // the double-double kernels get the offsets from the center
+    if (precision == FRACTAL_KERNEL_DOUBLE_DOUBLE) {
+        p.center_x[0] = center_x;
+        center_x = 0.0;
+    }
+
+    for (int r = 0; r < repeat; r++) {
+        *checksum = 0;
+        start = now();
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col += run) {
+                run = width - col < FRACTAL_TILE_SIZE ? width - col
+                                                      : FRACTAL_TILE_SIZE;
+                for (int i = 0; i < run; i++) {
+                    xc[i] = center_x + (col + i - width / 2.0) / zoom;
+                    yc[i] = -(row - height / 2.0) / zoom;
+                }
+
+                kernel(&p, xc, yc, run, iterations, NULL, NULL);
+                for (int i = 0; i < run; i++)
+                    *checksum += iterations[i];
+            }
+        }
+
+        time = now() - start;
+        if (best < 0.0 || time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,341 @@
+#include "fractal_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "FRCACHE1"
+
+// the slots start after the header of the file
+#define CACHE_HEADER_BYTES 4096
+
+// the slots are aligned to cache lines
+#define CACHE_SLOT_ALIGN 64
+
+/**
+ * Beginning of the file
+ */
+typedef struct {
+    char magic[8];
+    uint32_t key_bytes, data_bytes;
+    uint32_t capacity;
+    uint32_t reserved;
+    uint64_t clock; // incremented every time an entry is used
+} cache_header_t;
+
+/**
+ * Beginning of a slot, followed by key_bytes bytes of key and data_bytes
+ * bytes of data
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t last_used; // clock of the last use, 0 if the slot is empty
+    uint32_t key_size, data_size;
+} cache_slot_t;
+
+/**
+ * Slot sorted by its last use when the file is opened
+ */
+typedef struct {
+    uint64_t last_used;
+    int slot;
+} cache_use_t;
+
+// private functions
+static cache_slot_t *cache_slot(fractal_cache_t *cache, int slot);
+static uint64_t cache_hash(const void *key, int size);
+static int cache_find(fractal_cache_t *cache, uint64_t hash, const void *key,
+                      int key_size);
+static void cache_index(fractal_cache_t *cache);
+static int compare_use(const void *a, const void *b);
+static void cache_chain(fractal_cache_t *cache, int slot);
+static void cache_unchain(fractal_cache_t *cache, int slot);
+static void cache_touch(fractal_cache_t *cache, int slot);
+
+fractal_cache_t *fractal_cache_open(const char *filename, long max_bytes,
+                                    int key_bytes, int data_bytes) {
+    size_t slot_size =
+        (sizeof(cache_slot_t) + key_bytes + data_bytes + CACHE_SLOT_ALIGN -
+         1) / CACHE_SLOT_ALIGN * CACHE_SLOT_ALIGN;
+    long capacity = (max_bytes - CACHE_HEADER_BYTES) / (long)slot_size;
+    size_t map_size = CACHE_HEADER_BYTES + capacity * slot_size;
+    cache_header_t *header;
+    struct stat status;
+    uint8_t *map;
+    int fd, valid;
+
+    if (key_bytes < 1 || data_bytes < 1 || capacity < 1 ||
+        capacity > 0x7FFFFFFF / 2) {
+        fprintf(stderr, "Invalid size of the tile cache\n");
+        return NULL;
+    }
+
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Cannot open the tile cache");
+        return NULL;
+    }
+
+    // the file of another size is created again, its pages are written
+    // only when they are used
+    valid = !fstat(fd, &status) && (size_t)status.st_size == map_size;
+    if (!valid && (ftruncate(fd, 0) || ftruncate(fd, map_size))) {
+        perror("Cannot create the tile cache");
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Cannot map the tile cache");
+        close(fd);
+        return NULL;
+    }
+
+    fractal_cache_t *cache = calloc(1, sizeof(fractal_cache_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd = fd;
+    cache->map = map;
+    cache->map_size = map_size;
+    cache->key_bytes = key_bytes;
+    cache->data_bytes = data_bytes;
+    cache->slot_size = slot_size;
+    cache->capacity = (int)capacity;
+
+    header = (cache_header_t *)map;
+    if (!valid || memcmp(header->magic, CACHE_MAGIC, 8) ||
+        header->key_bytes != (uint32_t)key_bytes ||
+        header->data_bytes != (uint32_t)data_bytes ||
+        header->capacity != (uint32_t)capacity) {
+        for (int i = 0; i < cache->capacity; i++)
+            memset(cache_slot(cache, i), 0, sizeof(cache_slot_t));
+        memset(header, 0, sizeof(cache_header_t));
+        memcpy(header->magic, CACHE_MAGIC, 8);
+        header->key_bytes = key_bytes;
+        header->data_bytes = data_bytes;
+        header->capacity = capacity;
+    }
+
+    cache_index(cache);
+
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Tile cache: %d of %d entries\n", cache->count,
+            cache->capacity);
+#endif
+
+    return cache;
+}
+
+int fractal_cache_load(fractal_cache_t *cache, const void *key, int key_size,
+                       void *data, int size) {
+    uint64_t hash = cache_hash(key, key_size);
+    int slot, result = -1;
+
+    pthread_mutex_lock(&cache->lock);
+    slot = cache_find(cache, hash, key, key_size);
+    if (slot >= 0 && cache_slot(cache, slot)->data_size == (uint32_t)size) {
+        memcpy(data,
+               (uint8_t *)(cache_slot(cache, slot) + 1) + cache->key_bytes,
+               size);
+        cache_touch(cache, slot);
+        result = 0;
+    }
+    if (result)
+        cache->misses++;
+    else
+        cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+void fractal_cache_store(fractal_cache_t *cache, const void *key,
+                         int key_size, const void *data, int size) {
+    uint64_t hash = cache_hash(key, key_size);
+    cache_slot_t *entry;
+    int slot;
+
+    if (key_size > cache->key_bytes || size > cache->data_bytes)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    slot = cache_find(cache, hash, key, key_size);
+    if (slot < 0) {
+        slot = cache->oldest;
+        entry = cache_slot(cache, slot);
+        if (entry->last_used) {
+            cache_unchain(cache, slot);
+            cache->evictions++;
+            cache->count--;
+        }
+
+        // empty until it is complete
+        entry->last_used = 0;
+        entry->hash = hash;
+        entry->key_size = key_size;
+        entry->data_size = size;
+        memcpy(entry + 1, key, key_size);
+        memcpy((uint8_t *)(entry + 1) + cache->key_bytes, data, size);
+        cache_chain(cache, slot);
+        cache->count++;
+    }
+    cache_touch(cache, slot);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void fractal_cache_close(fractal_cache_t *cache) {
+#ifdef DEBUG
+    fprintf(stderr,
+            " [DD] Tile cache: %ld hits, %ld misses, %ld evictions, %d of "
+            "%d entries\n",
+            cache->hits, cache->misses, cache->evictions, cache->count,
+            cache->capacity);
+#endif
+
+    // the kernel writes the pages of the mapping on the disk
+    munmap(cache->map, cache->map_size);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->next);
+    free(cache->newer);
+    free(cache->older);
+    free(cache);
+}
+
+//      Private functions
+
+cache_slot_t *cache_slot(fractal_cache_t *cache, int slot) {
+    return (cache_slot_t *)(cache->map + CACHE_HEADER_BYTES +
+                            (size_t)slot * cache->slot_size);
+}
+
+/**
+ * 64-bit FNV-1a, the keys are compared anyway
+ */
+uint64_t cache_hash(const void *key, int size) {
+    const uint8_t *bytes = key;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Returns the slot of the entry 'key', -1 if there is none
+ */
+int cache_find(fractal_cache_t *cache, uint64_t hash, const void *key,
+               int key_size) {
+    cache_slot_t *entry;
+
+    for (int slot = cache->buckets[hash % cache->bucket_count]; slot >= 0;
+         slot = cache->next[slot]) {
+        entry = cache_slot(cache, slot);
+        if (entry->hash == hash && entry->key_size == (uint32_t)key_size &&
+            !memcmp(entry + 1, key, key_size))
+            return slot;
+    }
+    return -1;
+}
+
+/**
+ * Builds the hash table and the LRU list of the slots of the file
+ */
+void cache_index(fractal_cache_t *cache) {
+    cache_use_t *uses = malloc(sizeof(cache_use_t) * cache->capacity);
+    cache_slot_t *entry;
+    int slot;
+
+    cache->bucket_count = cache->capacity;
+    cache->buckets = malloc(sizeof(int) * cache->bucket_count);
+    cache->next = malloc(sizeof(int) * cache->capacity);
+    cache->newer = malloc(sizeof(int) * cache->capacity);
+    cache->older = malloc(sizeof(int) * cache->capacity);
+    for (int i = 0; i < cache->bucket_count; i++)
+        cache->buckets[i] = -1;
+
+    for (int i = 0; i < cache->capacity; i++) {
+        entry = cache_slot(cache, i);
+        if (entry->last_used &&
+            (entry->key_size > (uint32_t)cache->key_bytes ||
+             entry->data_size > (uint32_t)cache->data_bytes))
+            entry->last_used = 0; // not valid
+        uses[i].last_used = entry->last_used;
+        uses[i].slot = i;
+    }
+    qsort(uses, cache->capacity, sizeof(cache_use_t), compare_use);
+
+    cache->oldest = uses[0].slot;
+    cache->newest = uses[cache->capacity - 1].slot;
+    for (int i = 0; i < cache->capacity; i++) {
+        slot = uses[i].slot;
+        cache->older[slot] = i > 0 ? uses[i - 1].slot : -1;
+        cache->newer[slot] = i < cache->capacity - 1 ? uses[i + 1].slot : -1;
+        if (uses[i].last_used) {
+            cache_chain(cache, slot);
+            cache->count++;
+        }
+    }
+    free(uses);
+}
+
+int compare_use(const void *a, const void *b) {
+    const cache_use_t *x = a, *y = b;
+
+    if (x->last_used != y->last_used)
+        return x->last_used < y->last_used ? -1 : 1;
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/**
+ * Adds the slot to the chain of its hash
+ */
+void cache_chain(fractal_cache_t *cache, int slot) {
+    int *head =
+        &cache->buckets[cache_slot(cache, slot)->hash % cache->bucket_count];
+
+    cache->next[slot] = *head;
+    *head = slot;
+}
+
+/**
+ * Removes the slot from the chain of its hash
+ */
+void cache_unchain(fractal_cache_t *cache, int slot) {
+    int *link =
+        &cache->buckets[cache_slot(cache, slot)->hash % cache->bucket_count];
+
+    while (*link != slot)
+        link = &cache->next[*link];
+    *link = cache->next[slot];
+}
+
+/**
+ * Marks the slot as the most recently used one
+ */
+void cache_touch(fractal_cache_t *cache, int slot) {
+    cache_header_t *header = (cache_header_t *)cache->map;
+
+    cache_slot(cache, slot)->last_used = ++header->clock;
+    if (slot == cache->newest)
+        return;
+
+    // out of the list
+    if (cache->older[slot] >= 0)
+        cache->newer[cache->older[slot]] = cache->newer[slot];
+    else
+        cache->oldest = cache->newer[slot];
+    cache->older[cache->newer[slot]] = cache->older[slot];
+
+    // at the end
+    cache->older[slot] = cache->newest;
+    cache->newer[slot] = -1;
+    cache->newer[cache->newest] = slot;
+    cache->newest = slot;
+}
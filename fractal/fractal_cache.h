@@ -0,0 +1,67 @@
+#ifndef FRACTAL_CACHE_H
+#define FRACTAL_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Content-addressed store of fixed-size entries in a memory-mapped file,
+ * kept between the runs. Every entry has a key of at most 'key_bytes'
+ * bytes, found by its hash, and at most 'data_bytes' bytes of data. When
+ * the file is full the least recently used entry is replaced.
+ * The file is used by a single process at a time
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    uint8_t *map; // the whole file
+    size_t map_size;
+
+    int key_bytes, data_bytes;
+    size_t slot_size; // bytes of an entry with its header
+    int capacity;     // entries that fit in the file
+    int count;        // entries in the file
+
+    // slots with the same hash % bucket_count are chained by 'next'
+    int *buckets, *next;
+    int bucket_count;
+
+    // every slot from the least recently used one, the empty slots come
+    // first (see the 'clock' of the file)
+    int *newer, *older;
+    int oldest, newest;
+
+    long hits, misses, evictions;
+} fractal_cache_t;
+
+/**
+ * Opens the cache file 'filename', creating it if it does not exist or
+ * it has been created with other sizes, with at most 'max_bytes' bytes.
+ * Returns NULL on error
+ */
+extern fractal_cache_t *fractal_cache_open(const char *filename,
+                                           long max_bytes, int key_bytes,
+                                           int data_bytes);
+
+/**
+ * Copies the data of the entry 'key' in 'data' if it has exactly 'size'
+ * bytes. Returns -1 if there is no such entry (a miss)
+ */
+extern int fractal_cache_load(fractal_cache_t *cache, const void *key,
+                              int key_size, void *data, int size);
+
+/**
+ * Adds the entry 'key' with 'size' bytes of 'data', replacing the least
+ * recently used one if the cache is full. An existing entry is only
+ * marked as used
+ */
+extern void fractal_cache_store(fractal_cache_t *cache, const void *key,
+                                int key_size, const void *data, int size);
+
+/**
+ * Writes the cache on the disk and closes it
+ */
+extern void fractal_cache_close(fractal_cache_t *cache);
+
+#endif /* FRACTAL_CACHE_H */
@@ -0,0 +1,345 @@
+#include "fractal_color.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLOR_X86
+#include <immintrin.h>
+#endif
+
+#define PALETTE_MASK (FRACTAL_PALETTE_SIZE - 1)
+
+static uint32_t palette_lut[FRACTAL_PALETTE_SIZE];
+static uint32_t palette_yuv_lut[FRACTAL_PALETTE_SIZE];
+static uint32_t palette_yuv_inside;
+static pthread_once_t palette_once = PTHREAD_ONCE_INIT;
+
+// private functions
+static void palette_init_lut();
+static uint32_t palette_color(double t);
+static uint32_t palette_to_yuv(uint32_t color);
+static void colorize(const fractal_palette_t *palette, const int *iterations,
+                     const float *smooth, long count, int offset,
+                     uint32_t inside, uint8_t *rgb);
+static void colorize_scalar(const fractal_palette_t *palette,
+                            const int *iterations, const float *smooth,
+                            long count, int offset, uint32_t inside,
+                            uint8_t *rgb);
+static uint32_t blend(uint32_t a, uint32_t b, float fraction);
+static int palette_shifted(const fractal_palette_t *palette, int iterations,
+                           int offset);
+
+#ifdef COLOR_X86
+static long colorize_avx2(const fractal_palette_t *palette,
+                          const int *iterations, const float *smooth,
+                          long count, int offset, uint32_t inside,
+                          uint8_t *rgb);
+#endif
+
+const uint32_t *fractal_palette_colors() {
+    pthread_once(&palette_once, palette_init_lut);
+    return palette_lut;
+}
+
+uint32_t fractal_palette_inside() { return palette_color(1.0); }
+
+void fractal_palette_init(fractal_palette_t *palette, int max_iterations) {
+    int period = max_iterations < FRACTAL_PALETTE_SIZE ? max_iterations
+                                                       : FRACTAL_PALETTE_SIZE;
+
+    palette->colors = fractal_palette_colors();
+    palette->max_iterations = max_iterations;
+    palette->scale = (float)FRACTAL_PALETTE_SIZE / period;
+}
+
+void fractal_colorize(const fractal_palette_t *palette, const int *iterations,
+                      const float *smooth, long count, int offset,
+                      uint8_t *rgb) {
+    colorize(palette, iterations, smooth, count, offset,
+             fractal_palette_inside(), rgb);
+}
+
+void fractal_colorize_yuv(const fractal_palette_t *palette,
+                          const int *iterations, const float *smooth,
+                          int width, int height, int first, int last,
+                          int offset, uint8_t *const planes[3],
+                          const int strides[3]) {
+    fractal_palette_t yuv = *palette;
+    uint8_t *top = malloc((size_t)width * 6), *bottom, *y_plane;
+    int x1, sum_u, sum_v;
+    long pixel;
+
+    pthread_once(&palette_once, palette_init_lut);
+    yuv.colors = palette_yuv_lut;
+
+    for (int row = first; row < last; row += 2) {
+        // 2 rows of pixels 0x00VVUUYY like the RGB ones, the last row of an
+        // odd height is its own pair
+        pixel = (long)row * width;
+        bottom = row + 1 < height ? top + 3 * width : top;
+        colorize(&yuv, iterations + pixel, smooth ? smooth + pixel : NULL,
+                 bottom == top ? width : 2L * width, offset,
+                 palette_yuv_inside, top);
+
+        y_plane = planes[0] + (long)row * strides[0];
+        for (int x = 0; x < width; x++)
+            y_plane[x] = top[3 * x];
+        if (bottom != top) {
+            y_plane += strides[0];
+            for (int x = 0; x < width; x++)
+                y_plane[x] = bottom[3 * x];
+        }
+
+        // the chroma of 2 x 2 pixels is their average
+        for (int x = 0; x < width; x += 2) {
+            x1 = x + 1 < width ? x + 1 : x;
+            sum_u = top[3 * x + 1] + top[3 * x1 + 1] + bottom[3 * x + 1] +
+                    bottom[3 * x1 + 1];
+            sum_v = top[3 * x + 2] + top[3 * x1 + 2] + bottom[3 * x + 2] +
+                    bottom[3 * x1 + 2];
+            planes[1][(long)row / 2 * strides[1] + x / 2] = (sum_u + 2) >> 2;
+            planes[2][(long)row / 2 * strides[2] + x / 2] = (sum_v + 2) >> 2;
+        }
+    }
+    free(top);
+}
+
+int fractal_palette_index(const fractal_palette_t *palette, int offset,
+                          uint8_t map[FRACTAL_PALETTE_SIZE + 1],
+                          uint32_t colors[256]) {
+    int period = palette->max_iterations < FRACTAL_PALETTE_SIZE
+                     ? palette->max_iterations
+                     : FRACTAL_PALETTE_SIZE;
+    int count = 0, slot, found;
+    uint32_t color;
+
+    offset &= PALETTE_MASK;
+
+    // the inside color first, then the colors of the escaped pixels
+    for (int n = -1; n < period; n++) {
+        slot = n < 0 ? FRACTAL_PALETTE_SIZE
+                     : palette_shifted(palette, n, offset);
+        color = n < 0 ? fractal_palette_inside() : palette->colors[slot];
+
+        for (found = 0; found < count && colors[found] != color; found++)
+            ;
+        if (found == count) {
+            if (count == 256)
+                return 0;
+            colors[count++] = color;
+        }
+        map[slot] = found;
+    }
+    return count;
+}
+
+void fractal_colorize_indexed(const fractal_palette_t *palette,
+                              const int *iterations, long count, int offset,
+                              const uint8_t *map, uint8_t *indices) {
+    offset &= PALETTE_MASK;
+
+    for (long i = 0; i < count; i++) {
+        if (iterations[i] >= palette->max_iterations)
+            indices[i] = map[FRACTAL_PALETTE_SIZE];
+        else
+            indices[i] = map[palette_shifted(palette, iterations[i], offset)];
+    }
+}
+
+//      Private functions
+
+void palette_init_lut() {
+    for (int i = 0; i < FRACTAL_PALETTE_SIZE; i++) {
+        palette_lut[i] = palette_color((double)i / FRACTAL_PALETTE_SIZE);
+        palette_yuv_lut[i] = palette_to_yuv(palette_lut[i]);
+    }
+    palette_yuv_inside = palette_to_yuv(fractal_palette_inside());
+}
+
+/**
+ * Color at 't' (from 0 to 1) of the default palette
+ */
+uint32_t palette_color(double t) {
+    // color algorithm (default 9.4 ; 15.9 ; 9.4)
+    uint8_t red = (uint8_t)(256.0 * 9.4 * (1.0 - t) * t * t * t);
+    uint8_t green = (uint8_t)(256.0 * 15.9 * (1.0 - t) * (1.0 - t) * t * t);
+    uint8_t blue =
+        (uint8_t)(256.0 * 9.4 * (1.0 - t) * (1.0 - t) * (1.0 - t) * t);
+
+    return red | (uint32_t)green << 8 | (uint32_t)blue << 16;
+}
+
+/**
+ * Color 0x00BBGGRR in BT.601 limited range, as converted by swscale,
+ * packed as 0x00VVUUYY
+ */
+uint32_t palette_to_yuv(uint32_t color) {
+    int red = color & 0xFF, green = color >> 8 & 0xFF, blue = color >> 16;
+    uint32_t y = ((66 * red + 129 * green + 25 * blue + 128) >> 8) + 16;
+    uint32_t u = (-38 * red - 74 * green + 112 * blue + (128 << 8) + 128) >> 8;
+    uint32_t v = (112 * red - 94 * green - 18 * blue + (128 << 8) + 128) >> 8;
+
+    return y | u << 8 | v << 16;
+}
+
+/**
+ * Colors of 'count' pixels with the colors of 'palette' and 'inside',
+ * 3 bytes for each one
+ */
+void colorize(const fractal_palette_t *palette, const int *iterations,
+              const float *smooth, long count, int offset, uint32_t inside,
+              uint8_t *rgb) {
+    long done = 0;
+
+    offset &= PALETTE_MASK;
+
+#ifdef COLOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        done = colorize_avx2(palette, iterations, smooth, count, offset,
+                             inside, rgb);
+#endif
+
+    colorize_scalar(palette, iterations + done, smooth ? smooth + done : NULL,
+                    count - done, offset, inside, rgb + 3 * done);
+}
+
+/**
+ * The position of a pixel in the palette is its iterations modulo the
+ * period plus the fractional iterations, times palette->scale. The
+ * iterations are below the period when it is not FRACTAL_PALETTE_SIZE,
+ * so the modulo is always a mask
+ */
+void colorize_scalar(const fractal_palette_t *palette, const int *iterations,
+                     const float *smooth, long count, int offset,
+                     uint32_t inside, uint8_t *rgb) {
+    uint32_t color, next;
+    float position;
+    int index, shifted;
+
+    for (long i = 0; i < count; i++) {
+        if (iterations[i] >= palette->max_iterations) {
+            color = inside;
+        } else {
+            position = (float)(iterations[i] & PALETTE_MASK);
+            if (smooth)
+                position += smooth[i];
+            position *= palette->scale;
+            index = (int)position;
+            shifted = (index + offset) & PALETTE_MASK;
+
+            color = palette->colors[shifted];
+            if (smooth) {
+                next = palette->colors[(shifted + 1) & PALETTE_MASK];
+                color = blend(color, next, position - (float)index);
+            }
+        }
+
+        *rgb++ = color & 0xFF;
+        *rgb++ = color >> 8 & 0xFF;
+        *rgb++ = color >> 16 & 0xFF;
+    }
+}
+
+/**
+ * Palette color of the escaped pixels with 'iterations' and no smooth,
+ * the same as colorize_scalar
+ */
+int palette_shifted(const fractal_palette_t *palette, int iterations,
+                    int offset) {
+    float position = (float)(iterations & PALETTE_MASK) * palette->scale;
+
+    return ((int)position + offset) & PALETTE_MASK;
+}
+
+/**
+ * a * (1 - fraction) + b * fraction for every channel, in steps of 1/256
+ */
+uint32_t blend(uint32_t a, uint32_t b, float fraction) {
+    int w = (int)(fraction * 256.0f);
+    uint32_t result = 0, ca, cb;
+
+    w = w < 0 ? 0 : (w > 256 ? 256 : w);
+    for (int shift = 0; shift < 24; shift += 8) {
+        ca = a >> shift & 0xFF;
+        cb = b >> shift & 0xFF;
+        result |= (ca * (256 - w) + cb * w) >> 8 << shift;
+    }
+    return result;
+}
+
+#ifdef COLOR_X86
+
+/**
+ * Same as colorize_scalar with 8 pixels at a time, returns the number of
+ * pixels done (the others are left to colorize_scalar)
+ */
+__attribute__((target("avx2"))) long
+colorize_avx2(const fractal_palette_t *palette, const int *iterations,
+              const float *smooth, long count, int offset, uint32_t inside,
+              uint8_t *rgb) {
+    const __m256i last = _mm256_set1_epi32(palette->max_iterations - 1),
+                  mask = _mm256_set1_epi32(PALETTE_MASK),
+                  shift = _mm256_set1_epi32(offset),
+                  inside_color = _mm256_set1_epi32((int)inside),
+                  one = _mm256_set1_epi32(1), zero = _mm256_setzero_si256(),
+                  full = _mm256_set1_epi32(256),
+                  red_blue = _mm256_set1_epi32(0xFF00FF),
+                  green = _mm256_set1_epi32(0xFF00);
+    const __m256 scale = _mm256_set1_ps(palette->scale),
+                 weight = _mm256_set1_ps(256.0f);
+    // 4 pixels 0x00BBGGRR of each half become 12 bytes RGB
+    const __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5,
+        6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const int *colors = (const int *)palette->colors;
+    long i = 0;
+
+    // every store writes 4 bytes after the 8 pixels, the next pixels
+    // overwrite them
+    for (; i + 10 <= count; i += 8) {
+        __m256i n = _mm256_loadu_si256((const __m256i *)(iterations + i));
+        __m256i in = _mm256_cmpgt_epi32(n, last);
+        __m256 position = _mm256_cvtepi32_ps(_mm256_and_si256(n, mask));
+        if (smooth)
+            position = _mm256_add_ps(position, _mm256_loadu_ps(smooth + i));
+        position = _mm256_mul_ps(position, scale);
+        __m256i index = _mm256_cvttps_epi32(position);
+        __m256i shifted =
+            _mm256_and_si256(_mm256_add_epi32(index, shift), mask);
+        __m256i color = _mm256_i32gather_epi32(colors, shifted, 4);
+
+        if (smooth) {
+            __m256i next =
+                _mm256_and_si256(_mm256_add_epi32(shifted, one), mask);
+            __m256i b = _mm256_i32gather_epi32(colors, next, 4);
+            __m256i w = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_sub_ps(position, _mm256_cvtepi32_ps(index)), weight));
+            w = _mm256_min_epi32(_mm256_max_epi32(w, zero), full);
+            __m256i iw = _mm256_sub_epi32(full, w);
+
+            // red and blue together: their products do not overlap
+            __m256i rb = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_and_si256(color, red_blue), iw),
+                _mm256_mullo_epi32(_mm256_and_si256(b, red_blue), w));
+            __m256i g = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_and_si256(color, green), iw),
+                _mm256_mullo_epi32(_mm256_and_si256(b, green), w));
+            color = _mm256_or_si256(
+                _mm256_and_si256(_mm256_srli_epi32(rb, 8), red_blue),
+                _mm256_and_si256(_mm256_srli_epi32(g, 8), green));
+        }
+
+        color = _mm256_blendv_epi8(color, inside_color, in);
+        color = _mm256_shuffle_epi8(color, pack);
+        _mm_storeu_si128((__m128i *)(rgb + 3 * i),
+                         _mm256_castsi256_si128(color));
+        _mm_storeu_si128((__m128i *)(rgb + 3 * i + 12),
+                         _mm256_extracti128_si256(color, 1));
+    }
+
+    return i;
+}
+
+#endif /* COLOR_X86 */
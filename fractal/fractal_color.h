@@ -0,0 +1,82 @@
+#ifndef FRACTAL_COLOR_H
+#define FRACTAL_COLOR_H
+
+#include <stdint.h>
+
+// colors of the palette, a power of 2: the memory and the setup of the
+// palette do not depend on max_iterations
+#define FRACTAL_PALETTE_SIZE 1024
+
+/**
+ * How the iterations are mapped to the colors of the palette: with
+ * max_iterations up to FRACTAL_PALETTE_SIZE the palette is stretched over
+ * them, otherwise it repeats every FRACTAL_PALETTE_SIZE iterations. The
+ * first and the last color are the same, so the cycles have no seams
+ */
+typedef struct {
+    const uint32_t *colors; // see fractal_palette_colors
+    int max_iterations;
+    float scale; // palette colors per iteration
+} fractal_palette_t;
+
+/**
+ * FRACTAL_PALETTE_SIZE colors of the default palette packed as
+ * 0x00BBGGRR, shared by every palette and by the preview
+ */
+extern const uint32_t *fractal_palette_colors();
+
+/**
+ * Color of the pixels that reach max_iterations
+ */
+extern uint32_t fractal_palette_inside();
+
+/**
+ * Sets up the palette for 'max_iterations' (at least 1)
+ */
+extern void fractal_palette_init(fractal_palette_t *palette,
+                                 int max_iterations);
+
+/**
+ * Writes the RGB colors of 'count' pixels in 'rgb'. An escaped pixel gets
+ * the color 'offset' places after its own, cycling through the palette,
+ * and if 'smooth' is not NULL it is blended with the next color by its
+ * fractional iterations. Uses the widest vectors supported by the CPU,
+ * the result does not depend on them
+ */
+extern void fractal_colorize(const fractal_palette_t *palette,
+                             const int *iterations, const float *smooth,
+                             long count, int offset, uint8_t *rgb);
+
+/**
+ * Same as fractal_colorize for the rows from 'first' (even) to 'last'
+ * (excluded) of a 'width' x 'height' frame, but writes the planes of YUV
+ * 4:2:0 with their 'strides': the palette is converted to BT.601 once and
+ * the chroma of every 2 x 2 pixels is their average. 'iterations' and
+ * 'smooth' are those of the whole frame
+ */
+extern void fractal_colorize_yuv(const fractal_palette_t *palette,
+                                 const int *iterations, const float *smooth,
+                                 int width, int height, int first, int last,
+                                 int offset, uint8_t *const planes[3],
+                                 const int strides[3]);
+
+/**
+ * Finds the distinct colors that the pixels can get without smooth, with
+ * the palette shifted by 'offset': 'map' gets the index in 'colors' of
+ * every color of the palette and of the inside color (the last entry).
+ * Returns the number of colors, 0 if there are more than 256
+ */
+extern int fractal_palette_index(const fractal_palette_t *palette, int offset,
+                                 uint8_t map[FRACTAL_PALETTE_SIZE + 1],
+                                 uint32_t colors[256]);
+
+/**
+ * Same as fractal_colorize without smooth, but writes the index of the
+ * color of every pixel, from the 'map' of fractal_palette_index
+ */
+extern void fractal_colorize_indexed(const fractal_palette_t *palette,
+                                     const int *iterations, long count,
+                                     int offset, const uint8_t *map,
+                                     uint8_t *indices);
+
+#endif /* FRACTAL_COLOR_H */
@@ -0,0 +1,439 @@
+#include "fractal_field.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define FIELD_MAGIC "FRFIELD1"
+
+// written in the byte order of the machine, read back only by the same
+#define FIELD_BYTE_ORDER 0x01020304
+
+// the planes start on a page, so they can be used from the mapping
+#define FIELD_DATA_ALIGN 4096
+
+/**
+ * Beginning of the file, followed by the center strings, the table of
+ * the chunks (aligned to 8 bytes) and the chunks from 'data_offset': the
+ * chunks of the iterations, then the ones of the smooth values
+ */
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    int32_t chunk_rows, chunk_count;
+    int32_t level, precision;
+
+    // the configuration
+    double x, y, zoom, julia_x, julia_y, julia_zoom;
+    int32_t use_julia, width, height, max_iterations, threads;
+    int32_t interior_check, render_mode, config_precision, smooth;
+    int32_t band_rows, png_level, png_filter;
+
+    // bytes of the center strings with their '\0', 0 for NULL
+    int32_t center_x_size, center_y_size;
+
+    uint64_t table_offset, data_offset;
+} field_header_t;
+
+// private functions
+static void field_header_init(field_header_t *header,
+                              const fractal_config_t *config,
+                              fractal_precision_t precision, int smooth,
+                              int level);
+static int field_write_chunks(FILE *file, const field_header_t *header,
+                              const int *iterations, const float *smooth,
+                              fractal_field_chunk_t *chunks);
+static int field_write_header(FILE *file, const field_header_t *header,
+                              const fractal_config_t *config,
+                              const fractal_field_chunk_t *chunks);
+static int field_check(fractal_field_t *field, const field_header_t *header);
+static const char *field_string(const fractal_field_t *field, uint64_t offset,
+                                int size);
+static void field_shuffle(const uint8_t *src, long count, uint8_t *dst);
+static void field_unshuffle(const uint8_t *src, long count, uint8_t *dst);
+
+int fractal_field_save(const char *filename, const fractal_config_t *config,
+                       fractal_precision_t precision, const int *iterations,
+                       const float *smooth, int level) {
+    field_header_t header;
+    fractal_field_chunk_t *chunks;
+    int failed;
+
+    if (config->width < 1 || config->height < 1 || level < 0 || level > 9)
+        return -1;
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Cannot save the field");
+        return -1;
+    }
+
+    // the header is written last with the table of the chunks
+    field_header_init(&header, config, precision, smooth != NULL, level);
+    chunks = calloc(2 * header.chunk_count, sizeof(fractal_field_chunk_t));
+    failed = field_write_chunks(file, &header, iterations, smooth, chunks) ||
+             field_write_header(file, &header, config, chunks);
+    failed = fclose(file) != 0 || failed;
+    free(chunks);
+
+    if (failed) {
+        fprintf(stderr, "Cannot save the field %s\n", filename);
+        remove(filename);
+        return -1;
+    }
+    return 0;
+}
+
+fractal_field_t *fractal_field_open(const char *filename) {
+    struct stat status;
+    uint8_t *map;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open the field");
+        return NULL;
+    }
+    if (fstat(fd, &status) ||
+        (size_t)status.st_size < sizeof(field_header_t)) {
+        fprintf(stderr, "Invalid field %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    // the mapping stays valid without the descriptor
+    map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Cannot map the field");
+        return NULL;
+    }
+
+    fractal_field_t *field = calloc(1, sizeof(fractal_field_t));
+    field->map = map;
+    field->map_size = status.st_size;
+    if (field_check(field, (const field_header_t *)map)) {
+        fprintf(stderr, "Invalid field %s\n", filename);
+        fractal_field_close(field);
+        return NULL;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Field of %d x %d pixels, %s\n",
+            field->config.width, field->config.height,
+            field->level ? "compressed" : "mapped");
+#endif
+
+    return field;
+}
+
+int fractal_field_chunk_rows(const fractal_field_t *field, int chunk) {
+    int first = chunk * field->chunk_rows;
+
+    return field->config.height - first < field->chunk_rows
+               ? field->config.height - first
+               : field->chunk_rows;
+}
+
+int fractal_field_read(const fractal_field_t *field, int chunk,
+                       int *iterations, float *smooth) {
+    long count = (long)fractal_field_chunk_rows(field, chunk) *
+                 field->config.width;
+    size_t bytes = 4 * count;
+    const fractal_field_chunk_t *part;
+    uint8_t *scratch = NULL, *dst;
+    uLongf size;
+    int failed = 0;
+
+    for (int plane = 0; plane < 2 && !failed; plane++) {
+        dst = plane ? (uint8_t *)smooth : (uint8_t *)iterations;
+        if (!dst || (plane && !field->config.smooth))
+            continue;
+
+        part = &field->chunks[2 * chunk + plane];
+        if (!field->level) {
+            memcpy(dst, field->map + part->offset, bytes);
+            continue;
+        }
+
+        if (!scratch)
+            scratch = malloc(bytes);
+        size = bytes;
+        failed = uncompress(scratch, &size, field->map + part->offset,
+                            part->size) != Z_OK ||
+                 size != bytes;
+        if (!failed)
+            field_unshuffle(scratch, count, dst);
+        else
+            fprintf(stderr, "Corrupted chunk %d of the field\n", chunk);
+    }
+
+    free(scratch);
+    return failed ? -1 : 0;
+}
+
+void fractal_field_close(fractal_field_t *field) {
+    if (!field)
+        return;
+
+    munmap(field->map, field->map_size);
+    free(field);
+}
+
+//      Private functions
+
+/**
+ * Fills the header of a new file, the offsets of the table and of the
+ * chunks follow from the center strings
+ */
+void field_header_init(field_header_t *header, const fractal_config_t *config,
+                       fractal_precision_t precision, int smooth, int level) {
+    uint64_t offset;
+
+    // no padding byte is left uninitialized in the file
+    memset(header, 0, sizeof(field_header_t));
+    memcpy(header->magic, FIELD_MAGIC, 8);
+    header->byte_order = FIELD_BYTE_ORDER;
+    header->chunk_rows = FRACTAL_FIELD_CHUNK_ROWS;
+    header->chunk_count =
+        (config->height + FRACTAL_FIELD_CHUNK_ROWS - 1) /
+        FRACTAL_FIELD_CHUNK_ROWS;
+    header->level = level;
+    header->precision = precision;
+
+    header->x = config->x;
+    header->y = config->y;
+    header->zoom = config->zoom;
+    header->julia_x = config->julia_x;
+    header->julia_y = config->julia_y;
+    header->julia_zoom = config->julia_zoom;
+    header->use_julia = config->use_julia;
+    header->width = config->width;
+    header->height = config->height;
+    header->max_iterations = config->max_iterations;
+    header->threads = config->threads;
+    header->interior_check = config->interior_check;
+    header->render_mode = config->render_mode;
+    header->config_precision = config->precision;
+    header->smooth = smooth;
+    header->band_rows = config->band_rows;
+    header->png_level = config->png_level;
+    header->png_filter = config->png_filter;
+    header->center_x_size =
+        config->center_x ? (int32_t)strlen(config->center_x) + 1 : 0;
+    header->center_y_size =
+        config->center_y ? (int32_t)strlen(config->center_y) + 1 : 0;
+
+    offset = sizeof(field_header_t) + header->center_x_size +
+             header->center_y_size;
+    header->table_offset = (offset + 7) / 8 * 8;
+    offset = header->table_offset +
+             2 * header->chunk_count * sizeof(fractal_field_chunk_t);
+    header->data_offset =
+        (offset + FIELD_DATA_ALIGN - 1) / FIELD_DATA_ALIGN * FIELD_DATA_ALIGN;
+}
+
+/**
+ * Writes the chunks of the planes from 'data_offset' and their places in
+ * 'chunks'. The compressed chunks are the 4 bytes of the values stored as
+ * 4 planes, like the filters of PNG it makes them easier to deflate.
+ * Returns -1 on error
+ */
+int field_write_chunks(FILE *file, const field_header_t *header,
+                       const int *iterations, const float *smooth,
+                       fractal_field_chunk_t *chunks) {
+    size_t bytes = 4L * header->chunk_rows * header->width;
+    uLong bound = compressBound(bytes);
+    uint64_t offset = header->data_offset;
+    uint8_t *shuffled = NULL, *out = NULL;
+    const uint8_t *src;
+    int failed, rows;
+    uLongf size;
+    long count;
+
+    if (header->level) {
+        shuffled = malloc(bytes);
+        out = malloc(bound);
+    }
+
+    failed = fseek(file, (long)offset, SEEK_SET) != 0;
+    for (int plane = 0; plane < 2 && !failed; plane++) {
+        src = plane ? (const uint8_t *)smooth : (const uint8_t *)iterations;
+        for (int i = 0; i < header->chunk_count && src && !failed; i++) {
+            rows = header->height - i * header->chunk_rows;
+            rows = rows < header->chunk_rows ? rows : header->chunk_rows;
+            count = (long)rows * header->width;
+
+            if (header->level) {
+                field_shuffle(src, count, shuffled);
+                size = bound;
+                failed = compress2(out, &size, shuffled, 4 * count,
+                                   header->level) != Z_OK;
+            } else {
+                size = 4 * count;
+            }
+
+            chunks[2 * i + plane].offset = offset;
+            chunks[2 * i + plane].size = size;
+            offset += size;
+            failed = failed ||
+                     fwrite(header->level ? out : src, 1, size, file) != size;
+            src += 4 * count;
+        }
+    }
+
+    free(shuffled);
+    free(out);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Writes the header, the center strings and the table of the chunks at
+ * the beginning of the file. Returns -1 on error
+ */
+int field_write_header(FILE *file, const field_header_t *header,
+                       const fractal_config_t *config,
+                       const fractal_field_chunk_t *chunks) {
+    static const uint8_t zeros[8] = {0};
+    size_t padding = header->table_offset - sizeof(field_header_t) -
+                     header->center_x_size - header->center_y_size;
+    size_t table = 2 * header->chunk_count;
+    int failed;
+
+    failed = fseek(file, 0, SEEK_SET) ||
+             fwrite(header, sizeof(field_header_t), 1, file) != 1;
+    if (!failed && config->center_x)
+        failed = fwrite(config->center_x, header->center_x_size, 1, file) != 1;
+    if (!failed && config->center_y)
+        failed = fwrite(config->center_y, header->center_y_size, 1, file) != 1;
+    failed = failed || fwrite(zeros, 1, padding, file) != padding ||
+             fwrite(chunks, sizeof(fractal_field_chunk_t), table, file) !=
+                 table;
+    return failed ? -1 : 0;
+}
+
+/**
+ * Checks the header of the mapped file and fills the field from it.
+ * Returns -1 if the file is not valid
+ */
+int field_check(fractal_field_t *field, const field_header_t *header) {
+    fractal_config_t *config = &field->config;
+    const fractal_field_chunk_t *part;
+    uint64_t plane_offset, bytes, first;
+    long pixels;
+    int rows;
+
+    if (memcmp(header->magic, FIELD_MAGIC, 8) ||
+        header->byte_order != FIELD_BYTE_ORDER || header->width < 1 ||
+        header->height < 1 || header->chunk_rows < 1 ||
+        header->chunk_count !=
+            (header->height + header->chunk_rows - 1) / header->chunk_rows ||
+        header->level < 0 || header->level > 9 ||
+        header->center_x_size < 0 || header->center_y_size < 0 ||
+        header->table_offset % 8 ||
+        header->table_offset +
+                2 * (uint64_t)header->chunk_count *
+                    sizeof(fractal_field_chunk_t) >
+            field->map_size)
+        return -1;
+
+    config->x = header->x;
+    config->y = header->y;
+    config->zoom = header->zoom;
+    config->julia_x = header->julia_x;
+    config->julia_y = header->julia_y;
+    config->julia_zoom = header->julia_zoom;
+    config->use_julia = header->use_julia;
+    config->width = header->width;
+    config->height = header->height;
+    config->max_iterations = header->max_iterations;
+    config->threads = header->threads;
+    config->interior_check = header->interior_check;
+    config->render_mode = header->render_mode;
+    config->precision = header->config_precision;
+    config->smooth = header->smooth != 0;
+    config->band_rows = header->band_rows;
+    config->png_level = header->png_level;
+    config->png_filter = header->png_filter;
+    config->center_x =
+        field_string(field, sizeof(field_header_t), header->center_x_size);
+    config->center_y =
+        field_string(field, sizeof(field_header_t) + header->center_x_size,
+                     header->center_y_size);
+    if ((header->center_x_size && !config->center_x) ||
+        (header->center_y_size && !config->center_y))
+        return -1;
+
+    field->precision = header->precision;
+    field->level = header->level;
+    field->chunk_rows = header->chunk_rows;
+    field->chunk_count = header->chunk_count;
+    field->chunks =
+        (const fractal_field_chunk_t *)(field->map + header->table_offset);
+
+    // without compression the chunks must be the contiguous planes
+    pixels = (long)header->width * header->height;
+    for (int i = 0; i < 2 * field->chunk_count; i++) {
+        part = &field->chunks[i];
+        rows = fractal_field_chunk_rows(field, i / 2);
+        if (i % 2 && !config->smooth)
+            continue;
+        if (part->offset > field->map_size ||
+            part->size > field->map_size - part->offset)
+            return -1;
+        if (field->level)
+            continue;
+
+        plane_offset = header->data_offset + (i % 2 ? 4 * pixels : 0);
+        first = (uint64_t)(i / 2) * field->chunk_rows * header->width;
+        bytes = 4L * rows * header->width;
+        if (header->data_offset % FIELD_DATA_ALIGN ||
+            part->offset != plane_offset + 4 * first || part->size != bytes)
+            return -1;
+    }
+
+    if (!field->level) {
+        field->iterations = (const int *)(field->map + header->data_offset);
+        if (config->smooth)
+            field->smooth =
+                (const float *)(field->map + header->data_offset + 4 * pixels);
+    }
+    return 0;
+}
+
+/**
+ * String of 'size' bytes at 'offset' in the file, NULL if it is empty or
+ * not valid
+ */
+const char *field_string(const fractal_field_t *field, uint64_t offset,
+                         int size) {
+    const char *string = (const char *)field->map + offset;
+
+    if (size < 1 || offset + size > field->map_size || string[size - 1])
+        return NULL;
+    return string;
+}
+
+/**
+ * Stores the byte k of the 'count' values of 4 bytes of 'src' at
+ * dst[k * count]
+ */
+void field_shuffle(const uint8_t *src, long count, uint8_t *dst) {
+    for (long i = 0; i < count; i++)
+        for (int k = 0; k < 4; k++)
+            dst[k * count + i] = src[4 * i + k];
+}
+
+/**
+ * Inverse of field_shuffle
+ */
+void field_unshuffle(const uint8_t *src, long count, uint8_t *dst) {
+    for (long i = 0; i < count; i++)
+        for (int k = 0; k < 4; k++)
+            dst[4 * i + k] = src[k * count + i];
+}
@@ -0,0 +1,83 @@
+#ifndef FRACTAL_FIELD_H
+#define FRACTAL_FIELD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fractal.h"
+
+// rows of a chunk of the planes, the chunks are compressed independently
+#define FRACTAL_FIELD_CHUNK_ROWS 64
+
+/**
+ * Place of a chunk of a plane in the file
+ */
+typedef struct {
+    uint64_t offset, size;
+} fractal_field_chunk_t;
+
+/**
+ * Iterations of a photo kept in a file with the configuration that
+ * rendered them, to color them again without rendering. The planes of
+ * the iterations and of the smooth values are split in chunks of
+ * FRACTAL_FIELD_CHUNK_ROWS rows, each one deflated on its own or stored
+ * as is: without compression the planes are contiguous and used directly
+ * from the memory-mapped file. The file has the byte order of the
+ * machine that wrote it
+ */
+typedef struct {
+    // max_iterations is the one used by the render, the center strings
+    // belong to the field
+    fractal_config_t config;
+    fractal_precision_t precision; // used by the render
+
+    int level;      // zlib level of the chunks, 0 if not compressed
+    int chunk_rows; // rows of every chunk but the last one
+    int chunk_count;
+
+    // iterations of the chunk i at chunks[2 * i], smooth values at
+    // chunks[2 * i + 1] (empty without smooth)
+    const fractal_field_chunk_t *chunks;
+
+    // the planes in the file without compression, NULL otherwise
+    const int *iterations;
+    const float *smooth;
+
+    uint8_t *map; // the whole file
+    size_t map_size;
+} fractal_field_t;
+
+/**
+ * Saves the width x height 'iterations' and 'smooth' values (NULL
+ * without smooth) rendered with 'config' and 'precision' in 'filename'.
+ * 'level' is the zlib level from 1 to 9, 0 to store the planes without
+ * compression. A failed save leaves no file. Returns -1 on error
+ */
+extern int fractal_field_save(const char *filename,
+                              const fractal_config_t *config,
+                              fractal_precision_t precision,
+                              const int *iterations, const float *smooth,
+                              int level);
+
+/**
+ * Maps the file 'filename'. Returns NULL if it is not a valid field
+ */
+extern fractal_field_t *fractal_field_open(const char *filename);
+
+/**
+ * Rows of the chunk 'chunk', the last one can be shorter
+ */
+extern int fractal_field_chunk_rows(const fractal_field_t *field, int chunk);
+
+/**
+ * Copies the rows of 'chunk' in 'iterations' and in 'smooth' (NULL to
+ * skip them, left as is if the field has none), uncompressing them if
+ * needed. Different chunks can be read at the same time. Returns -1 if
+ * the chunk is corrupted
+ */
+extern int fractal_field_read(const fractal_field_t *field, int chunk,
+                              int *iterations, float *smooth);
+
+extern void fractal_field_close(fractal_field_t *field);
+
+#endif /* FRACTAL_FIELD_H */
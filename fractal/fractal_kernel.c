@@ -0,0 +1,1061 @@
+#include "fractal_kernel.h"
+
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// the kernel bodies are inlined in the functions of KERNEL_ENTRY
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+/**
+ * Unevaluated sum hi + lo, |lo| <= ulp(hi) / 2
+ */
+typedef struct {
+    double hi, lo;
+} double_double_t;
+
+// private functions
+KERNEL_INLINE int kernel_scalar(const fractal_kernel_params_t *params,
+                                const double *xc, const double *yc, int count,
+                                int *iterations, float *smooth,
+                                fractal_orbit_t *orbit, int julia,
+                                int interior);
+KERNEL_INLINE int kernel_scalar_float(const fractal_kernel_params_t *params,
+                                      const double *xc, const double *yc,
+                                      int count, int *iterations, float *smooth,
+                                      fractal_orbit_t *orbit, int julia,
+                                      int interior);
+KERNEL_INLINE int kernel_double_double(const fractal_kernel_params_t *params,
+                                       const double *dx, const double *dy,
+                                       int count, int *iterations,
+                                       float *smooth, fractal_orbit_t *orbit,
+                                       int julia, int interior);
+static float kernel_smooth(int n, int max_iterations, double radius);
+static double_double_t dd_add(double_double_t a, double_double_t b);
+static double_double_t dd_mul(double_double_t a, double_double_t b);
+
+/**
+ * Returns 1 if 'c' is inside the main cardioid or the period-2 bulb
+ */
+static int mb_in_cardioid_or_bulb(double x, double y);
+
+#ifdef KERNEL_X86
+KERNEL_INLINE int kernel_sse2(const fractal_kernel_params_t *params,
+                              const double *xc, const double *yc, int count,
+                              int *iterations, float *smooth,
+                              fractal_orbit_t *orbit, int julia, int interior);
+KERNEL_INLINE int kernel_avx2(const fractal_kernel_params_t *params,
+                              const double *xc, const double *yc, int count,
+                              int *iterations, float *smooth,
+                              fractal_orbit_t *orbit, int julia, int interior);
+KERNEL_INLINE int kernel_avx512(const fractal_kernel_params_t *params,
+                                const double *xc, const double *yc, int count,
+                                int *iterations, float *smooth,
+                                fractal_orbit_t *orbit, int julia,
+                                int interior);
+KERNEL_INLINE int kernel_sse2_float(const fractal_kernel_params_t *params,
+                                    const double *xc, const double *yc,
+                                    int count, int *iterations, float *smooth,
+                                    fractal_orbit_t *orbit, int julia,
+                                    int interior);
+KERNEL_INLINE int kernel_avx2_float(const fractal_kernel_params_t *params,
+                                    const double *xc, const double *yc,
+                                    int count, int *iterations, float *smooth,
+                                    fractal_orbit_t *orbit, int julia,
+                                    int interior);
+KERNEL_INLINE int kernel_avx512_float(const fractal_kernel_params_t *params,
+                                      const double *xc, const double *yc,
+                                      int count, int *iterations, float *smooth,
+                                      fractal_orbit_t *orbit, int julia,
+                                      int interior);
+
+/**
+ * Conversions between the doubles of the arguments and the float lanes
+ */
+KERNEL_INLINE __m128 load_float_sse2(const double *p)
+    __attribute__((target("sse2")));
+KERNEL_INLINE void store_float_sse2(double *p, __m128 v)
+    __attribute__((target("sse2")));
+KERNEL_INLINE __m256 load_float_avx2(const double *p)
+    __attribute__((target("avx2")));
+KERNEL_INLINE void store_float_avx2(double *p, __m256 v)
+    __attribute__((target("avx2")));
+KERNEL_INLINE __m512 load_float_avx512(const double *p)
+    __attribute__((target("avx512f")));
+KERNEL_INLINE void store_float_avx512(double *p, __m512 v)
+    __attribute__((target("avx512f")));
+#endif
+
+int kernel_double_double(const fractal_kernel_params_t *params,
+                         const double *dx, const double *dy, int count,
+                         int *iterations, float *smooth,
+                         fractal_orbit_t *orbit, int julia, int interior) {
+    const double_double_t center_x = {params->center_x[0],
+                                      params->center_x[1]};
+    const double_double_t center_y = {params->center_y[0],
+                                      params->center_y[1]};
+    const double_double_t julia_x = {params->julia_x, 0.0};
+    const double_double_t julia_y = {params->julia_y, 0.0};
+    int max_iterations = params->max_iterations, skipped = 0;
+    (void)orbit; // z does not fit in a double
+
+    for (int i = 0; i < count; i++) {
+        double_double_t x = dd_add(center_x, (double_double_t){dx[i], 0.0});
+        double_double_t y = dd_add(center_y, (double_double_t){dy[i], 0.0});
+        double_double_t cx = julia ? julia_x : x;
+        double_double_t cy = julia ? julia_y : y;
+        double_double_t xx = {0.0, 0.0}, yy = xx, xy, saved_x = x, saved_y = y;
+        int n = 0, check = 1;
+
+        if (interior && !julia &&
+            mb_in_cardioid_or_bulb(x.hi, y.hi)) {
+            iterations[i] = max_iterations;
+            if (smooth)
+                smooth[i] = 0.0f;
+            skipped++;
+            continue;
+        }
+
+        while (n < max_iterations) {
+            xx = dd_mul(x, x);
+            yy = dd_mul(y, y);
+            if (xx.hi + yy.hi > 4.0)
+                break;
+            xy = dd_mul(x, y);
+            y = dd_add(dd_add(xy, xy), cy);
+            x = dd_add(dd_add(xx, (double_double_t){-yy.hi, -yy.lo}), cx);
+            n++;
+
+            if (interior) {
+                if (x.hi == saved_x.hi && x.lo == saved_x.lo &&
+                    y.hi == saved_y.hi && y.lo == saved_y.lo) {
+                    n = max_iterations;
+                    skipped++;
+                    break;
+                }
+                if (n == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        iterations[i] = n;
+        if (smooth)
+            smooth[i] = kernel_smooth(n, max_iterations, xx.hi + yy.hi);
+    }
+
+    return skipped;
+}
+
+/*
+ * Every kernel must return exactly the same iterations as kernel_scalar:
+ * the operations are done in the same order and the library is compiled
+ * with -ffp-contract=off so that no FMA is generated.
+ * The escape test is "not greater than 4" (unordered is true) to match the
+ * scalar 'break' on 'xx + yy > 4.0' even when the orbit becomes NaN.
+ *
+ * Periodicity checking (Brent): z is saved when the iteration is a power
+ * of 2 and every following z is compared with it. The comparison is exact,
+ * an orbit that comes back to the same doubles repeats forever and would
+ * reach max_iterations anyway, so the result does not change.
+ */
+
+int kernel_scalar(const fractal_kernel_params_t *params, const double *xc,
+                  const double *yc, int count, int *iterations, float *smooth,
+                  fractal_orbit_t *orbit, int julia, int interior) {
+    int max_iterations = params->max_iterations, skipped = 0;
+    int start = orbit ? orbit->start : 0;
+
+    for (int i = 0; i < count; i++) {
+        // 'x', 'y', 'xx' and 'yy' are calculation variables
+        double x = start ? orbit->x[i] : xc[i];
+        double y = start ? orbit->y[i] : yc[i], xx = 0.0, yy = 0.0;
+        double cx = julia ? params->julia_x : xc[i];
+        double cy = julia ? params->julia_y : yc[i];
+        double saved_x = x, saved_y = y;
+        int n = start, check = 1;
+
+        if (interior && !julia && !start && mb_in_cardioid_or_bulb(x, y)) {
+            iterations[i] = max_iterations;
+            if (smooth)
+                smooth[i] = 0.0f;
+            if (orbit)
+                orbit->x[i] = NAN;
+            skipped++;
+            continue;
+        }
+
+        while (n < max_iterations) {
+            xx = x * x;
+            yy = y * y;
+            if (xx + yy > 4.0)
+                break;
+            y = 2.0 * x * y + cy;
+            x = xx - yy + cx;
+            n++;
+
+            if (interior) {
+                if (x == saved_x && y == saved_y) {
+                    n = max_iterations;
+                    x = NAN; // never escapes
+                    skipped++;
+                    break;
+                }
+                if (n - start == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        iterations[i] = n;
+        if (smooth)
+            smooth[i] = kernel_smooth(n, max_iterations, xx + yy);
+        if (orbit) {
+            orbit->x[i] = x;
+            orbit->y[i] = y;
+        }
+    }
+
+    return skipped;
+}
+
+int kernel_scalar_float(const fractal_kernel_params_t *params, const double *xc,
+                        const double *yc, int count, int *iterations,
+                        float *smooth, fractal_orbit_t *orbit, int julia,
+                        int interior) {
+    int max_iterations = params->max_iterations, skipped = 0;
+    int start = orbit ? orbit->start : 0;
+
+    for (int i = 0; i < count; i++) {
+        float x = (float)(start ? orbit->x[i] : xc[i]);
+        float y = (float)(start ? orbit->y[i] : yc[i]), xx = 0.0f, yy = 0.0f;
+        float cx = julia ? (float)params->julia_x : (float)xc[i];
+        float cy = julia ? (float)params->julia_y : (float)yc[i];
+        float saved_x = x, saved_y = y;
+        int n = start, check = 1;
+
+        if (interior && !julia && !start) {
+            // same operations of mb_in_cardioid_or_bulb
+            float xq = x - 0.25f, q;
+            yy = y * y;
+            q = xq * xq + yy;
+            if (q * (q + xq) <= 0.25f * yy ||
+                (x + 1.0f) * (x + 1.0f) + yy <= 0.0625f) {
+                iterations[i] = max_iterations;
+                if (smooth)
+                    smooth[i] = 0.0f;
+                if (orbit)
+                    orbit->x[i] = NAN;
+                skipped++;
+                continue;
+            }
+        }
+
+        while (n < max_iterations) {
+            xx = x * x;
+            yy = y * y;
+            if (xx + yy > 4.0f)
+                break;
+            y = 2.0f * x * y + cy;
+            x = xx - yy + cx;
+            n++;
+
+            if (interior) {
+                if (x == saved_x && y == saved_y) {
+                    n = max_iterations;
+                    x = NAN;
+                    skipped++;
+                    break;
+                }
+                if (n - start == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        iterations[i] = n;
+        if (smooth)
+            smooth[i] = kernel_smooth(n, max_iterations, xx + yy);
+        if (orbit) {
+            orbit->x[i] = x;
+            orbit->y[i] = y;
+        }
+    }
+
+    return skipped;
+}
+
+/*
+ * Double-double operations without FMA (Dekker, Knuth): the products are
+ * split in halves of 26 bits so that they are exact in double
+ */
+
+double_double_t dd_add(double_double_t a, double_double_t b) {
+    double s = a.hi + b.hi, v = s - a.hi;
+    double e = (a.hi - (s - v)) + (b.hi - v) + a.lo + b.lo;
+    double hi = s + e;
+    return (double_double_t){hi, e - (hi - s)};
+}
+
+double_double_t dd_mul(double_double_t a, double_double_t b) {
+    const double split = 134217729.0; // 2^27 + 1
+    double t = split * a.hi, ah = t - (t - a.hi), al = a.hi - ah;
+    t = split * b.hi;
+    double bh = t - (t - b.hi), bl = b.hi - bh;
+
+    double p = a.hi * b.hi;
+    double e = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+    e += a.hi * b.lo + a.lo * b.hi;
+    double hi = p + e;
+    return (double_double_t){hi, e - (hi - p)};
+}
+
+int mb_in_cardioid_or_bulb(double x, double y) {
+    double xq = x - 0.25, yy = y * y;
+    double q = xq * xq + yy;
+    if (q * (q + xq) <= 0.25 * yy)
+        return 1;
+
+    return (x + 1.0) * (x + 1.0) + yy <= 0.0625;
+}
+
+float fractal_kernel_smooth(double radius) {
+    // |z| is about between 2 and 4 after the escape, so this goes from 1
+    // to 0 and adds up with the iterations to a continuous value
+    double fraction = 1.0 - log2(0.5 * log2(radius));
+    if (!(fraction > 0.0))
+        return 0.0f; // also NaN
+    return fraction < 1.0 ? (float)fraction : 1.0f;
+}
+
+float kernel_smooth(int n, int max_iterations, double radius) {
+    return n < max_iterations ? fractal_kernel_smooth(radius) : 0.0f;
+}
+
+#ifdef KERNEL_X86
+
+__attribute__((target("sse2"))) int
+kernel_sse2(const fractal_kernel_params_t *params, const double *xc,
+            const double *yc, int count, int *iterations, float *smooth,
+            fractal_orbit_t *orbit, int julia, int interior) {
+    const __m128d two = _mm_set1_pd(2.0), four = _mm_set1_pd(4.0),
+                  one = _mm_set1_pd(1.0);
+    const __m128d max_n = _mm_set1_pd(params->max_iterations);
+    const __m128d quarter = _mm_set1_pd(0.25), sixteenth = _mm_set1_pd(0.0625);
+    const __m128d nan = _mm_set1_pd(NAN);
+    double result[2];
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d x = _mm_loadu_pd(xc + i), y = _mm_loadu_pd(yc + i);
+        __m128d cx = julia ? _mm_set1_pd(params->julia_x) : x;
+        __m128d cy = julia ? _mm_set1_pd(params->julia_y) : y;
+        if (start) {
+            // resumed from the last z, c is still the pixel
+            x = _mm_loadu_pd(orbit->x + i);
+            y = _mm_loadu_pd(orbit->y + i);
+        }
+        __m128d n = _mm_set1_pd(start), xx, yy, r, active, same;
+        __m128d saved_x = x, saved_y = y, cycled = _mm_setzero_pd();
+        __m128d radius = _mm_setzero_pd();
+        active = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            // same operations of mb_in_cardioid_or_bulb
+            __m128d xq = _mm_sub_pd(x, quarter);
+            yy = _mm_mul_pd(y, y);
+            __m128d q = _mm_add_pd(_mm_mul_pd(xq, xq), yy);
+            __m128d bx = _mm_add_pd(x, one);
+            cycled = _mm_or_pd(
+                _mm_cmple_pd(_mm_mul_pd(q, _mm_add_pd(q, xq)),
+                             _mm_mul_pd(quarter, yy)),
+                _mm_cmple_pd(_mm_add_pd(_mm_mul_pd(bx, bx), yy), sixteenth));
+            active = _mm_andnot_pd(cycled, active);
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm_mul_pd(x, x);
+            yy = _mm_mul_pd(y, y);
+            r = _mm_add_pd(xx, yy);
+            if (smooth) // |z|^2 of the lanes that escape now is kept
+                radius = _mm_or_pd(_mm_andnot_pd(active, radius),
+                                   _mm_and_pd(active, r));
+            active = _mm_and_pd(active, _mm_cmpngt_pd(r, four));
+            if (!_mm_movemask_pd(active))
+                break;
+
+            // escaped lanes keep iterating but are not counted anymore
+            n = _mm_add_pd(n, _mm_and_pd(active, one));
+            y = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, x), y), cy);
+            x = _mm_add_pd(_mm_sub_pd(xx, yy), cx);
+
+            if (interior) {
+                same = _mm_and_pd(_mm_cmpeq_pd(x, saved_x),
+                                  _mm_cmpeq_pd(y, saved_y));
+                same = _mm_and_pd(same, active);
+                cycled = _mm_or_pd(cycled, same);
+                active = _mm_andnot_pd(same, active);
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        n = _mm_or_pd(_mm_andnot_pd(cycled, n), _mm_and_pd(cycled, max_n));
+        skipped += __builtin_popcount(_mm_movemask_pd(cycled));
+        _mm_storeu_pd(result, n);
+        iterations[i] = (int)result[0];
+        iterations[i + 1] = (int)result[1];
+
+        if (orbit) {
+            // NaN marks the pixels that never escape
+            _mm_storeu_pd(orbit->x + i, _mm_or_pd(_mm_andnot_pd(cycled, x),
+                                                  _mm_and_pd(cycled, nan)));
+            _mm_storeu_pd(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            _mm_storeu_pd(result, radius);
+            for (int l = 0; l < 2; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar(params, xc + i, yc + i, count - i,
+                                   iterations + i, smooth, orbit, julia,
+                                   interior);
+}
+
+__attribute__((target("avx2"))) int
+kernel_avx2(const fractal_kernel_params_t *params, const double *xc,
+            const double *yc, int count, int *iterations, float *smooth,
+            fractal_orbit_t *orbit, int julia, int interior) {
+    const __m256d two = _mm256_set1_pd(2.0), four = _mm256_set1_pd(4.0),
+                  one = _mm256_set1_pd(1.0);
+    const __m256d max_n = _mm256_set1_pd(params->max_iterations);
+    const __m256d quarter = _mm256_set1_pd(0.25),
+                  sixteenth = _mm256_set1_pd(0.0625);
+    const __m256d nan = _mm256_set1_pd(NAN);
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = _mm256_loadu_pd(xc + i), y = _mm256_loadu_pd(yc + i);
+        __m256d cx = julia ? _mm256_set1_pd(params->julia_x) : x;
+        __m256d cy = julia ? _mm256_set1_pd(params->julia_y) : y;
+        if (start) {
+            x = _mm256_loadu_pd(orbit->x + i);
+            y = _mm256_loadu_pd(orbit->y + i);
+        }
+        __m256d n = _mm256_set1_pd(start), xx, yy, r, active, same;
+        __m256d saved_x = x, saved_y = y, cycled = _mm256_setzero_pd();
+        __m256d radius = _mm256_setzero_pd();
+        active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            // same operations of mb_in_cardioid_or_bulb
+            __m256d xq = _mm256_sub_pd(x, quarter);
+            yy = _mm256_mul_pd(y, y);
+            __m256d q = _mm256_add_pd(_mm256_mul_pd(xq, xq), yy);
+            __m256d bx = _mm256_add_pd(x, one);
+            cycled = _mm256_or_pd(
+                _mm256_cmp_pd(_mm256_mul_pd(q, _mm256_add_pd(q, xq)),
+                              _mm256_mul_pd(quarter, yy), _CMP_LE_OQ),
+                _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(bx, bx), yy),
+                              sixteenth, _CMP_LE_OQ));
+            active = _mm256_andnot_pd(cycled, active);
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm256_mul_pd(x, x);
+            yy = _mm256_mul_pd(y, y);
+            r = _mm256_add_pd(xx, yy);
+            if (smooth)
+                radius = _mm256_blendv_pd(radius, r, active);
+            active =
+                _mm256_and_pd(active, _mm256_cmp_pd(r, four, _CMP_NGT_UQ));
+            if (!_mm256_movemask_pd(active))
+                break;
+
+            n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+            y = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, x), y), cy);
+            x = _mm256_add_pd(_mm256_sub_pd(xx, yy), cx);
+
+            if (interior) {
+                same = _mm256_and_pd(_mm256_cmp_pd(x, saved_x, _CMP_EQ_OQ),
+                                     _mm256_cmp_pd(y, saved_y, _CMP_EQ_OQ));
+                same = _mm256_and_pd(same, active);
+                cycled = _mm256_or_pd(cycled, same);
+                active = _mm256_andnot_pd(same, active);
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        n = _mm256_blendv_pd(n, max_n, cycled);
+        skipped += __builtin_popcount(_mm256_movemask_pd(cycled));
+        _mm_storeu_si128((__m128i *)(iterations + i), _mm256_cvtpd_epi32(n));
+
+        if (orbit) {
+            _mm256_storeu_pd(orbit->x + i, _mm256_blendv_pd(x, nan, cycled));
+            _mm256_storeu_pd(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            double result[4];
+            _mm256_storeu_pd(result, radius);
+            for (int l = 0; l < 4; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar(params, xc + i, yc + i, count - i,
+                                   iterations + i, smooth, orbit, julia,
+                                   interior);
+}
+
+__attribute__((target("avx512f"))) int
+kernel_avx512(const fractal_kernel_params_t *params, const double *xc,
+              const double *yc, int count, int *iterations, float *smooth,
+              fractal_orbit_t *orbit, int julia, int interior) {
+    const __m512d two = _mm512_set1_pd(2.0), four = _mm512_set1_pd(4.0),
+                  one = _mm512_set1_pd(1.0);
+    const __m512d max_n = _mm512_set1_pd(params->max_iterations);
+    const __m512d quarter = _mm512_set1_pd(0.25),
+                  sixteenth = _mm512_set1_pd(0.0625);
+    const __m512d nan = _mm512_set1_pd(NAN);
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 8 <= count; i += 8) {
+        __m512d x = _mm512_loadu_pd(xc + i), y = _mm512_loadu_pd(yc + i);
+        __m512d cx = julia ? _mm512_set1_pd(params->julia_x) : x;
+        __m512d cy = julia ? _mm512_set1_pd(params->julia_y) : y;
+        if (start) {
+            x = _mm512_loadu_pd(orbit->x + i);
+            y = _mm512_loadu_pd(orbit->y + i);
+        }
+        __m512d n = _mm512_set1_pd(start), xx, yy, r;
+        __m512d saved_x = x, saved_y = y, radius = _mm512_setzero_pd();
+        __mmask8 active = 0xFF, cycled = 0, same;
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            // same operations of mb_in_cardioid_or_bulb
+            __m512d xq = _mm512_sub_pd(x, quarter);
+            yy = _mm512_mul_pd(y, y);
+            __m512d q = _mm512_add_pd(_mm512_mul_pd(xq, xq), yy);
+            __m512d bx = _mm512_add_pd(x, one);
+            cycled = _mm512_cmp_pd_mask(
+                         _mm512_mul_pd(q, _mm512_add_pd(q, xq)),
+                         _mm512_mul_pd(quarter, yy), _CMP_LE_OQ) |
+                     _mm512_cmp_pd_mask(
+                         _mm512_add_pd(_mm512_mul_pd(bx, bx), yy), sixteenth,
+                         _CMP_LE_OQ);
+            active &= ~cycled;
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm512_mul_pd(x, x);
+            yy = _mm512_mul_pd(y, y);
+            r = _mm512_add_pd(xx, yy);
+            if (smooth)
+                radius = _mm512_mask_mov_pd(radius, active, r);
+            active = _mm512_mask_cmp_pd_mask(active, r, four, _CMP_NGT_UQ);
+            if (!active)
+                break;
+
+            n = _mm512_mask_add_pd(n, active, n, one);
+            y = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, x), y), cy);
+            x = _mm512_add_pd(_mm512_sub_pd(xx, yy), cx);
+
+            if (interior) {
+                same = _mm512_mask_cmp_pd_mask(active, x, saved_x, _CMP_EQ_OQ);
+                same = _mm512_mask_cmp_pd_mask(same, y, saved_y, _CMP_EQ_OQ);
+                cycled |= same;
+                active &= ~same;
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        n = _mm512_mask_mov_pd(n, cycled, max_n);
+        skipped += __builtin_popcount(cycled);
+        _mm256_storeu_si256((__m256i *)(iterations + i),
+                            _mm512_cvtpd_epi32(n));
+
+        if (orbit) {
+            _mm512_storeu_pd(orbit->x + i, _mm512_mask_mov_pd(x, cycled, nan));
+            _mm512_storeu_pd(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            double result[8];
+            _mm512_storeu_pd(result, radius);
+            for (int l = 0; l < 8; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar(params, xc + i, yc + i, count - i,
+                                   iterations + i, smooth, orbit, julia,
+                                   interior);
+}
+
+/*
+ * Single precision kernels: the same algorithm with twice the lanes, the
+ * iterations are counted in integer lanes
+ */
+
+__attribute__((target("sse2"))) int
+kernel_sse2_float(const fractal_kernel_params_t *params, const double *xc,
+                  const double *yc, int count, int *iterations, float *smooth,
+                  fractal_orbit_t *orbit, int julia, int interior) {
+    const __m128 two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f),
+                 one = _mm_set1_ps(1.0f);
+    const __m128 quarter = _mm_set1_ps(0.25f), sixteenth = _mm_set1_ps(0.0625f);
+    const __m128i max_n = _mm_set1_epi32(params->max_iterations);
+    const __m128 nan = _mm_set1_ps(NAN);
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = load_float_sse2(xc + i), y = load_float_sse2(yc + i);
+        __m128 cx = julia ? _mm_set1_ps((float)params->julia_x) : x;
+        __m128 cy = julia ? _mm_set1_ps((float)params->julia_y) : y;
+        if (start) {
+            x = load_float_sse2(orbit->x + i);
+            y = load_float_sse2(orbit->y + i);
+        }
+        __m128 xx, yy, r, active, same, saved_x = x, saved_y = y;
+        __m128 cycled = _mm_setzero_ps(), radius = _mm_setzero_ps();
+        __m128i n = _mm_set1_epi32(start);
+        active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            __m128 xq = _mm_sub_ps(x, quarter);
+            yy = _mm_mul_ps(y, y);
+            __m128 q = _mm_add_ps(_mm_mul_ps(xq, xq), yy);
+            __m128 bx = _mm_add_ps(x, one);
+            cycled = _mm_or_ps(
+                _mm_cmple_ps(_mm_mul_ps(q, _mm_add_ps(q, xq)),
+                             _mm_mul_ps(quarter, yy)),
+                _mm_cmple_ps(_mm_add_ps(_mm_mul_ps(bx, bx), yy), sixteenth));
+            active = _mm_andnot_ps(cycled, active);
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm_mul_ps(x, x);
+            yy = _mm_mul_ps(y, y);
+            r = _mm_add_ps(xx, yy);
+            if (smooth)
+                radius = _mm_or_ps(_mm_andnot_ps(active, radius),
+                                   _mm_and_ps(active, r));
+            active = _mm_and_ps(active, _mm_cmpngt_ps(r, four));
+            if (!_mm_movemask_ps(active))
+                break;
+
+            // active lanes are -1
+            n = _mm_sub_epi32(n, _mm_castps_si128(active));
+            y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, x), y), cy);
+            x = _mm_add_ps(_mm_sub_ps(xx, yy), cx);
+
+            if (interior) {
+                same = _mm_and_ps(_mm_cmpeq_ps(x, saved_x),
+                                  _mm_cmpeq_ps(y, saved_y));
+                same = _mm_and_ps(same, active);
+                cycled = _mm_or_ps(cycled, same);
+                active = _mm_andnot_ps(same, active);
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        __m128i mask = _mm_castps_si128(cycled);
+        n = _mm_or_si128(_mm_andnot_si128(mask, n), _mm_and_si128(mask, max_n));
+        skipped += __builtin_popcount(_mm_movemask_ps(cycled));
+        _mm_storeu_si128((__m128i *)(iterations + i), n);
+
+        if (orbit) {
+            store_float_sse2(orbit->x + i, _mm_or_ps(_mm_andnot_ps(cycled, x),
+                                                     _mm_and_ps(cycled, nan)));
+            store_float_sse2(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            float result[4];
+            _mm_storeu_ps(result, radius);
+            for (int l = 0; l < 4; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar_float(params, xc + i, yc + i, count - i,
+                                         iterations + i, smooth, orbit, julia,
+                                         interior);
+}
+
+__attribute__((target("avx2"))) int
+kernel_avx2_float(const fractal_kernel_params_t *params, const double *xc,
+                  const double *yc, int count, int *iterations, float *smooth,
+                  fractal_orbit_t *orbit, int julia, int interior) {
+    const __m256 two = _mm256_set1_ps(2.0f), four = _mm256_set1_ps(4.0f),
+                 one = _mm256_set1_ps(1.0f);
+    const __m256 quarter = _mm256_set1_ps(0.25f),
+                 sixteenth = _mm256_set1_ps(0.0625f);
+    const __m256i max_n = _mm256_set1_epi32(params->max_iterations);
+    const __m256 nan = _mm256_set1_ps(NAN);
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = load_float_avx2(xc + i), y = load_float_avx2(yc + i);
+        __m256 cx =
+            julia ? _mm256_set1_ps((float)params->julia_x) : x;
+        __m256 cy =
+            julia ? _mm256_set1_ps((float)params->julia_y) : y;
+        if (start) {
+            x = load_float_avx2(orbit->x + i);
+            y = load_float_avx2(orbit->y + i);
+        }
+        __m256 xx, yy, r, active, same, saved_x = x, saved_y = y;
+        __m256 cycled = _mm256_setzero_ps(), radius = _mm256_setzero_ps();
+        __m256i n = _mm256_set1_epi32(start);
+        active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            __m256 xq = _mm256_sub_ps(x, quarter);
+            yy = _mm256_mul_ps(y, y);
+            __m256 q = _mm256_add_ps(_mm256_mul_ps(xq, xq), yy);
+            __m256 bx = _mm256_add_ps(x, one);
+            cycled = _mm256_or_ps(
+                _mm256_cmp_ps(_mm256_mul_ps(q, _mm256_add_ps(q, xq)),
+                              _mm256_mul_ps(quarter, yy), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(bx, bx), yy),
+                              sixteenth, _CMP_LE_OQ));
+            active = _mm256_andnot_ps(cycled, active);
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm256_mul_ps(x, x);
+            yy = _mm256_mul_ps(y, y);
+            r = _mm256_add_ps(xx, yy);
+            if (smooth)
+                radius = _mm256_blendv_ps(radius, r, active);
+            active =
+                _mm256_and_ps(active, _mm256_cmp_ps(r, four, _CMP_NGT_UQ));
+            if (!_mm256_movemask_ps(active))
+                break;
+
+            n = _mm256_sub_epi32(n, _mm256_castps_si256(active));
+            y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, x), y), cy);
+            x = _mm256_add_ps(_mm256_sub_ps(xx, yy), cx);
+
+            if (interior) {
+                same = _mm256_and_ps(_mm256_cmp_ps(x, saved_x, _CMP_EQ_OQ),
+                                     _mm256_cmp_ps(y, saved_y, _CMP_EQ_OQ));
+                same = _mm256_and_ps(same, active);
+                cycled = _mm256_or_ps(cycled, same);
+                active = _mm256_andnot_ps(same, active);
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        n = _mm256_blendv_epi8(n, max_n, _mm256_castps_si256(cycled));
+        skipped += __builtin_popcount(_mm256_movemask_ps(cycled));
+        _mm256_storeu_si256((__m256i *)(iterations + i), n);
+
+        if (orbit) {
+            store_float_avx2(orbit->x + i, _mm256_blendv_ps(x, nan, cycled));
+            store_float_avx2(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            float result[8];
+            _mm256_storeu_ps(result, radius);
+            for (int l = 0; l < 8; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar_float(params, xc + i, yc + i, count - i,
+                                         iterations + i, smooth, orbit, julia,
+                                         interior);
+}
+
+__attribute__((target("avx512f"))) int
+kernel_avx512_float(const fractal_kernel_params_t *params, const double *xc,
+                    const double *yc, int count, int *iterations, float *smooth,
+                    fractal_orbit_t *orbit, int julia, int interior) {
+    const __m512 two = _mm512_set1_ps(2.0f), four = _mm512_set1_ps(4.0f),
+                 one = _mm512_set1_ps(1.0f);
+    const __m512 quarter = _mm512_set1_ps(0.25f),
+                 sixteenth = _mm512_set1_ps(0.0625f);
+    const __m512i max_n = _mm512_set1_epi32(params->max_iterations),
+                  one_n = _mm512_set1_epi32(1);
+    const __m512 nan = _mm512_set1_ps(NAN);
+    int i = 0, skipped = 0, start = orbit ? orbit->start : 0;
+    fractal_orbit_t rest;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512 x = load_float_avx512(xc + i), y = load_float_avx512(yc + i);
+        __m512 cx =
+            julia ? _mm512_set1_ps((float)params->julia_x) : x;
+        __m512 cy =
+            julia ? _mm512_set1_ps((float)params->julia_y) : y;
+        if (start) {
+            x = load_float_avx512(orbit->x + i);
+            y = load_float_avx512(orbit->y + i);
+        }
+        __m512 xx, yy, r, saved_x = x, saved_y = y;
+        __m512 radius = _mm512_setzero_ps();
+        __m512i n = _mm512_set1_epi32(start);
+        __mmask16 active = 0xFFFF, cycled = 0, same;
+        int check = 1;
+
+        if (interior && !julia && !start) {
+            __m512 xq = _mm512_sub_ps(x, quarter);
+            yy = _mm512_mul_ps(y, y);
+            __m512 q = _mm512_add_ps(_mm512_mul_ps(xq, xq), yy);
+            __m512 bx = _mm512_add_ps(x, one);
+            cycled = _mm512_cmp_ps_mask(
+                         _mm512_mul_ps(q, _mm512_add_ps(q, xq)),
+                         _mm512_mul_ps(quarter, yy), _CMP_LE_OQ) |
+                     _mm512_cmp_ps_mask(
+                         _mm512_add_ps(_mm512_mul_ps(bx, bx), yy), sixteenth,
+                         _CMP_LE_OQ);
+            active &= ~cycled;
+        }
+
+        for (int k = 0; k < params->max_iterations - start; k++) {
+            xx = _mm512_mul_ps(x, x);
+            yy = _mm512_mul_ps(y, y);
+            r = _mm512_add_ps(xx, yy);
+            if (smooth)
+                radius = _mm512_mask_mov_ps(radius, active, r);
+            active = _mm512_mask_cmp_ps_mask(active, r, four, _CMP_NGT_UQ);
+            if (!active)
+                break;
+
+            n = _mm512_mask_add_epi32(n, active, n, one_n);
+            y = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(two, x), y), cy);
+            x = _mm512_add_ps(_mm512_sub_ps(xx, yy), cx);
+
+            if (interior) {
+                same = _mm512_mask_cmp_ps_mask(active, x, saved_x, _CMP_EQ_OQ);
+                same = _mm512_mask_cmp_ps_mask(same, y, saved_y, _CMP_EQ_OQ);
+                cycled |= same;
+                active &= ~same;
+                if (k + 1 == check) {
+                    saved_x = x;
+                    saved_y = y;
+                    check *= 2;
+                }
+            }
+        }
+
+        n = _mm512_mask_mov_epi32(n, cycled, max_n);
+        skipped += __builtin_popcount(cycled);
+        _mm512_storeu_si512((void *)(iterations + i), n);
+
+        if (orbit) {
+            store_float_avx512(orbit->x + i,
+                               _mm512_mask_mov_ps(x, cycled, nan));
+            store_float_avx512(orbit->y + i, y);
+        }
+
+        if (smooth) {
+            float result[16];
+            _mm512_storeu_ps(result, radius);
+            for (int l = 0; l < 16; l++)
+                smooth[i + l] = kernel_smooth(
+                    iterations[i + l], params->max_iterations, result[l]);
+        }
+    }
+
+    // the remaining pixels
+    if (smooth)
+        smooth += i;
+    if (orbit) {
+        rest = (fractal_orbit_t){orbit->x + i, orbit->y + i, start};
+        orbit = &rest;
+    }
+    return skipped + kernel_scalar_float(params, xc + i, yc + i, count - i,
+                                         iterations + i, smooth, orbit, julia,
+                                         interior);
+}
+
+/*
+ * The float lanes are converted from and to the doubles of the arguments
+ * in groups of 2, 4 or 8, the halves are joined
+ */
+
+__attribute__((target("sse2"))) __m128 load_float_sse2(const double *p) {
+    return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)),
+                         _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+}
+
+__attribute__((target("sse2"))) void store_float_sse2(double *p, __m128 v) {
+    _mm_storeu_pd(p, _mm_cvtps_pd(v));
+    _mm_storeu_pd(p + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+}
+
+__attribute__((target("avx2"))) __m256 load_float_avx2(const double *p) {
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_loadu_pd(p))),
+        _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)), 1);
+}
+
+__attribute__((target("avx2"))) void store_float_avx2(double *p, __m256 v) {
+    _mm256_storeu_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_storeu_pd(p + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// avx512f has no insertf32x8, the halves are joined as doubles
+__attribute__((target("avx512f"))) __m512 load_float_avx512(const double *p) {
+    return _mm512_castpd_ps(_mm512_insertf64x4(
+        _mm512_castps_pd(
+            _mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_loadu_pd(p)))),
+        _mm256_castps_pd(_mm512_cvtpd_ps(_mm512_loadu_pd(p + 8))), 1));
+}
+
+__attribute__((target("avx512f"))) void store_float_avx512(double *p,
+                                                           __m512 v) {
+    _mm512_storeu_pd(p, _mm512_cvtps_pd(_mm512_castps512_ps256(v)));
+    _mm512_storeu_pd(p + 8,
+                     _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(
+                         _mm512_castps_pd(v), 1))));
+}
+
+#endif /* KERNEL_X86 */
+
+/*
+ * Every kernel body is compiled once, reading the fractal type and the
+ * interior check from the parameters. Variants with those flags as
+ * constants were no faster: the branches are loop-invariant and well
+ * predicted (fractal-bench measured them within +-5% of this loop)
+ */
+
+#define KERNEL_ENTRY(body, attributes)                                        \
+    attributes int body##_entry(const fractal_kernel_params_t *params,        \
+                                const double *xc, const double *yc,           \
+                                int count, int *iterations, float *smooth,    \
+                                fractal_orbit_t *orbit) {                     \
+        return body(params, xc, yc, count, iterations, smooth, orbit,         \
+                    params->use_julia, params->interior_check);               \
+    }
+
+KERNEL_ENTRY(kernel_scalar, static)
+KERNEL_ENTRY(kernel_scalar_float, static)
+KERNEL_ENTRY(kernel_double_double, static)
+
+#ifdef KERNEL_X86
+KERNEL_ENTRY(kernel_sse2, static __attribute__((target("sse2"))))
+KERNEL_ENTRY(kernel_avx2, static __attribute__((target("avx2"))))
+KERNEL_ENTRY(kernel_avx512, static __attribute__((target("avx512f"))))
+KERNEL_ENTRY(kernel_sse2_float, static __attribute__((target("sse2"))))
+KERNEL_ENTRY(kernel_avx2_float, static __attribute__((target("avx2"))))
+KERNEL_ENTRY(kernel_avx512_float, static __attribute__((target("avx512f"))))
+#endif
+
+fractal_kernel_t fractal_kernel_select(fractal_kernel_precision_t precision,
+                                       const char **name) {
+    const char *selected = "scalar";
+    int single = precision == FRACTAL_KERNEL_FLOAT;
+    fractal_kernel_t kernel =
+        single ? kernel_scalar_float_entry : kernel_scalar_entry;
+
+    if (precision == FRACTAL_KERNEL_DOUBLE_DOUBLE) {
+        // scalar only
+        if (name)
+            *name = selected;
+        return kernel_double_double_entry;
+    }
+
+#ifdef KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        selected = "avx512";
+        kernel = single ? kernel_avx512_float_entry : kernel_avx512_entry;
+    } else if (__builtin_cpu_supports("avx2")) {
+        selected = "avx2";
+        kernel = single ? kernel_avx2_float_entry : kernel_avx2_entry;
+    } else if (__builtin_cpu_supports("sse2")) {
+        selected = "sse2";
+        kernel = single ? kernel_sse2_float_entry : kernel_sse2_entry;
+    }
+#endif
+
+    if (name)
+        *name = selected;
+    return kernel;
+}
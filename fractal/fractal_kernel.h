@@ -0,0 +1,76 @@
+#ifndef FRACTAL_KERNEL_H
+#define FRACTAL_KERNEL_H
+
+// max number of pixels passed to a kernel in a single call
+#define FRACTAL_KERNEL_RUN 256
+
+/**
+ * Parameters shared by every pixel of a frame
+ */
+typedef struct {
+    double julia_x, julia_y; // Julia constant, ignored for Mandelbrot
+    int use_julia;
+    int max_iterations;
+    int interior_check; // detect points that never escape
+
+    // center of the view as a double-double (hi + lo), for the
+    // double-double kernels
+    double center_x[2], center_y[2];
+} fractal_kernel_params_t;
+
+/**
+ * Arithmetic of a kernel
+ */
+typedef enum {
+    FRACTAL_KERNEL_FLOAT,        // coordinates rounded to float
+    FRACTAL_KERNEL_DOUBLE,
+    FRACTAL_KERNEL_DOUBLE_DOUBLE // about 106 bits, see below
+} fractal_kernel_precision_t;
+
+/**
+ * Where the orbits of the pixels stopped, to resume them with a higher
+ * max_iterations
+ */
+typedef struct {
+    double *x, *y; // z of every pixel, x is NaN if the pixel never escapes
+    int start;     // iterations already done from x and y, 0 for none
+} fractal_orbit_t;
+
+/**
+ * Escape-time kernel: computes the iterations of 'count' pixels, 'xc' and
+ * 'yc' contain the real and imaginary part of each pixel (usually a run
+ * of contiguous columns). The result is written in 'iterations'.
+ * If params->interior_check is set, points inside the main cardioid or
+ * the period-2 bulb (Mandelbrot only) and orbits that become periodic
+ * get max_iterations without iterating further.
+ * Returns the number of pixels short-circuited this way.
+ * If 'smooth' is not NULL the fractional part of the iterations (see
+ * fractal_kernel_smooth) is written in it, 0 for the pixels that did not
+ * escape.
+ * If 'orbit' is not NULL the pixels start from its z after orbit->start
+ * iterations (if not 0), and the last z of every pixel is written in it:
+ * it is meaningful for the pixels that reached max_iterations.
+ * Double-double kernels get the offsets of the pixels from
+ * params->center_x and params->center_y in 'xc' and 'yc' instead, since
+ * adding them in double would lose the digits, and ignore 'orbit'
+ */
+typedef int (*fractal_kernel_t)(const fractal_kernel_params_t *params,
+                                const double *xc, const double *yc,
+                                int count, int *iterations, float *smooth,
+                                fractal_orbit_t *orbit);
+
+/**
+ * Returns the fastest kernel supported by the CPU. If 'name' is not NULL
+ * it will point to the name of the instruction set used
+ */
+extern fractal_kernel_t
+fractal_kernel_select(fractal_kernel_precision_t precision, const char **name);
+
+/**
+ * Fractional part of the iterations of a pixel that escaped with
+ * |z|^2 = 'radius' (normalized iteration count), from 0 to 1: the colors
+ * blended with it have no bands
+ */
+extern float fractal_kernel_smooth(double radius);
+
+#endif /* FRACTAL_KERNEL_H */
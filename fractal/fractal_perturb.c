@@ -0,0 +1,309 @@
+#include "fractal_perturb.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// a pixel is glitched when |z| < GLITCH_TOLERANCE * |Z| (Pauldelbrot)
+#define GLITCH_TOLERANCE_SQUARED 1e-6
+
+// private functions
+static inline int perturb_pixels(const fractal_reference_t *ref,
+                                 int max_iterations, const double *dx,
+                                 const double *dy, int count, int *iterations,
+                                 float *smooth, int julia)
+    __attribute__((always_inline));
+static int big_compare_abs(const fractal_big_t *a, const fractal_big_t *b,
+                           int limbs);
+static void big_add_abs(fractal_big_t *r, const fractal_big_t *a,
+                        const fractal_big_t *b, int limbs);
+static void big_sub_abs(fractal_big_t *r, const fractal_big_t *a,
+                        const fractal_big_t *b, int limbs);
+static void big_add(fractal_big_t *r, const fractal_big_t *a,
+                    const fractal_big_t *b, int limbs);
+static void big_sub(fractal_big_t *r, const fractal_big_t *a,
+                    const fractal_big_t *b, int limbs);
+
+int fractal_big_from_string(fractal_big_t *r, const char *str) {
+    const char *p = str, *digits, *last;
+    uint64_t integer = 0, rem;
+
+    if (!str)
+        return -1;
+
+    *r = (fractal_big_t){0};
+    if (*p == '-' || *p == '+')
+        r->negative = *p++ == '-';
+
+    for (digits = p; *p >= '0' && *p <= '9'; p++) {
+        integer = integer * 10 + (*p - '0');
+        if (integer > UINT32_MAX)
+            return -1;
+    }
+    r->limb[0] = (uint32_t)integer;
+
+    if (*p == '.') {
+        // the fraction is built from the last digit: f = (f + digit) / 10
+        for (last = ++p; *p >= '0' && *p <= '9'; p++)
+            ;
+        if (p == last && last - 1 == digits)
+            return -1; // just "."
+
+        for (const char *d = p - 1; d >= last; d--) {
+            rem = *d - '0';
+            for (int i = 1; i < FRACTAL_BIG_LIMBS; i++) {
+                uint64_t cur = (rem << 32) | r->limb[i];
+                r->limb[i] = (uint32_t)(cur / 10);
+                rem = cur % 10;
+            }
+        }
+    } else if (p == digits) {
+        return -1;
+    }
+
+    return *p == '\0' ? 0 : -1;
+}
+
+void fractal_big_from_double(fractal_big_t *r, double x) {
+    *r = (fractal_big_t){0};
+    r->negative = x < 0.0;
+    x = fabs(x);
+
+    // exact: every step removes the integer part and shifts by 32 bits
+    for (int i = 0; i < FRACTAL_BIG_LIMBS && x > 0.0; i++) {
+        r->limb[i] = (uint32_t)x;
+        x = ldexp(x - r->limb[i], 32);
+    }
+}
+
+double fractal_big_to_double(const fractal_big_t *a) {
+    double x = 0.0;
+    int first = 0;
+
+    // 96 bits from the first limb that is not zero are enough
+    while (first < FRACTAL_BIG_LIMBS - 1 && !a->limb[first])
+        first++;
+    for (int i = first + 2; i >= first; i--) {
+        if (i < FRACTAL_BIG_LIMBS)
+            x += ldexp(a->limb[i], -32 * i);
+    }
+    return a->negative ? -x : x;
+}
+
+void fractal_big_to_double_double(const fractal_big_t *a, double *dd) {
+    fractal_big_t hi, rest;
+
+    dd[0] = fractal_big_to_double(a);
+    fractal_big_from_double(&hi, dd[0]);
+    big_sub(&rest, a, &hi, FRACTAL_BIG_LIMBS);
+    dd[1] = fractal_big_to_double(&rest);
+}
+
+int fractal_big_limbs_for_zoom(double zoom) {
+    // 64 bits more than the size of a pixel
+    int limbs = zoom > 1.0 ? (int)(log2(zoom) / 32.0) + 3 : 3;
+    return limbs > FRACTAL_BIG_LIMBS ? FRACTAL_BIG_LIMBS : limbs;
+}
+
+void fractal_big_mul(fractal_big_t *r, const fractal_big_t *a,
+                     const fractal_big_t *b, int limbs) {
+    // product[k + 1] has weight 2^(-32 * k), product[0] is the overflow
+    uint32_t product[2 * FRACTAL_BIG_LIMBS + 1] = {0};
+    uint64_t carry;
+
+    // the rows go from the last limb of 'a' so that product[i] is still
+    // zero when the carry out of row i lands in it
+    for (int i = limbs - 1; i >= 0; i--) {
+        if (!a->limb[i])
+            continue;
+
+        carry = 0;
+        for (int j = limbs - 1; j >= 0; j--) {
+            carry += (uint64_t)a->limb[i] * b->limb[j] + product[i + j + 1];
+            product[i + j + 1] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        product[i] = (uint32_t)carry;
+    }
+
+    for (int i = 0; i < limbs; i++) {
+        r->limb[i] = product[i + 1];
+    }
+    r->negative = a->negative != b->negative;
+}
+
+fractal_reference_t *
+fractal_reference_new(const fractal_big_t *center_x,
+                      const fractal_big_t *center_y, double dx, double dy,
+                      const fractal_kernel_params_t *params, int limbs) {
+    fractal_big_t x, y, cx, cy, xx, yy, xy, tmp;
+    double zx, zy, r;
+    int max_iterations = params->max_iterations;
+
+    fractal_reference_t *ref = malloc(sizeof(fractal_reference_t));
+    ref->dx = dx;
+    ref->dy = dy;
+    ref->refs = 1;
+    ref->zx = malloc(sizeof(double) * (max_iterations + 1));
+    ref->zy = malloc(sizeof(double) * (max_iterations + 1));
+    ref->glitch = malloc(sizeof(double) * (max_iterations + 1));
+
+    fractal_big_from_double(&tmp, dx);
+    big_add(&x, center_x, &tmp, limbs);
+    fractal_big_from_double(&tmp, dy);
+    big_add(&y, center_y, &tmp, limbs);
+    if (params->use_julia) {
+        fractal_big_from_double(&cx, params->julia_x);
+        fractal_big_from_double(&cy, params->julia_y);
+    } else {
+        cx = x;
+        cy = y;
+    }
+
+    for (int n = 0;; n++) {
+        zx = fractal_big_to_double(&x);
+        zy = fractal_big_to_double(&y);
+        r = zx * zx + zy * zy;
+        ref->zx[n] = zx;
+        ref->zy[n] = zy;
+        ref->glitch[n] = GLITCH_TOLERANCE_SQUARED * r;
+
+        if (r > 4.0 || n == max_iterations) {
+            ref->length = n;
+            break;
+        }
+
+        fractal_big_mul(&xx, &x, &x, limbs);
+        fractal_big_mul(&yy, &y, &y, limbs);
+        fractal_big_mul(&xy, &x, &y, limbs);
+        big_sub(&tmp, &xx, &yy, limbs);
+        big_add(&x, &tmp, &cx, limbs);
+        big_add(&tmp, &xy, &xy, limbs);
+        big_add(&y, &tmp, &cy, limbs);
+    }
+
+    return ref;
+}
+
+fractal_reference_t *fractal_reference_ref(fractal_reference_t *ref) {
+    if (ref)
+        ref->refs++;
+    return ref;
+}
+
+void fractal_reference_free(fractal_reference_t *ref) {
+    if (!ref || --ref->refs > 0)
+        return;
+
+    free(ref->zx);
+    free(ref->zy);
+    free(ref->glitch);
+    free(ref);
+}
+
+int fractal_perturb_pixels(const fractal_reference_t *ref,
+                           const fractal_kernel_params_t *params,
+                           const double *dx, const double *dy, int count,
+                           int *iterations, float *smooth) {
+    return perturb_pixels(ref, params->max_iterations, dx, dy, count,
+                          iterations, smooth, params->use_julia);
+}
+
+//      Private functions
+
+int perturb_pixels(const fractal_reference_t *ref, int max_iterations,
+                   const double *dx, const double *dy, int count,
+                   int *iterations, float *smooth, int julia) {
+    int glitched = 0;
+
+    for (int i = 0; i < count; i++) {
+        // 'ex' and 'ey' are the delta from the reference orbit
+        double ex = dx[i] - ref->dx, ey = dy[i] - ref->dy;
+        double cx = julia ? 0.0 : ex;
+        double cy = julia ? 0.0 : ey;
+        double zx, zy, r = 0.0, tx, ty;
+        int n = 0;
+
+        while (n < max_iterations) {
+            zx = ref->zx[n] + ex;
+            zy = ref->zy[n] + ey;
+            r = zx * zx + zy * zy;
+            if (r > 4.0)
+                break;
+
+            if (n == ref->length || r < ref->glitch[n]) {
+                n = -(n + 1);
+                glitched++;
+                break;
+            }
+
+            // dz = (2 Z + dz) dz + dc
+            tx = 2.0 * ref->zx[n] + ex;
+            ty = 2.0 * ref->zy[n] + ey;
+            zx = tx * ex - ty * ey + cx;
+            ey = tx * ey + ty * ex + cy;
+            ex = zx;
+            n++;
+        }
+
+        iterations[i] = n;
+        if (smooth)
+            smooth[i] = n >= 0 && n < max_iterations ? fractal_kernel_smooth(r)
+                                                     : 0.0f;
+    }
+
+    return glitched;
+}
+
+int big_compare_abs(const fractal_big_t *a, const fractal_big_t *b,
+                    int limbs) {
+    for (int i = 0; i < limbs; i++) {
+        if (a->limb[i] != b->limb[i])
+            return a->limb[i] < b->limb[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+void big_add_abs(fractal_big_t *r, const fractal_big_t *a,
+                 const fractal_big_t *b, int limbs) {
+    uint64_t carry = 0;
+    for (int i = limbs - 1; i >= 0; i--) {
+        carry += (uint64_t)a->limb[i] + b->limb[i];
+        r->limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+}
+
+/**
+ * |r| = |a| - |b|, with |a| >= |b|
+ */
+void big_sub_abs(fractal_big_t *r, const fractal_big_t *a,
+                 const fractal_big_t *b, int limbs) {
+    int64_t borrow = 0;
+    for (int i = limbs - 1; i >= 0; i--) {
+        borrow += (int64_t)a->limb[i] - b->limb[i];
+        r->limb[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+}
+
+void big_add(fractal_big_t *r, const fractal_big_t *a, const fractal_big_t *b,
+             int limbs) {
+    if (a->negative == b->negative) {
+        r->negative = a->negative;
+        big_add_abs(r, a, b, limbs);
+    } else if (big_compare_abs(a, b, limbs) >= 0) {
+        r->negative = a->negative;
+        big_sub_abs(r, a, b, limbs);
+    } else {
+        r->negative = b->negative;
+        big_sub_abs(r, b, a, limbs);
+    }
+}
+
+void big_sub(fractal_big_t *r, const fractal_big_t *a, const fractal_big_t *b,
+             int limbs) {
+    fractal_big_t neg_b = *b;
+    neg_b.negative = !b->negative;
+    big_add(r, a, &neg_b, limbs);
+}
+
@@ -0,0 +1,94 @@
+#ifndef FRACTAL_PERTURB_H
+#define FRACTAL_PERTURB_H
+
+#include <stdint.h>
+
+#include "fractal_kernel.h"
+
+// max precision of the reference orbits: 32 * FRACTAL_BIG_LIMBS bits
+#define FRACTAL_BIG_LIMBS 40
+
+/**
+ * Fixed point number: limb[0] is the integer part, limb[i] has weight
+ * 2^(-32 * i). Operations use only the first 'limbs' limbs
+ */
+typedef struct {
+    int negative;
+    uint32_t limb[FRACTAL_BIG_LIMBS];
+} fractal_big_t;
+
+/**
+ * Reference orbit computed in high precision and stored as doubles:
+ * every pixel is iterated as a small delta from it. The orbit is read
+ * only once computed, the frames of a video share it
+ */
+typedef struct {
+    double dx, dy; // offset of the reference from the view center
+    int length;    // index of the last point of the orbit
+    double *zx, *zy;
+    double *glitch; // a pixel with |z|^2 below this value is glitched
+    int refs;       // owners of the orbit, see fractal_reference_ref
+} fractal_reference_t;
+
+/**
+ * Parses a decimal number like "-0.7436438870371587047522", returns 0 on
+ * success and -1 if the string is not valid
+ */
+extern int fractal_big_from_string(fractal_big_t *r, const char *str);
+
+extern void fractal_big_from_double(fractal_big_t *r, double x);
+
+extern double fractal_big_to_double(const fractal_big_t *a);
+
+/**
+ * Writes 'a' as dd[0] + dd[1]
+ */
+extern void fractal_big_to_double_double(const fractal_big_t *a, double *dd);
+
+/**
+ * Number of limbs needed to render with 'zoom' pixels per unit
+ */
+extern int fractal_big_limbs_for_zoom(double zoom);
+
+/**
+ * Writes a * b truncated to 'limbs' limbs: the limbs after the precision
+ * are dropped and so is the overflow of the integer part
+ */
+extern void fractal_big_mul(fractal_big_t *r, const fractal_big_t *a,
+                            const fractal_big_t *b, int limbs);
+
+/**
+ * Computes the orbit of the point center + (dx, dy) with 'limbs' limbs
+ * of precision. For Julia the orbit starts from that point, otherwise
+ * the point is 'c'
+ */
+extern fractal_reference_t *
+fractal_reference_new(const fractal_big_t *center_x,
+                      const fractal_big_t *center_y, double dx, double dy,
+                      const fractal_kernel_params_t *params, int limbs);
+
+/**
+ * Adds an owner to 'ref' and returns it, every owner frees it once.
+ * The owners are not counted atomically: they must be added and freed
+ * by the same thread
+ */
+extern fractal_reference_t *fractal_reference_ref(fractal_reference_t *ref);
+
+/**
+ * Frees 'ref' when its last owner frees it
+ */
+extern void fractal_reference_free(fractal_reference_t *ref);
+
+/**
+ * Iterates 'count' pixels at offset (dx, dy) from the view center using
+ * the reference orbit. Glitched pixels (the delta is no longer small
+ * compared to the orbit, or the orbit escaped first) are set to
+ * -(iterations + 1). Returns the number of glitched pixels.
+ * 'smooth' is the same of the kernels, it can be NULL
+ */
+extern int fractal_perturb_pixels(const fractal_reference_t *ref,
+                                  const fractal_kernel_params_t *params,
+                                  const double *dx, const double *dy,
+                                  int count, int *iterations, float *smooth);
+
+#endif /* FRACTAL_PERTURB_H */
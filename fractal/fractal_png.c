@@ -0,0 +1,708 @@
+#include "fractal_png.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rows of the image given to a worker at a time, at least this many bytes
+#define PNG_BAND_BYTES (256 * 1024)
+
+// window of deflate, filled with the end of the previous band
+#define PNG_WINDOW_BYTES 32768
+
+#define PNG_DEFAULT_LEVEL 6
+
+// bytes filtered between two checks of the cost of a filter
+#define PNG_COST_BLOCK 256
+
+// private functions
+static void *png_worker(void *data);
+static int png_deflate_init(fractal_png_t *png, z_stream *stream);
+static void png_compress(fractal_png_t *png, z_stream *stream,
+                         uint8_t *scratch, fractal_png_job_t *job);
+static void png_filter_rows(fractal_png_t *png, uint8_t *scratch,
+                            fractal_png_job_t *job, int from);
+static long png_filter_row(fractal_png_t *png, int type, const uint8_t *row,
+                           const uint8_t *prev, long limit, uint8_t *out);
+static void png_filter_block(int type, int bpp, const uint8_t *row,
+                             const uint8_t *prev, int from, int to,
+                             uint8_t *out);
+static int png_predict(int type, int a, int b, int c);
+static int png_paeth(int a, int b, int c);
+static int png_submit(fractal_png_t *png);
+static void png_next_job(fractal_png_t *png);
+static void png_flush(fractal_png_t *png, long until);
+static int png_write_job(fractal_png_t *png, fractal_png_job_t *job);
+static int png_write_chunk(fractal_png_t *png, const char *type,
+                           const uint8_t *data, size_t size);
+static void png_put_uint32(uint8_t *buffer, uint32_t value);
+static uint32_t png_get_uint32(const uint8_t *buffer);
+static uint8_t *png_read_file(const char *filename, size_t *size);
+static int png_read_chunks(const uint8_t *data, size_t size, int width,
+                           int height, uint8_t *palette, int *pixel_bytes,
+                           uint8_t **idat, size_t *idat_size);
+static int png_unfilter(uint8_t *data, int width, int height,
+                        int pixel_bytes, const uint8_t *palette,
+                        uint8_t *pixels, int stride);
+
+fractal_png_t *fractal_png_open(const char *filename, int width, int height,
+                                int level, fractal_png_filter_t filter,
+                                int threads, const uint32_t *palette,
+                                int colors) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    uint8_t header[13], entries[3 * 256];
+    size_t raw_size, filtered_size;
+
+    if (width < 1 || height < 1 || (palette && (colors < 1 || colors > 256)))
+        return NULL;
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Cannot create the photo");
+        return NULL;
+    }
+
+    fractal_png_t *png = calloc(1, sizeof(fractal_png_t));
+    png->file = file;
+    png->filename = malloc(strlen(filename) + 1);
+    strcpy(png->filename, filename);
+    png->width = width;
+    png->height = height;
+    png->level = level >= 1 && level <= 9 ? level : PNG_DEFAULT_LEVEL;
+    // the PNG specification advises no filter for indexed images
+    png->filter = palette && filter == FRACTAL_PNG_FILTER_AUTO
+                      ? FRACTAL_PNG_FILTER_NONE
+                      : filter;
+    png->pixel_bytes = palette ? 1 : 3;
+    png->row_bytes = png->pixel_bytes * width;
+    png->zeros = calloc(png->row_bytes, 1);
+    png->adler = adler32(0L, Z_NULL, 0);
+
+    // the row above the dictionary is needed to filter its first row
+    png->context_rows = PNG_WINDOW_BYTES / (png->row_bytes + 1) + 2;
+    png->band_rows = PNG_BAND_BYTES / png->row_bytes + 1;
+    if (png->band_rows < png->context_rows)
+        png->band_rows = png->context_rows;
+
+    // a small image is a single band, that needs no context
+    if (png->band_rows > height)
+        png->band_rows = height;
+    if (png->context_rows > height)
+        png->context_rows = height;
+
+    // without workers there is one band in flight and the one before it
+    png->thread_count = threads > 0 ? threads : 0;
+    png->job_count = threads > 0 ? 2 * threads : 2;
+    png->jobs = calloc(png->job_count, sizeof(fractal_png_job_t));
+    raw_size = (size_t)(png->context_rows + png->band_rows) * png->row_bytes;
+    filtered_size =
+        (size_t)(png->context_rows + png->band_rows) * (png->row_bytes + 1);
+    for (int i = 0; i < png->job_count; i++) {
+        png->jobs[i].raw = malloc(raw_size);
+        png->jobs[i].filtered = malloc(filtered_size);
+        png->jobs[i].out_capacity = compressBound(filtered_size) + 64;
+        png->jobs[i].out = malloc(png->jobs[i].out_capacity);
+    }
+
+    pthread_mutex_init(&png->lock, NULL);
+    pthread_cond_init(&png->ready, NULL);
+    pthread_cond_init(&png->done, NULL);
+    png->threads = malloc(sizeof(pthread_t) * png->thread_count);
+    for (int i = 0; i < png->thread_count; i++)
+        pthread_create(png->threads + i, NULL, png_worker, png);
+    if (!png->thread_count) {
+        png->scratch = malloc(png->row_bytes + 1);
+        png->stream_ready = !png_deflate_init(png, &png->stream);
+    }
+
+    png_put_uint32(header, width);
+    png_put_uint32(header + 4, height);
+    header[8] = 8;  // bits per sample
+    header[9] = palette ? 3 : 2; // indexed or RGB
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filters
+    header[12] = 0; // not interlaced
+    if (fwrite(signature, 1, 8, file) != 8) {
+        perror("Cannot save the photo");
+        png->failed = 1;
+    }
+    if (png->failed || png_write_chunk(png, "IHDR", header, 13)) {
+        fractal_png_close(png, 0);
+        return NULL;
+    }
+
+    if (palette) {
+        for (int i = 0; i < colors; i++) {
+            entries[3 * i] = palette[i] & 0xFF;
+            entries[3 * i + 1] = palette[i] >> 8 & 0xFF;
+            entries[3 * i + 2] = palette[i] >> 16 & 0xFF;
+        }
+        if (png_write_chunk(png, "PLTE", entries, 3 * colors)) {
+            fractal_png_close(png, 0);
+            return NULL;
+        }
+    }
+
+    png_next_job(png);
+    return png;
+}
+
+int fractal_png_write(fractal_png_t *png, const uint8_t *pixels, int rows) {
+    fractal_png_job_t *job;
+    int count;
+
+    if (png->failed || png->rows + rows > png->height)
+        return -1;
+
+    while (rows > 0) {
+        job = png->jobs + png->filling % png->job_count;
+        count = png->band_rows - job->rows;
+        count = count < rows ? count : rows;
+        memcpy(job->raw + (size_t)(job->context + job->rows) * png->row_bytes,
+               pixels, (size_t)count * png->row_bytes);
+        job->rows += count;
+        png->rows += count;
+        pixels += (size_t)count * png->row_bytes;
+        rows -= count;
+
+        if (job->rows == png->band_rows || png->rows == png->height) {
+            if (png_submit(png))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int fractal_png_close(fractal_png_t *png, int keep) {
+    int saved = keep && !png->failed && png->rows == png->height;
+
+    if (saved) {
+        png_flush(png, png->filling);
+        saved = !png->failed && !png_write_chunk(png, "IEND", NULL, 0);
+    }
+
+    pthread_mutex_lock(&png->lock);
+    png->stop = 1;
+    pthread_cond_broadcast(&png->ready);
+    pthread_mutex_unlock(&png->lock);
+    for (int i = 0; i < png->thread_count; i++)
+        pthread_join(png->threads[i], NULL);
+
+    if (fclose(png->file) != 0 && saved) {
+        perror("Cannot save the photo");
+        saved = 0;
+    }
+    if (!saved)
+        remove(png->filename);
+
+    for (int i = 0; i < png->job_count; i++) {
+        free(png->jobs[i].raw);
+        free(png->jobs[i].filtered);
+        free(png->jobs[i].out);
+    }
+    if (png->stream_ready)
+        deflateEnd(&png->stream);
+    pthread_mutex_destroy(&png->lock);
+    pthread_cond_destroy(&png->ready);
+    pthread_cond_destroy(&png->done);
+    free(png->scratch);
+    free(png->jobs);
+    free(png->threads);
+    free(png->zeros);
+    free(png->filename);
+    free(png);
+    return saved ? 0 : -1;
+}
+
+int fractal_png_read(const char *filename, int width, int height,
+                     uint8_t *pixels, int stride) {
+    uint8_t palette[3 * 256] = {0}, *data, *idat = NULL, *inflated;
+    size_t size, idat_size = 0;
+    int pixel_bytes = 0, result = -1;
+    uLongf expected, inflated_size;
+
+    data = png_read_file(filename, &size);
+    if (!data)
+        return -1;
+
+    if (!png_read_chunks(data, size, width, height, palette, &pixel_bytes,
+                         &idat, &idat_size)) {
+        expected = (uLongf)(pixel_bytes * width + 1) * height;
+        inflated_size = expected;
+        inflated = malloc(expected);
+        if (uncompress(inflated, &inflated_size, idat, idat_size) == Z_OK &&
+            inflated_size == expected)
+            result = png_unfilter(inflated, width, height, pixel_bytes,
+                                  palette, pixels, stride);
+        free(inflated);
+    }
+
+    free(idat);
+    free(data);
+    return result;
+}
+
+//      Private functions
+
+/**
+ * Compresses the ready bands, the oldest first, until the file is closed
+ */
+void *png_worker(void *data) {
+    fractal_png_t *png = data;
+    fractal_png_job_t *job;
+    z_stream stream;
+    uint8_t *scratch = malloc(png->row_bytes + 1);
+    int ready = !png_deflate_init(png, &stream);
+
+    pthread_mutex_lock(&png->lock);
+    while (!png->stop) {
+        job = NULL;
+        for (int i = 0; i < png->job_count; i++) {
+            if (png->jobs[i].state == PNG_JOB_READY &&
+                (!job || png->jobs[i].sequence < job->sequence))
+                job = png->jobs + i;
+        }
+        if (!job) {
+            pthread_cond_wait(&png->ready, &png->lock);
+            continue;
+        }
+
+        job->state = PNG_JOB_BUSY;
+        pthread_mutex_unlock(&png->lock);
+        if (ready)
+            png_compress(png, &stream, scratch, job);
+        job->failed = !ready;
+        pthread_mutex_lock(&png->lock);
+        job->state = PNG_JOB_DONE;
+        pthread_cond_broadcast(&png->done);
+    }
+    pthread_mutex_unlock(&png->lock);
+
+    if (ready)
+        deflateEnd(&stream);
+    free(scratch);
+    return NULL;
+}
+
+/**
+ * Initializes a raw deflate stream for the bands, returns -1 on error
+ */
+int png_deflate_init(fractal_png_t *png, z_stream *stream) {
+    // like libpng, the filtered rows are mostly small values
+    int strategy = png->filter == FRACTAL_PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY
+                                                          : Z_FILTERED;
+
+    memset(stream, 0, sizeof(z_stream));
+    if (deflateInit2(stream, png->level, Z_DEFLATED, -15, 8, strategy) !=
+        Z_OK) {
+        fprintf(stderr, "Cannot initialize zlib\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Filters the band of 'job' and deflates it as a part of the zlib stream
+ * of the image: the first band starts with the zlib header, the others
+ * use the end of the previous one as dictionary and only the last one
+ * ends the stream
+ */
+void png_compress(fractal_png_t *png, z_stream *stream, uint8_t *scratch,
+                  fractal_png_job_t *job) {
+    int line = png->row_bytes + 1, flevel;
+    // the first context row has no row above unless it is the first row
+    // of the image: it is not part of the dictionary
+    int from = job->first_row == 0 ? 0 : 1;
+    size_t dictionary = (size_t)(job->context - from) * line;
+    uint8_t *band = job->filtered + (size_t)job->context * line;
+
+    png_filter_rows(png, scratch, job, from);
+    job->bytes = (size_t)job->rows * line;
+    job->adler = adler32(adler32(0L, Z_NULL, 0), band, job->bytes);
+
+    deflateReset(stream);
+    if (dictionary > PNG_WINDOW_BYTES)
+        dictionary = PNG_WINDOW_BYTES;
+    if (dictionary > 0)
+        deflateSetDictionary(stream, band - dictionary, dictionary);
+
+    job->out_size = 0;
+    if (job->sequence == 0) {
+        flevel = png->level < 2    ? 0
+                 : png->level < 6  ? 1
+                 : png->level == 6 ? 2
+                                   : 3;
+        job->out[0] = 0x78; // deflate with a 32 KiB window
+        job->out[1] = flevel << 6;
+        job->out[1] |= 31 - (0x78 << 8 | job->out[1]) % 31;
+        job->out_size = 2;
+    }
+
+    // 4 bytes are left for the checksum at the end of the stream
+    stream->next_in = band;
+    stream->avail_in = job->bytes;
+    while (1) {
+        stream->next_out = job->out + job->out_size;
+        stream->avail_out = job->out_capacity - 4 - job->out_size;
+        deflate(stream, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+        job->out_size = job->out_capacity - 4 - stream->avail_out;
+        if (stream->avail_out > 0)
+            break;
+
+        job->out_capacity *= 2;
+        job->out = realloc(job->out, job->out_capacity);
+    }
+}
+
+/**
+ * Filters the rows of 'raw' from 'from' in 'filtered', with the filter
+ * of the image or the one with the smallest sum of the absolute values
+ */
+void png_filter_rows(fractal_png_t *png, uint8_t *scratch,
+                     fractal_png_job_t *job, int from) {
+    const uint8_t *row, *prev;
+    uint8_t *out, *best, *candidate;
+    long cost, best_cost;
+
+    for (int i = from; i < job->context + job->rows; i++) {
+        row = job->raw + (size_t)i * png->row_bytes;
+        prev = i > 0 ? row - png->row_bytes : png->zeros;
+        out = job->filtered + (size_t)i * (png->row_bytes + 1);
+        if (png->filter != FRACTAL_PNG_FILTER_AUTO) {
+            png_filter_row(png, png->filter - FRACTAL_PNG_FILTER_NONE, row,
+                           prev, LONG_MAX, out);
+            continue;
+        }
+
+        // the best row so far stays in one buffer, the next candidate is
+        // filtered in the other one
+        best = out;
+        candidate = scratch;
+        best_cost = png_filter_row(png, 0, row, prev, LONG_MAX, best);
+        for (int type = 1; type < 5; type++) {
+            cost = png_filter_row(png, type, row, prev, best_cost, candidate);
+            if (cost < best_cost) {
+                best_cost = cost;
+                candidate = best;
+                best = out == best ? scratch : out;
+            }
+        }
+        if (best != out)
+            memcpy(out, best, png->row_bytes + 1);
+    }
+}
+
+/**
+ * Writes the filter type and the filtered bytes of 'row' in 'out',
+ * 'prev' is the row above. Returns the sum of the absolute values of the
+ * bytes as signed (lower sums usually compress better), the filter stops
+ * as soon as it is greater than 'limit'
+ */
+long png_filter_row(fractal_png_t *png, int type, const uint8_t *row,
+                    const uint8_t *prev, long limit, uint8_t *out) {
+    int bytes = png->row_bytes, bpp = png->pixel_bytes, x, end;
+    long cost = 0;
+
+    // the first pixel has nothing on its left
+    *out++ = type;
+    for (x = 0; x < bpp; x++)
+        out[x] = row[x] - png_predict(type, 0, prev[x], 0);
+
+    // the limit is checked once per block, so the loops are vectorized
+    for (x = 0; x < bytes && cost <= limit; x = end) {
+        end = x + PNG_COST_BLOCK < bytes ? x + PNG_COST_BLOCK : bytes;
+        png_filter_block(type, bpp, row, prev, x < bpp ? bpp : x, end, out);
+        for (; x < end; x++)
+            cost += out[x] < 128 ? out[x] : 256 - out[x];
+    }
+    return cost;
+}
+
+/**
+ * Filters the bytes of 'row' from 'from' (at least 'bpp', the bytes of a
+ * pixel) to 'to' excluded
+ */
+void png_filter_block(int type, int bpp, const uint8_t *row,
+                      const uint8_t *prev, int from, int to, uint8_t *out) {
+    int x;
+
+    switch (type) {
+    case 0: // none
+        for (x = from; x < to; x++)
+            out[x] = row[x];
+        break;
+    case 1: // sub
+        for (x = from; x < to; x++)
+            out[x] = row[x] - row[x - bpp];
+        break;
+    case 2: // up
+        for (x = from; x < to; x++)
+            out[x] = row[x] - prev[x];
+        break;
+    case 3: // average
+        for (x = from; x < to; x++)
+            out[x] = row[x] - ((row[x - bpp] + prev[x]) >> 1);
+        break;
+    default: // paeth
+        for (x = from; x < to; x++)
+            out[x] =
+                row[x] - png_paeth(row[x - bpp], prev[x], prev[x - bpp]);
+        break;
+    }
+}
+
+/**
+ * Value predicted by the filter 'type' from the byte on the left 'a', the
+ * one above 'b' and the one above on the left 'c'
+ */
+int png_predict(int type, int a, int b, int c) {
+    switch (type) {
+    case 0:
+        return 0;
+    case 1:
+        return a;
+    case 2:
+        return b;
+    case 3:
+        return (a + b) >> 1;
+    default:
+        return png_paeth(a, b, c);
+    }
+}
+
+int png_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/**
+ * Gives the band being filled to the workers (or compresses it if there
+ * are none) and prepares the next one. Returns -1 on error
+ */
+int png_submit(fractal_png_t *png) {
+    fractal_png_job_t *job = png->jobs + png->filling % png->job_count;
+
+    job->last = png->rows == png->height;
+    if (!png->thread_count) {
+        if (png->stream_ready)
+            png_compress(png, &png->stream, png->scratch, job);
+        job->failed = !png->stream_ready;
+        job->state = PNG_JOB_DONE;
+    } else {
+        pthread_mutex_lock(&png->lock);
+        job->state = PNG_JOB_READY;
+        pthread_cond_signal(&png->ready);
+        pthread_mutex_unlock(&png->lock);
+    }
+
+    png->filling++;
+    if (!job->last)
+        png_next_job(png);
+    return png->failed ? -1 : 0;
+}
+
+/**
+ * Prepares the job of the band 'filling', writing the band that used it
+ * before, with the last rows of the previous band as context
+ */
+void png_next_job(fractal_png_t *png) {
+    fractal_png_job_t *job = png->jobs + png->filling % png->job_count;
+    fractal_png_job_t *prev =
+        png->jobs + (png->filling + png->job_count - 1) % png->job_count;
+
+    png_flush(png, png->filling - png->job_count + 1);
+
+    job->sequence = png->filling;
+    job->context = png->rows < png->context_rows ? png->rows
+                                                 : png->context_rows;
+    job->first_row = png->rows - job->context;
+    job->rows = 0;
+
+    // the previous band is full and at least as tall as the context
+    if (job->context > 0)
+        memcpy(job->raw,
+               prev->raw + (size_t)(job->first_row - prev->first_row) *
+                               png->row_bytes,
+               (size_t)job->context * png->row_bytes);
+}
+
+/**
+ * Waits for the bands before 'until' and writes them in order
+ */
+void png_flush(fractal_png_t *png, long until) {
+    fractal_png_job_t *job;
+
+    for (; png->written < until; png->written++) {
+        job = png->jobs + png->written % png->job_count;
+        pthread_mutex_lock(&png->lock);
+        while (job->state != PNG_JOB_DONE)
+            pthread_cond_wait(&png->done, &png->lock);
+        pthread_mutex_unlock(&png->lock);
+
+        if (!png->failed)
+            png_write_job(png, job);
+        pthread_mutex_lock(&png->lock);
+        job->state = PNG_JOB_FREE;
+        pthread_mutex_unlock(&png->lock);
+    }
+}
+
+/**
+ * Writes the deflated band in an IDAT chunk, the last one with the
+ * checksum of the whole stream. Returns -1 on error
+ */
+int png_write_job(fractal_png_t *png, fractal_png_job_t *job) {
+    if (job->failed) {
+        png->failed = 1;
+        return -1;
+    }
+
+    png->adler = adler32_combine(png->adler, job->adler, job->bytes);
+    if (job->last) {
+        png_put_uint32(job->out + job->out_size, png->adler);
+        job->out_size += 4;
+    }
+    return png_write_chunk(png, "IDAT", job->out, job->out_size);
+}
+
+/**
+ * Writes a chunk with its length and CRC, returns -1 on error
+ */
+int png_write_chunk(fractal_png_t *png, const char *type,
+                    const uint8_t *data, size_t size) {
+    uint8_t header[8], crc[4];
+    uLong checksum = crc32(0L, (const uint8_t *)type, 4);
+
+    if (size > 0)
+        checksum = crc32(checksum, data, size);
+    png_put_uint32(header, size);
+    memcpy(header + 4, type, 4);
+    png_put_uint32(crc, checksum);
+
+    if (fwrite(header, 1, 8, png->file) != 8 ||
+        (size > 0 && fwrite(data, 1, size, png->file) != size) ||
+        fwrite(crc, 1, 4, png->file) != 4) {
+        perror("Cannot save the photo");
+        png->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Big-endian, like every integer of a PNG file
+ */
+void png_put_uint32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+uint32_t png_get_uint32(const uint8_t *buffer) {
+    return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 |
+           (uint32_t)buffer[2] << 8 | buffer[3];
+}
+
+/**
+ * Reads the whole file, returns NULL if it cannot be read
+ */
+uint8_t *png_read_file(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    uint8_t *data = NULL;
+    long length;
+
+    if (!file)
+        return NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 &&
+        fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(length);
+        if (fread(data, 1, length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+        *size = length;
+    }
+    fclose(file);
+    return data;
+}
+
+/**
+ * Checks the chunks of a PNG file written by fractal_png_open, with its
+ * size, and joins its IDAT chunks in 'idat'. The palette of an indexed
+ * image is copied in 'palette'. Returns -1 if the file is not valid
+ */
+int png_read_chunks(const uint8_t *data, size_t size, int width, int height,
+                    uint8_t *palette, int *pixel_bytes, uint8_t **idat,
+                    size_t *idat_size) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const uint8_t *type, *chunk;
+    size_t offset = 8, length;
+
+    if (size < 8 || memcmp(data, signature, 8) != 0)
+        return -1;
+
+    while (offset + 12 <= size) {
+        length = png_get_uint32(data + offset);
+        if (length > size - offset - 12)
+            return -1;
+        type = data + offset + 4;
+        chunk = type + 4;
+        if (crc32(0L, type, length + 4) != png_get_uint32(chunk + length))
+            return -1;
+        offset += length + 12;
+
+        if (!memcmp(type, "IHDR", 4)) {
+            if (length != 13 || png_get_uint32(chunk) != (uint32_t)width ||
+                png_get_uint32(chunk + 4) != (uint32_t)height ||
+                chunk[8] != 8 || (chunk[9] != 2 && chunk[9] != 3) ||
+                chunk[12] != 0)
+                return -1;
+            *pixel_bytes = chunk[9] == 2 ? 3 : 1;
+        } else if (!memcmp(type, "PLTE", 4) && length <= 3 * 256) {
+            memcpy(palette, chunk, length);
+        } else if (!memcmp(type, "IDAT", 4)) {
+            *idat = realloc(*idat, *idat_size + length);
+            memcpy(*idat + *idat_size, chunk, length);
+            *idat_size += length;
+        } else if (!memcmp(type, "IEND", 4)) {
+            return *pixel_bytes && *idat ? 0 : -1;
+        }
+    }
+    return -1; // incomplete
+}
+
+/**
+ * Reverses the filters of the inflated rows of 'data' and writes their
+ * pixels in RGB in 'pixels', a row every 'stride' bytes. Returns -1 if a
+ * filter is not valid
+ */
+int png_unfilter(uint8_t *data, int width, int height, int pixel_bytes,
+                 const uint8_t *palette, uint8_t *pixels, int stride) {
+    int bytes = pixel_bytes * width, a, c;
+    uint8_t *row, *prev = NULL, *out;
+
+    for (int y = 0; y < height; y++, prev = row) {
+        row = data + (size_t)y * (bytes + 1) + 1;
+        if (row[-1] > 4)
+            return -1;
+        for (int x = 0; x < bytes; x++) {
+            a = x < pixel_bytes ? 0 : row[x - pixel_bytes];
+            c = x < pixel_bytes || !prev ? 0 : prev[x - pixel_bytes];
+            row[x] += png_predict(row[-1], a, prev ? prev[x] : 0, c);
+        }
+
+        out = pixels + (size_t)y * stride;
+        if (pixel_bytes == 3) {
+            memcpy(out, row, bytes);
+            continue;
+        }
+        for (int x = 0; x < width; x++)
+            memcpy(out + 3 * x, palette + 3 * row[x], 3);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef FRACTAL_PNG_H
+#define FRACTAL_PNG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "fractal.h"
+
+typedef enum {
+    PNG_JOB_FREE,  // can be filled with the next rows
+    PNG_JOB_READY, // waiting for a worker
+    PNG_JOB_BUSY,  // filtered and compressed by a worker
+    PNG_JOB_DONE   // waiting to be written in the file
+} fractal_png_job_state_t;
+
+/**
+ * Band of rows filtered and deflated by a worker. The rows before the
+ * band ('context') are filtered again to give the band the previous
+ * 32 KiB of the stream as dictionary, so the bands are compressed
+ * independently almost as well as a single stream
+ */
+typedef struct {
+    fractal_png_job_state_t state;
+    long sequence; // index of the band in the image
+    int first_row; // image row of the first row of 'raw'
+    int context;   // rows of 'raw' before the band
+    int rows;      // rows of the band
+    int last;      // the band ends the zlib stream
+    int failed;    // zlib could not be initialized
+
+    uint8_t *raw;      // context + rows rows of pixels
+    uint8_t *filtered; // the same rows with their filter type byte
+    uint8_t *out;      // deflated band
+    size_t out_size, out_capacity;
+    uLong adler;  // of the filtered band
+    size_t bytes; // size of the filtered band
+} fractal_png_job_t;
+
+/**
+ * RGB or indexed PNG file written a band of rows at a time, so the whole
+ * image is never in memory. The bands are filtered and deflated by
+ * 'threads' workers and joined in a single zlib stream, like pigz
+ */
+typedef struct {
+    FILE *file;
+    char *filename; // removed if the image is not complete
+    int width, height;
+    int rows;   // rows given so far
+    int failed; // an I/O error happened, nothing else is written
+
+    int level;                   // zlib compression level
+    fractal_png_filter_t filter; // filter of the rows
+    int pixel_bytes;             // 3 for RGB, 1 for indexed
+    int row_bytes;               // bytes of a row without the filter byte
+    int band_rows;               // rows of a full band
+    int context_rows;            // rows filtered again as dictionary
+    uint8_t *zeros;              // row above the first one
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // signaled when a job becomes ready
+    pthread_cond_t done;  // signaled when a job is done
+    pthread_t *threads;
+    int thread_count; // 0 to compress the bands in fractal_png_write
+    int stop;
+
+    // used by fractal_png_write without workers
+    z_stream stream;
+    int stream_ready;
+    uint8_t *scratch;
+
+    // jobs[sequence % job_count] is the band 'sequence', the bands are
+    // written in order before their job is filled again
+    fractal_png_job_t *jobs;
+    int job_count;
+    long filling; // sequence of the band being filled
+    long written; // bands written in the file
+    uLong adler;  // of the filtered bands written so far
+} fractal_png_t;
+
+/**
+ * Creates the file, writes the header and starts 'threads' workers, with
+ * 0 the bands are compressed by the caller (for small images written by
+ * several threads at a time).
+ * 'level' is the zlib level from 1 to 9, 0 for the default. If 'palette'
+ * is not NULL the image is indexed with its 'colors' colors (at most
+ * 256, packed as 0x00BBGGRR). Returns NULL on error
+ */
+extern fractal_png_t *fractal_png_open(const char *filename, int width,
+                                       int height, int level,
+                                       fractal_png_filter_t filter,
+                                       int threads, const uint32_t *palette,
+                                       int colors);
+
+/**
+ * Writes the next 'rows' rows, 'pixels' contains 3 bytes per pixel (RGB)
+ * or 1 (the index of the color) without padding and can be reused as
+ * soon as the function returns. Returns -1 on error
+ */
+extern int fractal_png_write(fractal_png_t *png, const uint8_t *pixels,
+                             int rows);
+
+/**
+ * Waits for the workers, ends the image and closes the file. If 'keep'
+ * is 0 or the image is not complete the file is removed. Returns -1 if
+ * it has not been saved
+ */
+extern int fractal_png_close(fractal_png_t *png, int keep);
+
+/**
+ * Reads a width x height PNG written by fractal_png_open in 'pixels', in
+ * RGB with a row every 'stride' bytes. Returns -1 if the file does not
+ * exist, is not complete or has another size
+ */
+extern int fractal_png_read(const char *filename, int width, int height,
+                            uint8_t *pixels, int stride);
+
+#endif /* FRACTAL_PNG_H */
@@ -0,0 +1,168 @@
+#include "fractal_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// cores shared by every pool, 0 until the first use
+static int budget_cores, budget_used;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_free = PTHREAD_COND_INITIALIZER;
+
+// private functions
+static void *pool_thread(void *void_args);
+static int online_cpus();
+
+fractal_pool_t *fractal_pool_new(int size) {
+    if (size < 1)
+        return NULL;
+
+    fractal_pool_t *pool = malloc(sizeof(fractal_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = malloc(sizeof(pthread_t) * size);
+    pool->workers = malloc(sizeof(fractal_pool_worker_t) * size);
+    pool->size = size;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->stop = 0;
+    pool->job = NULL;
+    pool->data = NULL;
+
+    int creation_result;
+    for (int i = 0; i < size; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        creation_result = pthread_create(pool->threads + i, NULL, pool_thread,
+                                         pool->workers + i);
+        if (creation_result) {
+            fprintf(stderr, "ERROR: Cannot create threads\n");
+            exit(creation_result);
+        }
+    }
+
+    return pool;
+}
+
+void fractal_pool_start(fractal_pool_t *pool, fractal_pool_job_t job,
+                        void *data) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+
+    pool->job = job;
+    pool->data = data;
+    pool->running = pool->size;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void fractal_pool_wait(fractal_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void fractal_pool_run(fractal_pool_t *pool, fractal_pool_job_t job,
+                      void *data) {
+    fractal_pool_start(pool, job, data);
+    fractal_pool_wait(pool);
+}
+
+void fractal_pool_free(fractal_pool_t *pool) {
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->size; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+void fractal_pool_set_budget(int cores) {
+    pthread_mutex_lock(&budget_lock);
+    budget_cores = cores > 0 ? cores : online_cpus();
+    pthread_cond_broadcast(&budget_free);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+int fractal_pool_get_budget() {
+    int cores;
+
+    pthread_mutex_lock(&budget_lock);
+    if (!budget_cores)
+        budget_cores = online_cpus();
+    cores = budget_cores;
+    pthread_mutex_unlock(&budget_lock);
+    return cores;
+}
+
+void fractal_pool_acquire_core() {
+    pthread_mutex_lock(&budget_lock);
+    if (!budget_cores)
+        budget_cores = online_cpus();
+    while (budget_used >= budget_cores)
+        pthread_cond_wait(&budget_free, &budget_lock);
+    budget_used++;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void fractal_pool_release_core() {
+    pthread_mutex_lock(&budget_lock);
+    budget_used--;
+    pthread_cond_signal(&budget_free);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+//      Private functions
+
+void *pool_thread(void *void_args) {
+    fractal_pool_worker_t *worker = void_args;
+    fractal_pool_t *pool = worker->pool;
+    unsigned long generation = 0;
+    fractal_pool_job_t job;
+    void *data;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+
+        generation = pool->generation;
+        job = pool->job;
+        data = pool->data;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(worker->index, data);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int online_cpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
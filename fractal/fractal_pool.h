@@ -0,0 +1,85 @@
+#ifndef FRACTAL_POOL_H
+#define FRACTAL_POOL_H
+
+#include <pthread.h>
+
+/**
+ * Function executed by every worker of the pool, 'worker' is the index
+ * of the worker (from 0 to size - 1)
+ */
+typedef void (*fractal_pool_job_t)(int worker, void *data);
+
+typedef struct fractal_pool fractal_pool_t;
+
+typedef struct {
+    fractal_pool_t *pool;
+    int index;
+} fractal_pool_worker_t;
+
+/**
+ * Long-lived workers, woken up once for every frame
+ */
+struct fractal_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start; // signaled when a new job is available
+    pthread_cond_t done;  // signaled when every worker has finished the job
+
+    pthread_t *threads;
+    fractal_pool_worker_t *workers;
+    int size;
+
+    unsigned long generation; // incremented for every job
+    int running;              // workers still executing the current job
+    int stop;
+
+    fractal_pool_job_t job;
+    void *data;
+};
+
+/**
+ * Creates a pool of 'size' threads waiting for jobs
+ */
+extern fractal_pool_t *fractal_pool_new(int size);
+
+/**
+ * Executes 'job' on every worker without waiting for the result
+ */
+extern void fractal_pool_start(fractal_pool_t *pool, fractal_pool_job_t job,
+                               void *data);
+
+/**
+ * Waits until every worker has finished the job
+ */
+extern void fractal_pool_wait(fractal_pool_t *pool);
+
+/**
+ * Executes 'job' on every worker and waits for the result
+ */
+extern void fractal_pool_run(fractal_pool_t *pool, fractal_pool_job_t job,
+                             void *data);
+
+/**
+ * Waits the current job, stops and joins the workers and frees the pool
+ */
+extern void fractal_pool_free(fractal_pool_t *pool);
+
+/**
+ * Sets the cores shared by the workers of every pool of the process,
+ * 0 for the number of online CPUs (the default)
+ */
+extern void fractal_pool_set_budget(int cores);
+
+/**
+ * Cores shared by the workers of every pool
+ */
+extern int fractal_pool_get_budget();
+
+/**
+ * Waits until one of the cores of the budget is free and takes it, it
+ * must be given back with fractal_pool_release_core
+ */
+extern void fractal_pool_acquire_core();
+
+extern void fractal_pool_release_core();
+
+#endif /* FRACTAL_POOL_H */
@@ -0,0 +1,307 @@
+#include "fractal_pyramid.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fractal_png.h"
+
+// room for "_files/", the level, the tile and the extension
+#define PYRAMID_PATH_EXTRA 64
+
+// private functions
+static char *pyramid_path(const fractal_pyramid_t *pyramid, const char *format,
+                          int level, int col, int row);
+static int pyramid_mkdir(const char *path);
+static char *pyramid_read_text(const char *path);
+static int pyramid_write_text(const char *path, const char *text);
+static void pyramid_remove_tiles(const fractal_pyramid_t *pyramid);
+
+fractal_pyramid_t *fractal_pyramid_open(const char *filename, int width,
+                                        int height, const char *settings,
+                                        int png_level,
+                                        fractal_png_filter_t filter) {
+    size_t length = strlen(filename);
+    char *path, *saved;
+    int size, failed = 0;
+
+    if (width < 1 || height < 1)
+        return NULL;
+
+    fractal_pyramid_t *pyramid = calloc(1, sizeof(fractal_pyramid_t));
+    if (length > 4 && !strcmp(filename + length - 4, ".dzi"))
+        length -= 4;
+    pyramid->name = malloc(length + 1);
+    memcpy(pyramid->name, filename, length);
+    pyramid->name[length] = '\0';
+    pyramid->width = width;
+    pyramid->height = height;
+    pyramid->png_level = png_level;
+    pyramid->png_filter = filter;
+
+    // the first level is a single pixel
+    size = width > height ? width : height;
+    for (pyramid->levels = 1; size > 1; pyramid->levels++)
+        size = (size + 1) / 2;
+
+    // the image is not complete until the .dzi is written again
+    path = pyramid_path(pyramid, "%s.dzi", 0, 0, 0);
+    remove(path);
+    free(path);
+
+    path = pyramid_path(pyramid, "%s_files", 0, 0, 0);
+    failed = pyramid_mkdir(path);
+    free(path);
+
+    // the tiles of other settings are removed before the new settings are
+    // saved, an interruption leaves no settings and removes them again
+    path = pyramid_path(pyramid, "%s_files/settings", 0, 0, 0);
+    saved = failed ? NULL : pyramid_read_text(path);
+    pyramid->resume = saved && !strcmp(saved, settings);
+    if (!failed && !pyramid->resume) {
+        remove(path);
+        pyramid_remove_tiles(pyramid);
+        failed = pyramid_write_text(path, settings);
+    }
+    free(saved);
+    free(path);
+
+    for (int level = 0; level < pyramid->levels && !failed; level++) {
+        path = pyramid_path(pyramid, "%s_files/%d", level, 0, 0);
+        failed = pyramid_mkdir(path);
+        free(path);
+    }
+
+    if (failed) {
+        fractal_pyramid_close(pyramid, 0);
+        return NULL;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, " [DD] Pyramid of %d levels%s\n", pyramid->levels,
+            pyramid->resume ? ", resumed" : "");
+#endif
+
+    return pyramid;
+}
+
+void fractal_pyramid_level_size(const fractal_pyramid_t *pyramid, int level,
+                                int *width, int *height) {
+    int shift = pyramid->levels - 1 - level;
+
+    // ceil(size / 2^shift), like halving it 'shift' times
+    *width = (int)(((long)pyramid->width + (1L << shift) - 1) >> shift);
+    *height = (int)(((long)pyramid->height + (1L << shift) - 1) >> shift);
+}
+
+void fractal_pyramid_tile_size(const fractal_pyramid_t *pyramid, int level,
+                               int col, int row, int *width, int *height) {
+    int x = col * FRACTAL_PYRAMID_TILE, y = row * FRACTAL_PYRAMID_TILE;
+
+    fractal_pyramid_level_size(pyramid, level, width, height);
+    *width = *width - x < FRACTAL_PYRAMID_TILE ? *width - x
+                                               : FRACTAL_PYRAMID_TILE;
+    *height = *height - y < FRACTAL_PYRAMID_TILE ? *height - y
+                                                 : FRACTAL_PYRAMID_TILE;
+    if (*width <= 0 || *height <= 0)
+        *width = *height = 0;
+}
+
+int fractal_pyramid_read_tile(const fractal_pyramid_t *pyramid, int level,
+                              int col, int row, uint8_t *pixels, int stride) {
+    int width, height, result;
+    char *path;
+
+    fractal_pyramid_tile_size(pyramid, level, col, row, &width, &height);
+    if (!pyramid->resume || !width)
+        return -1;
+
+    path = pyramid_path(pyramid, "%s_files/%d/%d_%d.png", level, col, row);
+    result = fractal_png_read(path, width, height, pixels, stride);
+    free(path);
+    return result;
+}
+
+int fractal_pyramid_write_tile(const fractal_pyramid_t *pyramid, int level,
+                               int col, int row, const uint8_t *pixels,
+                               int stride) {
+    char *path, *temporary;
+    int width, height, failed = 0;
+    fractal_png_t *png;
+
+    fractal_pyramid_tile_size(pyramid, level, col, row, &width, &height);
+    if (!width)
+        return -1;
+
+    // a tile is either complete or missing, even after a crash
+    path = pyramid_path(pyramid, "%s_files/%d/%d_%d.png", level, col, row);
+    temporary = malloc(strlen(path) + 5);
+    sprintf(temporary, "%s.tmp", path);
+
+    png = fractal_png_open(temporary, width, height, pyramid->png_level,
+                           pyramid->png_filter, 0, NULL, 0);
+    failed = !png;
+    for (int y = 0; y < height && !failed; y++)
+        failed = fractal_png_write(png, pixels + (size_t)y * stride, 1);
+    if (png)
+        failed = fractal_png_close(png, !failed) || failed;
+
+    if (!failed && rename(temporary, path)) {
+        perror("Cannot save the tile");
+        remove(temporary);
+        failed = 1;
+    }
+
+    free(temporary);
+    free(path);
+    return failed ? -1 : 0;
+}
+
+void fractal_pyramid_downsample(const uint8_t *src, int width, int height,
+                                int src_stride, uint8_t *dst,
+                                int dst_stride) {
+    const uint8_t *top, *bottom;
+    uint8_t *out;
+    int right, count, sum;
+
+    for (int y = 0; y < height; y += 2) {
+        top = src + (size_t)y * src_stride;
+        bottom = y + 1 < height ? top + src_stride : NULL;
+        out = dst + (size_t)(y / 2) * dst_stride;
+
+        // the pixels out of the edges are not counted
+        for (int x = 0; x < width; x += 2, out += 3) {
+            right = x + 1 < width;
+            count = (1 + right) * (bottom ? 2 : 1);
+            for (int i = 3 * x; i < 3 * x + 3; i++) {
+                sum = top[i] + (right ? top[i + 3] : 0);
+                if (bottom)
+                    sum += bottom[i] + (right ? bottom[i + 3] : 0);
+                out[i - 3 * x] = (sum + count / 2) / count;
+            }
+        }
+    }
+}
+
+int fractal_pyramid_close(fractal_pyramid_t *pyramid, int complete) {
+    char *path, *text;
+    int failed = 0;
+
+    if (complete) {
+        text = malloc(512);
+        snprintf(text, 512,
+                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\""
+                 " TileSize=\"%d\" Overlap=\"0\" Format=\"png\">\n"
+                 "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+                 "</Image>\n",
+                 FRACTAL_PYRAMID_TILE, pyramid->width, pyramid->height);
+        path = pyramid_path(pyramid, "%s.dzi", 0, 0, 0);
+        failed = pyramid_write_text(path, text);
+        free(path);
+        free(text);
+    }
+
+    free(pyramid->name);
+    free(pyramid);
+    return failed ? -1 : 0;
+}
+
+//      Private functions
+
+/**
+ * Returns a new string with the name of the pyramid and the numbers
+ * 'level', 'col' and 'row' written with 'format', that can ignore them
+ */
+char *pyramid_path(const fractal_pyramid_t *pyramid, const char *format,
+                   int level, int col, int row) {
+    size_t size = strlen(pyramid->name) + PYRAMID_PATH_EXTRA;
+    char *path = malloc(size);
+
+    snprintf(path, size, format, pyramid->name, level, col, row);
+    return path;
+}
+
+/**
+ * Creates a directory if it does not exist, returns -1 on error
+ */
+int pyramid_mkdir(const char *path) {
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        perror("Cannot create the pyramid");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the content of a small text file, NULL if it cannot be read
+ */
+char *pyramid_read_text(const char *path) {
+    FILE *file = fopen(path, "r");
+    char *text;
+    size_t size;
+
+    if (!file)
+        return NULL;
+    text = malloc(4096);
+    size = fread(text, 1, 4095, file);
+    text[size] = '\0';
+    fclose(file);
+    return text;
+}
+
+/**
+ * Replaces a text file, returns -1 on error
+ */
+int pyramid_write_text(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+    int failed = !file;
+
+    if (file) {
+        failed = fputs(text, file) == EOF;
+        failed = fclose(file) != 0 || failed;
+    }
+    if (failed)
+        perror("Cannot save the pyramid");
+    return failed ? -1 : 0;
+}
+
+/**
+ * Removes the tiles (and the directories of the levels) of the last
+ * export with this name, whatever its size was
+ */
+void pyramid_remove_tiles(const fractal_pyramid_t *pyramid) {
+    char *files = pyramid_path(pyramid, "%s_files", 0, 0, 0), *level, *tile;
+    struct dirent *entry, *tile_entry;
+    DIR *dir = opendir(files), *level_dir;
+
+    while (dir && (entry = readdir(dir))) {
+        // the levels are numbers
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+
+        level = malloc(strlen(files) + strlen(entry->d_name) + 2);
+        sprintf(level, "%s/%s", files, entry->d_name);
+        level_dir = opendir(level);
+        while (level_dir && (tile_entry = readdir(level_dir))) {
+            if (tile_entry->d_name[0] == '.')
+                continue;
+            tile = malloc(strlen(level) + strlen(tile_entry->d_name) + 2);
+            sprintf(tile, "%s/%s", level, tile_entry->d_name);
+            remove(tile);
+            free(tile);
+        }
+        if (level_dir)
+            closedir(level_dir);
+        rmdir(level);
+        free(level);
+    }
+
+    if (dir)
+        closedir(dir);
+    free(files);
+}
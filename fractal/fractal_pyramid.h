@@ -0,0 +1,90 @@
+#ifndef FRACTAL_PYRAMID_H
+#define FRACTAL_PYRAMID_H
+
+#include <stdint.h>
+
+#include "fractal.h"
+
+// side of the tiles of every level, the tiles on the right and bottom
+// edges are smaller
+#define FRACTAL_PYRAMID_TILE 256
+
+/**
+ * Deep Zoom image on disk: 'name'.dzi describes it and the tile (col, row)
+ * of the level L is 'name'_files/L/col_row.png. The last level has the
+ * size of the image, every level is half the next one (rounded up) down
+ * to a single pixel. The existing tiles are kept if they were rendered
+ * with the same settings, so an interrupted export can go on
+ */
+typedef struct {
+    char *name; // without ".dzi"
+    int width, height;
+    int levels; // the last one is levels - 1
+    int resume; // the existing tiles have the same settings
+    int png_level;
+    fractal_png_filter_t png_filter;
+} fractal_pyramid_t;
+
+/**
+ * Creates the directories of a width x height pyramid, 'filename' ends
+ * with ".dzi" or not. 'settings' is a text that tells what the tiles
+ * depend on: it is saved with the tiles and the ones rendered with other
+ * settings are removed. The tiles are PNG files with the zlib level
+ * 'png_level' and the filter 'png_filter' (see fractal_png_open).
+ * Returns NULL on error
+ */
+extern fractal_pyramid_t *fractal_pyramid_open(const char *filename,
+                                               int width, int height,
+                                               const char *settings,
+                                               int png_level,
+                                               fractal_png_filter_t filter);
+
+/**
+ * Size of the level 'level'
+ */
+extern void fractal_pyramid_level_size(const fractal_pyramid_t *pyramid,
+                                       int level, int *width, int *height);
+
+/**
+ * Size of the tile (col, row) of the level 'level', 0 x 0 if it is out of
+ * the level
+ */
+extern void fractal_pyramid_tile_size(const fractal_pyramid_t *pyramid,
+                                      int level, int col, int row,
+                                      int *width, int *height);
+
+/**
+ * Reads the tile (col, row) of 'level' in 'pixels', in RGB with a row
+ * every 'stride' bytes. Returns -1 if it has not been written with the
+ * same settings (or at all)
+ */
+extern int fractal_pyramid_read_tile(const fractal_pyramid_t *pyramid,
+                                     int level, int col, int row,
+                                     uint8_t *pixels, int stride);
+
+/**
+ * Writes the tile (col, row) of 'level' from 'pixels', in RGB with a row
+ * every 'stride' bytes. The tile replaces the existing one only when it
+ * is complete. Returns -1 on error. Different tiles can be written at
+ * the same time
+ */
+extern int fractal_pyramid_write_tile(const fractal_pyramid_t *pyramid,
+                                      int level, int col, int row,
+                                      const uint8_t *pixels, int stride);
+
+/**
+ * Halves the width x height RGB image 'src' in 'dst', every pixel is the
+ * average of 2 x 2 pixels (or less on the right and bottom edges).
+ * 'src_stride' and 'dst_stride' are the bytes of their rows
+ */
+extern void fractal_pyramid_downsample(const uint8_t *src, int width,
+                                       int height, int src_stride,
+                                       uint8_t *dst, int dst_stride);
+
+/**
+ * Writes the .dzi file if 'complete' is not 0 (a pyramid without it is
+ * not finished) and frees the pyramid. Returns -1 on error
+ */
+extern int fractal_pyramid_close(fractal_pyramid_t *pyramid, int complete);
+
+#endif /* FRACTAL_PYRAMID_H */
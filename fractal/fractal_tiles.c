@@ -0,0 +1,185 @@
+#include "fractal_tiles.h"
+
+#include <stdlib.h>
+
+// private functions
+static int steal(fractal_tiles_t *tiles, int worker);
+static int tile_at(fractal_tiles_t *tiles, int index);
+static double elapsed(const struct timespec *from, const struct timespec *to);
+
+fractal_tiles_t *fractal_tiles_new(int width, int height, int tile_size,
+                                   int workers) {
+    if (width < 1 || height < 1 || tile_size < 1 || workers < 1)
+        return NULL;
+
+    fractal_tiles_t *tiles = malloc(sizeof(fractal_tiles_t));
+    tiles->width = width;
+    tiles->height = height;
+    tiles->tile_size = tile_size;
+    tiles->columns = (width + tile_size - 1) / tile_size;
+    tiles->rows = (height + tile_size - 1) / tile_size;
+    tiles->count = tiles->columns * tiles->rows;
+    tiles->workers = workers;
+    tiles->deques = malloc(sizeof(fractal_tile_deque_t) * workers);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&tiles->deques[i].lock, NULL);
+    }
+
+    fractal_tiles_reset(tiles);
+    return tiles;
+}
+
+void fractal_tiles_reset(fractal_tiles_t *tiles) {
+    fractal_tile_deque_t *deque;
+
+    clock_gettime(CLOCK_MONOTONIC, &tiles->start);
+    for (int i = 0; i < tiles->workers; i++) {
+        deque = tiles->deques + i;
+        pthread_mutex_lock(&deque->lock);
+        deque->begin = (int)((long)tiles->count * i / tiles->workers);
+        deque->end = (int)((long)tiles->count * (i + 1) / tiles->workers);
+        deque->steals = 0;
+        deque->done = tiles->start;
+        pthread_mutex_unlock(&deque->lock);
+    }
+}
+
+int fractal_tiles_next(fractal_tiles_t *tiles, int worker,
+                       fractal_tile_t *tile) {
+    fractal_tile_deque_t *deque = tiles->deques + worker;
+    int index = -1;
+
+    do {
+        pthread_mutex_lock(&deque->lock);
+        if (deque->begin < deque->end)
+            index = deque->begin++;
+        pthread_mutex_unlock(&deque->lock);
+    } while (index < 0 && steal(tiles, worker));
+
+    if (index < 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deque->done);
+        return 0;
+    }
+
+    int size = tiles->tile_size;
+    index = tile_at(tiles, index);
+    tile->x = index % tiles->columns * size;
+    tile->y = index / tiles->columns * size;
+    tile->width = tiles->width - tile->x < size ? tiles->width - tile->x : size;
+    tile->height =
+        tiles->height - tile->y < size ? tiles->height - tile->y : size;
+    return 1;
+}
+
+double fractal_tiles_imbalance(fractal_tiles_t *tiles) {
+    double time, max = 0.0, sum = 0.0;
+
+    for (int i = 0; i < tiles->workers; i++) {
+        time = elapsed(&tiles->start, &tiles->deques[i].done);
+        sum += time;
+        if (time > max)
+            max = time;
+    }
+
+    if (sum <= 0.0)
+        return 0.0;
+    return max * tiles->workers / sum - 1.0;
+}
+
+int fractal_tiles_steals(fractal_tiles_t *tiles) {
+    int steals = 0;
+    for (int i = 0; i < tiles->workers; i++) {
+        steals += tiles->deques[i].steals;
+    }
+    return steals;
+}
+
+void fractal_tiles_free(fractal_tiles_t *tiles) {
+    if (!tiles)
+        return;
+
+    for (int i = 0; i < tiles->workers; i++) {
+        pthread_mutex_destroy(&tiles->deques[i].lock);
+    }
+    free(tiles->deques);
+    free(tiles);
+}
+
+//      Private functions
+
+/**
+ * Moves the second half of the largest block of another worker into the
+ * deque of 'worker'. Returns 0 if every other deque is empty
+ */
+int steal(fractal_tiles_t *tiles, int worker) {
+    fractal_tile_deque_t *victim, *own = tiles->deques + worker;
+    int victim_index, remaining, taken, first;
+
+    while (1) {
+        // look for the largest block, sizes may change while reading them
+        victim_index = -1;
+        remaining = 0;
+        for (int i = 0; i < tiles->workers; i++) {
+            if (i == worker)
+                continue;
+
+            victim = tiles->deques + i;
+            pthread_mutex_lock(&victim->lock);
+            if (victim->end - victim->begin > remaining) {
+                remaining = victim->end - victim->begin;
+                victim_index = i;
+            }
+            pthread_mutex_unlock(&victim->lock);
+        }
+
+        if (victim_index < 0)
+            return 0;
+
+        victim = tiles->deques + victim_index;
+        pthread_mutex_lock(&victim->lock);
+        remaining = victim->end - victim->begin;
+        if (remaining < 1) {
+            // someone else took them, try again
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+
+        taken = (remaining + 1) / 2;
+        victim->end -= taken;
+        first = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+
+        // never hold two locks: the stolen tiles belong to nobody until
+        // they are in the own deque, which is empty and only filled here
+        pthread_mutex_lock(&own->lock);
+        own->begin = first;
+        own->end = first + taken;
+        own->steals++;
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+}
+
+/**
+ * Tile (in row-major order) of the 'index'-th position of the blocks: the
+ * j-th position of every block is one of the tiles j * workers to
+ * (j + 1) * workers - 1, so the workers go through the frame together
+ * from the top and the rows of tiles are completed in order (see
+ * photo_thread). The blocks have 's' or 's + 1' positions
+ */
+int tile_at(fractal_tiles_t *tiles, int index) {
+    int workers = tiles->workers, s = tiles->count / workers;
+    int block = (int)((((long)index + 1) * workers - 1) / tiles->count);
+    int begin = (int)((long)tiles->count * block / workers);
+
+    if (index - begin < s)
+        return (index - begin) * workers + block;
+    // the last position of the longer blocks
+    return s * workers + begin - s * block;
+}
+
+double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) +
+           (to->tv_nsec - from->tv_nsec) / 1e9;
+}
@@ -0,0 +1,73 @@
+#ifndef FRACTAL_TILES_H
+#define FRACTAL_TILES_H
+
+#include <pthread.h>
+#include <time.h>
+
+#define FRACTAL_TILE_SIZE 64
+
+/**
+ * Rectangle of pixels rendered by a single worker
+ */
+typedef struct {
+    int x, y;
+    int width, height;
+} fractal_tile_t;
+
+/**
+ * Tiles owned by a worker: range [begin, end) of tile indices.
+ * The owner takes tiles from 'begin', thieves take them from 'end'
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int begin, end;
+    int steals;            // number of successful steals done by the owner
+    struct timespec done;  // when the worker ran out of tiles
+} fractal_tile_deque_t;
+
+/**
+ * Tile scheduler for a frame, every worker starts with a contiguous block
+ * of tiles and steals half of the largest remaining block when it has
+ * nothing left to do. The blocks are interleaved over the frame, so the
+ * tiles are rendered roughly from the top to the bottom
+ */
+typedef struct {
+    int width, height, tile_size;
+    int columns, rows, count; // tiles per row, per column and total
+    int workers;
+    fractal_tile_deque_t *deques;
+    struct timespec start;
+} fractal_tiles_t;
+
+/**
+ * Creates the scheduler of a width x height frame for 'workers' threads
+ */
+extern fractal_tiles_t *fractal_tiles_new(int width, int height,
+                                          int tile_size, int workers);
+
+/**
+ * Gives every worker its initial block of tiles, call it before each frame
+ */
+extern void fractal_tiles_reset(fractal_tiles_t *tiles);
+
+/**
+ * Gets the next tile for 'worker', stealing from the others if needed.
+ * Returns 0 when there are no tiles left
+ */
+extern int fractal_tiles_next(fractal_tiles_t *tiles, int worker,
+                              fractal_tile_t *tile);
+
+/**
+ * Load imbalance of the last frame: time of the slowest worker divided
+ * by the average time, minus one (0 means perfectly balanced)
+ */
+extern double fractal_tiles_imbalance(fractal_tiles_t *tiles);
+
+/**
+ * Total number of steals done in the last frame
+ */
+extern int fractal_tiles_steals(fractal_tiles_t *tiles);
+
+extern void fractal_tiles_free(fractal_tiles_t *tiles);
+
+#endif /* FRACTAL_TILES_H */
@@ -1,14 +1,23 @@
 #include "video.h"
 #include "../project_variables.h"
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 
 // private functions
+static void *encoder_thread(void *void_ctx);
+static int encode_frame(VideoCtx *ctx, const AVBufferRef *buffer, int stride);
+static AVBufferRef *frame_pool_alloc(void *void_pool, size_t size);
+static double elapsed_since(const struct timespec *start);
 static int close_all(VideoCtx *ctx);
 static int video_stream_init(VideoCtx *ctx, int w, int h, int framerate,
-                             enum AVPixelFormat pix_fmt_src);
+                             enum AVPixelFormat pix_fmt_src,
+                             const VideoEncoderConfig *encoder);
+static AVDictionary *encoder_options(const VideoEncoderConfig *encoder);
 static int audio_stream_init(VideoCtx *ctx);
 static int send_frame(VideoCtx *ctx, AVCodecContext *codec_ctx,
                       AVStream *stream, AVFrame *frame);
@@ -16,9 +25,11 @@ static void fill_test_audio_data(VideoCtx *ctx);
 
 VideoCtx *video_ctx_new(int *result, char *filename, int w, int h,
                         int framerate, enum AVPixelFormat pix_fmt_src,
+                        const VideoEncoderConfig *encoder,
                         AVDictionary *metadata) {
-    VideoCtx *ctx = malloc(sizeof(VideoCtx));
+    VideoCtx *ctx = calloc(1, sizeof(VideoCtx));
     AVFormatContext *mux_ctx = NULL;
+    VideoEncoderConfig defaults = {0};
 
 #ifndef DEBUG
     av_log_set_callback(NULL); // hide debug output
@@ -34,7 +45,8 @@ VideoCtx *video_ctx_new(int *result, char *filename, int w, int h,
     mux_ctx->metadata = metadata;
 
     ctx->mux_ctx = mux_ctx;
-    ret = video_stream_init(ctx, w, h, framerate, pix_fmt_src);
+    ret = video_stream_init(ctx, w, h, framerate, pix_fmt_src,
+                            encoder ? encoder : &defaults);
     if (ret < 0) {
         free(ctx);
         free(mux_ctx);
@@ -78,30 +90,216 @@ VideoCtx *video_ctx_new(int *result, char *filename, int w, int h,
         return NULL;
     }
 
+    // the frames are encoded while the next ones are generated
+    pthread_mutex_init(&ctx->queue_lock, NULL);
+    pthread_cond_init(&ctx->queue_ready, NULL);
+    pthread_cond_init(&ctx->queue_free, NULL);
+    pthread_create(&ctx->encoder, NULL, encoder_thread, ctx);
+
     if (result)
         *result = 0;
     return ctx;
 }
 
-void video_ctx_free(VideoCtx *ctx) {
+int video_ctx_free(VideoCtx *ctx) {
     int res = video_send_frame(ctx, NULL, -1);
-    if (res) {
-        free(ctx);
-        exit(res);
-    }
+
+    pthread_mutex_destroy(&ctx->queue_lock);
+    pthread_cond_destroy(&ctx->queue_ready);
+    pthread_cond_destroy(&ctx->queue_free);
 
     free(ctx);
+    return res;
 }
 
 int video_send_frame(VideoCtx *ctx, const uint8_t *data, int stride) {
+    AVBufferRef *buffer;
     int ret;
+
     if (!ctx || (data && stride < 1))
         return -1;
 
+    if (!data) {
+        // the encoder ends after the queued frames
+        pthread_mutex_lock(&ctx->queue_lock);
+        if (!ctx->queue_end) {
+            ctx->queue_end = 1;
+            pthread_cond_signal(&ctx->queue_ready);
+            pthread_mutex_unlock(&ctx->queue_lock);
+            pthread_join(ctx->encoder, NULL);
+            pthread_mutex_lock(&ctx->queue_lock);
+        }
+        ret = ctx->flush_result;
+        pthread_mutex_unlock(&ctx->queue_lock);
+        return ret;
+    }
+
+    buffer = av_buffer_alloc(video_frame_size(ctx, stride));
+    if (!buffer)
+        return -1;
+    memcpy(buffer->data, data, buffer->size);
+    return video_send_buffer(ctx, buffer, stride);
+}
+
+int video_send_buffer(VideoCtx *ctx, AVBufferRef *buffer, int stride) {
+    VideoQueueFrame *frame;
+    struct timespec start;
+    int ret;
+
+    if (!ctx || !buffer || stride < 1 ||
+        buffer->size < video_frame_size(ctx, stride)) {
+        av_buffer_unref(&buffer);
+        return -1;
+    }
+
+    // backpressure: wait for the encoder
+    pthread_mutex_lock(&ctx->queue_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (ctx->queue_count == VIDEO_QUEUE_FRAMES && !ctx->error)
+        pthread_cond_wait(&ctx->queue_free, &ctx->queue_lock);
+    ctx->stats.send_wait += elapsed_since(&start);
+    ret = ctx->queue_end ? -1 : ctx->error;
+    if (ret < 0) {
+        pthread_mutex_unlock(&ctx->queue_lock);
+        av_buffer_unref(&buffer);
+        return ret;
+    }
+
+    // the encoder releases the buffer when the frame has been encoded
+    frame = &ctx->queue[(ctx->queue_first + ctx->queue_count) %
+                        VIDEO_QUEUE_FRAMES];
+    frame->buffer = buffer;
+    frame->stride = stride;
+    ctx->queue_count++;
+    ctx->depth_sum += ctx->queue_count;
+    ctx->stats.frames++;
+    ctx->stats.queue_depth = (double)ctx->depth_sum / ctx->stats.frames;
+    if (ctx->queue_count > ctx->stats.max_queue_depth)
+        ctx->stats.max_queue_depth = ctx->queue_count;
+    ret = (int)ctx->stats.frames;
+    pthread_cond_signal(&ctx->queue_ready);
+    pthread_mutex_unlock(&ctx->queue_lock);
+
+    return ret;
+}
+
+size_t video_frame_size(VideoCtx *ctx, int stride) {
+    AVCodecContext *video_ctx = ctx->video_ctx;
+
+    if (ctx->sws_ctx)
+        return (size_t)stride * video_ctx->height;
+    return av_image_get_buffer_size(video_ctx->pix_fmt, video_ctx->width,
+                                    video_ctx->height, 1);
+}
+
+void video_get_stats(VideoCtx *ctx, VideoStats *stats) {
+    pthread_mutex_lock(&ctx->queue_lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->queue_lock);
+}
+
+VideoFramePool *video_frame_pool_new(size_t size) {
+    VideoFramePool *pool = calloc(1, sizeof(VideoFramePool));
+
+    pool->pool = av_buffer_pool_init2(size, pool, frame_pool_alloc, NULL);
+    if (!pool->pool) {
+        free(pool);
+        return NULL;
+    }
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+AVBufferRef *video_frame_pool_get(VideoFramePool *pool) {
+    AVBufferRef *buffer;
+
+    // frame_pool_alloc counts under the same lock
+    pthread_mutex_lock(&pool->lock);
+    buffer = av_buffer_pool_get(pool->pool);
+    if (buffer)
+        pool->requests++;
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+void video_frame_pool_counts(VideoFramePool *pool, int64_t *requests,
+                             int64_t *allocations) {
+    pthread_mutex_lock(&pool->lock);
+    *requests = pool->requests;
+    *allocations = pool->allocations;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void video_frame_pool_free(VideoFramePool *pool) {
+    if (!pool)
+        return;
+
+    // the buffers still referenced are freed when they are released
+    av_buffer_pool_uninit(&pool->pool);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+//      Private functions
+
+/**
+ * Encodes the queued frames in order until the end of the video, then
+ * flushes the streams and saves the file
+ */
+void *encoder_thread(void *void_ctx) {
+    VideoCtx *ctx = void_ctx;
+    VideoQueueFrame *frame;
+    struct timespec start;
+    int ret;
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    while (ctx->queue_count || !ctx->queue_end) {
+        if (!ctx->queue_count) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pthread_cond_wait(&ctx->queue_ready, &ctx->queue_lock);
+            ctx->stats.encode_wait += elapsed_since(&start);
+            continue;
+        }
+        frame = &ctx->queue[ctx->queue_first];
+        ret = ctx->error;
+        pthread_mutex_unlock(&ctx->queue_lock);
+
+        // after an error the frames are dropped
+        if (!ret)
+            ret = encode_frame(ctx, frame->buffer, frame->stride);
+        av_buffer_unref(&frame->buffer);
+
+        pthread_mutex_lock(&ctx->queue_lock);
+        if (ret < 0)
+            ctx->error = ret;
+        ctx->queue_first = (ctx->queue_first + 1) % VIDEO_QUEUE_FRAMES;
+        ctx->queue_count--;
+        pthread_cond_signal(&ctx->queue_free);
+    }
+    pthread_mutex_unlock(&ctx->queue_lock);
+
+    ret = encode_frame(ctx, NULL, -1);
+
+    // an error on one of the last queued frames is not returned by any
+    // video_send_buffer, the flush reports it
+    pthread_mutex_lock(&ctx->queue_lock);
+    ctx->flush_result = ctx->error ? ctx->error : ret;
+    pthread_mutex_unlock(&ctx->queue_lock);
+    return NULL;
+}
+
+/**
+ * Converts a frame, encodes and muxes it with the audio up to it, NULL to
+ * flush the streams and save the file. Returns a negative value on error
+ */
+int encode_frame(VideoCtx *ctx, const AVBufferRef *buffer, int stride) {
+    int ret;
+
     AVCodecContext *video_ctx = ctx->video_ctx, *audio_ctx = ctx->audio_ctx;
     AVFrame *frame;
 
-    if (data) {
+    if (buffer) {
         while (av_compare_ts(ctx->audio_pts, audio_ctx->time_base,
                              ctx->video_pts, video_ctx->time_base) < 0) {
             // Write audio frame while muxer requires audio frames instead of
@@ -129,14 +327,31 @@ int video_send_frame(VideoCtx *ctx, const uint8_t *data, int stride) {
                 return ret;
         }
 
+        // the frame refers to a buffer of its own, the encoder keeps a
+        // reference to it while it needs it
         frame = ctx->video_frame;
-        if (av_frame_make_writable(frame) < 0)
+        frame->format = video_ctx->pix_fmt;
+        frame->width = video_ctx->width;
+        frame->height = video_ctx->height;
+        if (ctx->sws_ctx)
+            frame->buf[0] = video_frame_pool_get(ctx->yuv_pool);
+        else
+            frame->buf[0] = av_buffer_ref(buffer); // already in pix_fmt
+        if (!frame->buf[0])
             return -1;
-
-        ret = sws_scale(ctx->sws_ctx, &data, &stride, 0, ctx->video_ctx->height,
-                        frame->data, frame->linesize);
-        if (ret < 0)
-            return ret;
+        av_image_fill_arrays(frame->data, frame->linesize,
+                             frame->buf[0]->data, frame->format,
+                             frame->width, frame->height, 1);
+
+        if (ctx->sws_ctx) {
+            ret = sws_scale(ctx->sws_ctx,
+                            (const uint8_t *const *)&buffer->data, &stride,
+                            0, frame->height, frame->data, frame->linesize);
+            if (ret < 0) {
+                av_frame_unref(frame);
+                return ret;
+            }
+        }
 
         frame->pts = ctx->video_pts++;
     } else {
@@ -149,6 +364,8 @@ int video_send_frame(VideoCtx *ctx, const uint8_t *data, int stride) {
 
     // if data send_frame otherwise flush video frames
     ret = send_frame(ctx, video_ctx, ctx->video_stream, frame);
+    if (frame)
+        av_frame_unref(frame);
     if (ret == -1)
         return -1;
 
@@ -160,7 +377,74 @@ int video_send_frame(VideoCtx *ctx, const uint8_t *data, int stride) {
     return ctx->video_pts;
 }
 
-//      Private functions
+/**
+ * Seconds since 'start' on the monotonic clock
+ */
+double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Options of the encoder for avcodec_open2
+ */
+AVDictionary *encoder_options(const VideoEncoderConfig *encoder) {
+    AVDictionary *opt = NULL;
+    char params[64];
+    int crf = encoder->crf;
+
+    if (encoder->codec == VIDEO_CODEC_FFV1) {
+        // version 3 has the slices and a checksum for every slice, to find
+        // the damage of an archived file
+        av_dict_set(&opt, "level", "3", 0);
+        av_dict_set(&opt, "slicecrc", "1", 0);
+        return opt;
+    }
+
+    if (crf <= 0 && encoder->codec == VIDEO_CODEC_HEVC)
+        crf = VIDEO_CRF;
+    if (crf > 0)
+        av_dict_set_int(&opt, "crf", crf, 0);
+    if (encoder->preset)
+        av_dict_set(&opt, "preset", encoder->preset, 0);
+    if (encoder->tune)
+        av_dict_set(&opt, "tune", encoder->tune, 0);
+
+    // libx265 ignores the threads and the slices of the context
+    if (encoder->codec == VIDEO_CODEC_HEVC &&
+        (encoder->threads > 0 || encoder->slices > 0)) {
+        if (encoder->threads > 0 && encoder->slices > 0)
+            snprintf(params, sizeof(params), "pools=%d:slices=%d",
+                     encoder->threads, encoder->slices);
+        else if (encoder->threads > 0)
+            snprintf(params, sizeof(params), "pools=%d", encoder->threads);
+        else
+            snprintf(params, sizeof(params), "slices=%d", encoder->slices);
+        av_dict_set(&opt, "x265-params", params, 0);
+    }
+
+#ifdef DEBUG
+    snprintf(params, sizeof(params), "%d", crf);
+    fprintf(stderr, " [DD] Encoder: crf %s, preset %s, tune %s\n",
+            crf > 0 ? params : "default",
+            encoder->preset ? encoder->preset : "default",
+            encoder->tune ? encoder->tune : "none");
+#endif
+
+    return opt;
+}
+
+/**
+ * Allocates a buffer of the pool that has none free
+ */
+AVBufferRef *frame_pool_alloc(void *void_pool, size_t size) {
+    VideoFramePool *pool = void_pool;
+
+    pool->allocations++;
+    return av_buffer_alloc(size);
+}
 
 int close_all(VideoCtx *ctx) {
     int ret = av_write_trailer(ctx->mux_ctx);
@@ -175,6 +459,7 @@ int close_all(VideoCtx *ctx) {
     av_frame_free(&ctx->video_frame);
     av_frame_free(&ctx->audio_frame);
     sws_freeContext(ctx->sws_ctx);
+    video_frame_pool_free(ctx->yuv_pool);
     swr_free(&ctx->swr_ctx);
 
     // close I/O
@@ -187,14 +472,20 @@ int close_all(VideoCtx *ctx) {
 }
 
 int video_stream_init(VideoCtx *ctx, int width, int height, int framerate,
-                      enum AVPixelFormat pix_fmt_src) {
+                      enum AVPixelFormat pix_fmt_src,
+                      const VideoEncoderConfig *encoder) {
+    static const enum AVCodecID codec_ids[] = {
+        AV_CODEC_ID_HEVC, AV_CODEC_ID_H264, AV_CODEC_ID_FFV1};
     AVFormatContext *mux_ctx = ctx->mux_ctx;
     ctx->video_pts = 0;
 
     // init stream
     AVCodecContext *video_ctx;
-    const AVCodec *codec = avcodec_find_encoder(VIDEO_CODEC_ID);
+    if ((unsigned)encoder->codec > VIDEO_CODEC_FFV1)
+        return -1;
+    const AVCodec *codec = avcodec_find_encoder(codec_ids[encoder->codec]);
     if (!codec) {
+        fprintf(stderr, " [EE] Video encoder not available\n");
         return -1;
     }
 
@@ -232,8 +523,15 @@ int video_stream_init(VideoCtx *ctx, int width, int height, int framerate,
     // pixel format of video codec: chroma 4:2:0
     video_ctx->pix_fmt = VIDEO_PIX_FMT;
 
-    // keyframe every quarter second
-    video_ctx->gop_size = framerate / 4;
+    // keyframe every quarter second by default
+    video_ctx->gop_size = encoder->gop > 0 ? encoder->gop : framerate / 4;
+
+    // the encoders not in the options (H.264 and FFV1) take the threads
+    // and the slices from the context
+    if (encoder->threads > 0)
+        video_ctx->thread_count = encoder->threads;
+    if (encoder->slices > 0)
+        video_ctx->slices = encoder->slices;
 
     // global header compatibility
     if (mux_ctx->oformat->flags & AVFMT_GLOBALHEADER)
@@ -242,8 +540,7 @@ int video_stream_init(VideoCtx *ctx, int width, int height, int framerate,
 
     // open stream
     int ret;
-    AVDictionary *opt = NULL;
-    av_dict_set_int(&opt, "crf", VIDEO_CRF, 0);
+    AVDictionary *opt = encoder_options(encoder);
     ret = avcodec_open2(video_ctx, codec, &opt);
     av_dict_free(&opt);
     if (ret < 0) {
@@ -255,24 +552,23 @@ int video_stream_init(VideoCtx *ctx, int width, int height, int framerate,
         return ret;
     }
 
+    // the buffers are given to the frame by encode_frame
     AVFrame *frame = av_frame_alloc();
     if (!frame) {
         return -1;
     }
-    frame->format = video_ctx->pix_fmt;
-    frame->width = width;
-    frame->height = height;
-
-    ret = av_frame_get_buffer(frame, 0);
-    if (ret < 0) {
-        return ret;
-    }
-
     ctx->video_frame = frame;
 
-    // crete swscale context
-    ctx->sws_ctx = sws_getContext(width, height, pix_fmt_src, width, height,
-                                  video_ctx->pix_fmt, 0, 0, 0, 0);
+    // crete swscale context, not needed if the frames are already in the
+    // pixel format of the codec
+    if (pix_fmt_src != video_ctx->pix_fmt) {
+        ctx->sws_ctx = sws_getContext(width, height, pix_fmt_src, width,
+                                      height, video_ctx->pix_fmt, 0, 0, 0, 0);
+        ctx->yuv_pool = video_frame_pool_new(av_image_get_buffer_size(
+            video_ctx->pix_fmt, width, height, 1));
+        if (!ctx->yuv_pool)
+            return -1;
+    }
 
     return 0;
 }
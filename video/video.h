@@ -3,13 +3,83 @@
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define VIDEO_CODEC_ID AV_CODEC_ID_HEVC
 #define VIDEO_PIX_FMT AV_PIX_FMT_YUV420P
+
+// quality of HEVC if the configuration does not say, the other codecs use
+// the default of their encoder
 #define VIDEO_CRF 28
 
+/**
+ * Codec of the video stream
+ */
+typedef enum VideoCodec {
+    VIDEO_CODEC_HEVC,
+    VIDEO_CODEC_H264,
+    VIDEO_CODEC_FFV1 // lossless, needs a container like Matroska
+} VideoCodec;
+
+/**
+ * Settings of the video encoder, 0 or NULL for the defaults
+ */
+typedef struct VideoEncoderConfig {
+    VideoCodec codec;
+
+    // of x264 and x265, like "ultrafast" or "veryslow" and "animation"
+    const char *preset;
+    const char *tune;
+
+    int crf;     // quality, lower is better (not used by FFV1)
+    int gop;     // frames between keyframes, a quarter second by default
+    int threads; // of the encoder, it chooses them by default
+    int slices;  // of every frame, encoded independently
+} VideoEncoderConfig;
+
+// frames waiting for the encoder, video_send_frame blocks when the queue
+// is full
+#define VIDEO_QUEUE_FRAMES 3
+
+/**
+ * Frame waiting for the encoder, in the source pixel format
+ */
+typedef struct VideoQueueFrame {
+    AVBufferRef *buffer; // released by the encoder
+    int stride;
+} VideoQueueFrame;
+
+/**
+ * Frame buffers of the same size reused through an AVBufferPool: a buffer
+ * goes back to the pool when its last reference is released, by the
+ * encoder or by whoever took it, even after the end of the video
+ */
+typedef struct VideoFramePool {
+    AVBufferPool *pool;
+    size_t size;
+    pthread_mutex_t lock;
+    int64_t requests;    // buffers taken from the pool
+    int64_t allocations; // buffers allocated because none was free
+} VideoFramePool;
+
+/**
+ * Statistics of the queue of the encoder since the video started
+ */
+typedef struct VideoStats {
+    int64_t frames; // queued frames
+
+    // frames in the queue when a frame is added (counting it)
+    double queue_depth; // average
+    int max_queue_depth;
+
+    // seconds video_send_frame waited for room in the queue (the encoder
+    // is slower) and the encoder waited for frames (the caller is slower)
+    double send_wait;
+    double encode_wait;
+} VideoStats;
+
 /**
  * Main struct used to encode and mux videos
  */
@@ -19,9 +89,10 @@ typedef struct VideoCtx {
     // video properties
     AVCodecContext *video_ctx;
     AVStream *video_stream;
-    AVFrame *video_frame;
+    AVFrame *video_frame; // refers to the buffer being encoded
     int64_t video_pts;
     struct SwsContext *sws_ctx;
+    VideoFramePool *yuv_pool; // frames converted by sws_ctx
 
     // audio properties
     AVCodecContext *audio_ctx;
@@ -30,6 +101,20 @@ typedef struct VideoCtx {
     int64_t audio_pts;
     struct SwrContext *swr_ctx;
     uint16_t *src_audio_data;
+
+    // encoder thread: the frames are queued by video_send_frame and
+    // converted, encoded and muxed by the thread in order
+    pthread_t encoder;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_ready; // signaled when a frame is queued or at the end
+    pthread_cond_t queue_free;  // signaled when a frame has been encoded
+    VideoQueueFrame queue[VIDEO_QUEUE_FRAMES];
+    int queue_first, queue_count;
+    int queue_end; // no more frames, the encoder flushes the streams
+    int error;     // first error of the encoder, the next frames are dropped
+    int flush_result;
+    int64_t depth_sum;
+    VideoStats stats;
 } VideoCtx;
 
 /**
@@ -37,22 +122,71 @@ typedef struct VideoCtx {
  * result: if not NULL the operation result
  * filename: The name of the file where save the video
  * w, h, framerate: Width, Height and video framerate
- * pix_fmt_src: Source pixel format
+ * pix_fmt_src: Source pixel format, VIDEO_PIX_FMT to skip the conversion
+ * encoder: Settings of the video encoder, NULL for the defaults
  * metadata: Muxer metadata
  * Returns the video context with result = 0, or NULL if error with result != 0
  */
 extern VideoCtx *video_ctx_new(int *result, char *filename, int w, int h,
                                int framerate, enum AVPixelFormat pix_fmt_src,
+                               const VideoEncoderConfig *encoder,
                                AVDictionary *metadata);
 
 /**
- * Send a NULL frame to video_send_frame and free ctx
+ * Send a NULL frame to video_send_frame and free ctx, returns 0 if every
+ * frame has been encoded and the file has been saved
  */
-extern void video_ctx_free(VideoCtx *ctx);
+extern int video_ctx_free(VideoCtx *ctx);
 
 /**
- * Send a frame to encoder, NULL to stop and save
+ * Queues a copy of a frame for the encoder thread (see video_send_buffer).
+ * NULL waits for the queued frames, flushes the encoder and saves the
+ * file, returning 0 on success
  */
 extern int video_send_frame(VideoCtx *ctx, const uint8_t *data, int stride);
 
+/**
+ * Queues a frame for the encoder thread without copying it, waiting while
+ * the queue is full, and returns the number of queued frames. The
+ * reference to 'buffer' is taken over and released when the frame has
+ * been encoded, so the buffer must not be written anymore. A frame in
+ * VIDEO_PIX_FMT has its planes one after the other without padding (see
+ * av_image_fill_arrays with align 1) and 'stride' is ignored. An error of
+ * the encoder is returned by the next call
+ */
+extern int video_send_buffer(VideoCtx *ctx, AVBufferRef *buffer, int stride);
+
+/**
+ * Bytes of a frame in the source pixel format with 'stride'
+ */
+extern size_t video_frame_size(VideoCtx *ctx, int stride);
+
+/**
+ * Copy the statistics of the queue of the encoder
+ */
+extern void video_get_stats(VideoCtx *ctx, VideoStats *stats);
+
+/**
+ * Creates a pool of frame buffers of 'size' bytes. Returns NULL on error
+ */
+extern VideoFramePool *video_frame_pool_new(size_t size);
+
+/**
+ * Takes a buffer of the pool, a free one if there is any. Returns NULL on
+ * error
+ */
+extern AVBufferRef *video_frame_pool_get(VideoFramePool *pool);
+
+/**
+ * Copies the number of buffers taken from the pool and of those that have
+ * been allocated, the others reused a buffer
+ */
+extern void video_frame_pool_counts(VideoFramePool *pool, int64_t *requests,
+                                    int64_t *allocations);
+
+/**
+ * Frees the pool, its buffers are freed when they are released
+ */
+extern void video_frame_pool_free(VideoFramePool *pool);
+
 #endif /* VIDEO_H */